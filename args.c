@@ -25,16 +25,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <linux/videodev2.h>
+#include <media/msm_vidc.h>
 
 #include "common.h"
 #include "version.h"
 
-int debug_level;
-
 void print_usage(char *name)
 {
 	fprintf(stderr, "v4l2_decode version " VERSION " date " DATE "\n\n");
-	fprintf(stderr, "usage: %s [OPTS] <URL>\n", name);
+	fprintf(stderr, "usage: %s [OPTS] <URL> [<URL>...]\n", name);
 	fprintf(stderr, "Where OPTS is a combination of:\n"
 	        "  -m <device>     video device (default /dev/video32)\n"
 	        "  -c              set \"continue data transfer\" flag\n"
@@ -45,7 +46,167 @@ void print_usage(char *name)
 	        "  -s              secure mode\n"
 	        "  -v              increase debug verbosity\n"
 	        "  -q              remove all debug output\n"
-		"\n");
+	        "  -z              convert and write packets directly into\n"
+	        "                  OUTPUT buffers, bypassing the bitstream filter\n"
+	        "                  (default)\n"
+	        "  --bsf           convert H.264 and HEVC packets with the\n"
+	        "                  libavcodec bitstream filter instead\n"
+	        "  --low-latency   for live sources: output frames in decode\n"
+	        "                  order, probe little, keep at most %d packets\n"
+	        "                  in the decoder and always show the newest\n"
+	        "                  frame, the latency of each is logged\n"
+	        "  --bench         decode as fast as possible without display\n"
+	        "                  and report the throughput\n"
+	        "  --report <file> write the counters, the frame latency, the\n"
+	        "                  CPU time and the peak ION memory as JSON to\n"
+	        "                  file on exit, - for stdout\n"
+	        "  --latency       report per stage frame latency on exit, the\n"
+	        "                  report can also be requested with SIGUSR1\n"
+	        "  --queue-bytes <n>\n"
+	        "                  read ahead at most n bytes of the stream\n"
+	        "                  (default %d)\n"
+	        "  --queue-ms <n>  read ahead at most n ms of the stream\n"
+	        "                  (default %d)\n"
+	        "  --probesize <n> read at most n bytes of the stream to find its\n"
+	        "                  parameters, 0 for the libavformat default\n"
+	        "                  (default %d)\n"
+	        "  --dump <file>   write the decoded frames to file as raw NV12,\n"
+	        "                  or P010 for 10-bit streams, instead of\n"
+	        "                  displaying them, - for stdout\n"
+	        "  --dump-scale <n>\n"
+	        "                  keep one sample out of n in both directions\n"
+	        "                  in the frames dumped\n"
+	        "  --index <file>  decode only the keyframes, as fast as\n"
+	        "                  possible, and list them in file, one per\n"
+	        "                  line: PTS in us, byte offset of the packet\n"
+	        "                  (-1 if unknown) and WxH size of the frame,\n"
+	        "                  as dumped when combined with --dump\n"
+	        "  --checksum <file>\n"
+	        "                  write the PTS and CRC-32 of the visible area\n"
+	        "                  of each decoded frame to file, - for stdout\n"
+	        "  --trace <file>  record buffer and presentation events, and\n"
+	        "                  write them to file in the Chrome JSON trace\n"
+	        "                  format on exit\n"
+	        "  --trace-marker  also write each event to the ftrace marker\n"
+	        "  --stats-socket <path>\n"
+	        "                  serve the live counters as JSON on a unix\n"
+	        "                  socket, they are also written to stderr on\n"
+	        "                  SIGUSR2\n"
+	        "  --playlist <file>\n"
+	        "                  play the urls listed in file, one per line,\n"
+	        "                  after the ones given, one after the other\n"
+	        "                  in a single decoding session\n"
+	        "  --loop          start over once all the urls were played\n"
+	        "  --codec <codec> codec of the stream on the standard input,\n"
+	        "                  h264 or hevc\n"
+	        "  --size <w>x<h>  size of an ingested stream, when its source\n"
+	        "                  does not tell\n"
+	        "  --fps <n>       frame rate of an ingested stream, when its\n"
+	        "                  source does not tell (default %d)\n"
+	        "  --perf-level <level>\n"
+	        "                  decoder clock level, one of nominal,\n"
+	        "                  performance, turbo or auto to follow the\n"
+	        "                  stream and decoding rate (default auto)\n"
+		"\n", LOW_LATENCY_OUT_QUEUED, PKTQ_DEFAULT_BYTES, PKTQ_DEFAULT_MS, PROBE_DEFAULT_SIZE,
+		INGEST_DEFAULT_FPS);
+	fprintf(stderr, "The URL can also be - to ingest an Annex-B stream from "
+		"the standard input,\nor shm:<path> or fd:<n> to ingest a "
+		"ring of access units in shared memory.\n\n");
+}
+
+enum {
+	OPT_BENCH = 256,
+	OPT_LATENCY,
+	OPT_QUEUE_BYTES,
+	OPT_QUEUE_MS,
+	OPT_DUMP,
+	OPT_CHECKSUM,
+	OPT_TRACE,
+	OPT_TRACE_MARKER,
+	OPT_STATS_SOCKET,
+	OPT_PERF_LEVEL,
+	OPT_PLAYLIST,
+	OPT_LOOP,
+	OPT_PROBESIZE,
+	OPT_LOW_LATENCY,
+	OPT_CODEC,
+	OPT_SIZE,
+	OPT_FPS,
+	OPT_REPORT,
+	OPT_BSF,
+	OPT_DUMP_SCALE,
+	OPT_INDEX,
+};
+
+static const struct option long_options[] = {
+	{ "bench", no_argument, NULL, OPT_BENCH },
+	{ "latency", no_argument, NULL, OPT_LATENCY },
+	{ "queue-bytes", required_argument, NULL, OPT_QUEUE_BYTES },
+	{ "queue-ms", required_argument, NULL, OPT_QUEUE_MS },
+	{ "dump", required_argument, NULL, OPT_DUMP },
+	{ "checksum", required_argument, NULL, OPT_CHECKSUM },
+	{ "trace", required_argument, NULL, OPT_TRACE },
+	{ "trace-marker", no_argument, NULL, OPT_TRACE_MARKER },
+	{ "stats-socket", required_argument, NULL, OPT_STATS_SOCKET },
+	{ "perf-level", required_argument, NULL, OPT_PERF_LEVEL },
+	{ "playlist", required_argument, NULL, OPT_PLAYLIST },
+	{ "loop", no_argument, NULL, OPT_LOOP },
+	{ "probesize", required_argument, NULL, OPT_PROBESIZE },
+	{ "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+	{ "codec", required_argument, NULL, OPT_CODEC },
+	{ "size", required_argument, NULL, OPT_SIZE },
+	{ "fps", required_argument, NULL, OPT_FPS },
+	{ "report", required_argument, NULL, OPT_REPORT },
+	{ "bsf", no_argument, NULL, OPT_BSF },
+	{ "dump-scale", required_argument, NULL, OPT_DUMP_SCALE },
+	{ "index", required_argument, NULL, OPT_INDEX },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Append the urls listed in a playlist file to the ones given, empty
+ * lines and lines starting with # are skipped */
+static int read_playlist(struct instance *i, const char *path)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	f = fopen(path, "r");
+	if (!f) {
+		err("failed to open playlist %s: %m\n", path);
+		return -1;
+	}
+
+	while ((len = getline(&line, &size, f)) >= 0) {
+		char **urls;
+
+		while (len > 0 && strchr(" \t\r\n", line[len - 1]))
+			line[--len] = '\0';
+
+		if (!len || line[0] == '#')
+			continue;
+
+		urls = realloc(i->urls, (i->url_count + 1) * sizeof (*urls));
+		if (!urls) {
+			err("failed to allocate playlist\n");
+			break;
+		}
+
+		i->urls = urls;
+		i->urls[i->url_count++] = strdup(line);
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!i->url_count) {
+		err("playlist %s is empty\n", path);
+		return -1;
+	}
+
+	return 0;
 }
 
 int parse_args(struct instance *i, int argc, char **argv)
@@ -55,10 +216,18 @@ int parse_args(struct instance *i, int argc, char **argv)
 	memset(i, 0, sizeof (*i));
 
 	i->video.name = "/dev/video32";
+	i->queue_bytes = PKTQ_DEFAULT_BYTES;
+	i->queue_ms = PKTQ_DEFAULT_MS;
+	i->probesize = -1;	/* set once the options are parsed */
+	i->perf.mode = PERF_AUTO;
+	i->ubwc = 1;
+	i->ubwc_10bit = 1;
+	i->direct_write = 1;
 
 	debug_level = 2;
 
-	while ((c = getopt(argc, argv, "cdfhim:o:pqsv")) != -1) {
+	while ((c = getopt_long(argc, argv, "cdfhim:o:pqsvz", long_options,
+				NULL)) != -1) {
 		switch (c) {
 		case 'c':
 			i->continue_data_transfer = 1;
@@ -87,6 +256,115 @@ int parse_args(struct instance *i, int argc, char **argv)
 		case 'v':
 			debug_level++;
 			break;
+		case 'z':
+			i->direct_write = 1;
+			break;
+		case OPT_BSF:
+			i->direct_write = 0;
+			break;
+		case OPT_DUMP_SCALE:
+			i->dump_scale = atoi(optarg);
+			if (i->dump_scale < 1) {
+				err("invalid dump scale %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_INDEX:
+			/* the keyframes are all the decoder gets, and they
+			 * come out as soon as decoded */
+			i->index_path = optarg;
+			i->keyframes = 1;
+			i->skip_frames = 1;
+			i->decode_order = 1;
+			break;
+		case OPT_BENCH:
+			i->bench = 1;
+			break;
+		case OPT_LATENCY:
+			i->latency_report = 1;
+			break;
+		case OPT_LOW_LATENCY:
+			i->low_latency = 1;
+			i->decode_order = 1;
+			i->latency_report = 1;
+			break;
+		case OPT_QUEUE_BYTES:
+			i->queue_bytes = atoi(optarg);
+			if (i->queue_bytes <= 0) {
+				err("invalid queue size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_QUEUE_MS:
+			i->queue_ms = atoi(optarg);
+			if (i->queue_ms <= 0) {
+				err("invalid queue duration %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_DUMP:
+			i->dump_path = optarg;
+			break;
+		case OPT_CHECKSUM:
+			i->checksum_path = optarg;
+			break;
+		case OPT_TRACE:
+			i->trace_path = optarg;
+			break;
+		case OPT_TRACE_MARKER:
+			i->trace_marker = 1;
+			break;
+		case OPT_STATS_SOCKET:
+			i->stats_socket = optarg;
+			break;
+		case OPT_REPORT:
+			i->report_path = optarg;
+			break;
+		case OPT_PERF_LEVEL:
+			i->perf.mode = perf_level_from_string(optarg);
+			if (i->perf.mode == -2) {
+				err("invalid perf level %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_PLAYLIST:
+			i->playlist = optarg;
+			break;
+		case OPT_LOOP:
+			i->loop = 1;
+			break;
+		case OPT_CODEC:
+			if (!strcmp(optarg, "h264")) {
+				i->fourcc = V4L2_PIX_FMT_H264;
+			} else if (!strcmp(optarg, "hevc")) {
+				i->fourcc = V4L2_PIX_FMT_HEVC;
+			} else {
+				err("unsupported codec %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_SIZE:
+			if (sscanf(optarg, "%dx%d", &i->width, &i->height) != 2 ||
+			    i->width <= 0 || i->height <= 0) {
+				err("invalid size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_FPS:
+			i->fps_n = atoi(optarg);
+			i->fps_d = 1;
+			if (i->fps_n <= 0) {
+				err("invalid frame rate %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_PROBESIZE:
+			i->probesize = atoi(optarg);
+			if (i->probesize < 0) {
+				err("invalid probe size %s\n", optarg);
+				return -1;
+			}
+			break;
 		default:
 			err("bad argument\n");
 		case 'h':
@@ -94,12 +372,41 @@ int parse_args(struct instance *i, int argc, char **argv)
 		}
 	}
 
+	/* whatever the order of the options, --probesize wins */
+	if (i->probesize < 0)
+		i->probesize = i->low_latency ? LOW_LATENCY_PROBE_SIZE :
+			PROBE_DEFAULT_SIZE;
+
+	if (i->playlist) {
+		/* the playlist is the only instance */
+		i->url_count = argc - optind;
+		i->urls = malloc(MAX(i->url_count, 1) * sizeof (*i->urls));
+		if (!i->urls)
+			return -1;
+
+		memcpy(i->urls, &argv[optind], i->url_count * sizeof (char *));
+
+		if (read_playlist(i, i->playlist))
+			return -1;
+
+		i->url = i->urls[0];
+		return 0;
+	}
+
 	if (optind >= argc) {
 		err("missing url to play\n");
 		return -1;
 	}
 
+	if (argc - optind > MAX_INSTANCES) {
+		err("too many urls, at most %d streams can be decoded\n",
+		    MAX_INSTANCES);
+		return -1;
+	}
+
 	i->url = argv[optind];
+	i->urls = &argv[optind];
+	i->url_count = argc - optind;
 
 	return 0;
 }
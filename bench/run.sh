@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# V4L2 Codec decoding example application
+#
+# Benchmark harness: decode each stream of a matrix headless, a number
+# of times, and write the report of each run as a line of JSON. The
+# first line describes the system the benchmark ran on.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+set -eu
+
+if [ $# -ne 5 ]; then
+	echo "usage: $0 <decoder> <matrix> <media dir> <runs> <results>" >&2
+	exit 1
+fi
+
+decoder=$1
+matrix=$2
+media=$3
+runs=$4
+results=$5
+
+report=$(mktemp)
+trap 'rm -f "$report"' EXIT
+
+printf '{"kernel":"%s","machine":"%s","date":"%s","runs":%d}\n' \
+	"$(uname -r)" "$(uname -m)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+	"$runs" > "$results"
+
+grep -v '^[[:space:]]*#' "$matrix" | while read -r name file opts; do
+	[ -n "$name" ] || continue
+
+	if [ ! -f "$media/$file" ]; then
+		echo "$name: $media/$file not found, skipped" >&2
+		printf '{"stream":"%s","skipped":true}\n' "$name" >> "$results"
+		continue
+	fi
+
+	run=1
+	while [ "$run" -le "$runs" ]; do
+		echo "$name: run $run/$runs" >&2
+		rm -f "$report"
+
+		# the options are split on purpose, the standard input
+		# would otherwise be read for keys
+		if "$decoder" -q --bench --report "$report" $opts \
+		   "$media/$file" < /dev/null >&2 && [ -s "$report" ]; then
+			printf '{"stream":"%s","file":"%s","run":%d,' \
+				"$name" "$file" "$run" >> "$results"
+			printf '"result":%s}\n' "$(cat "$report")" >> "$results"
+		else
+			echo "$name: run $run failed" >&2
+			printf '{"stream":"%s","file":"%s","run":%d,"failed":true}\n' \
+				"$name" "$file" "$run" >> "$results"
+		fi
+
+		run=$((run + 1))
+	done
+done
+
+echo "results written to $results" >&2
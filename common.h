@@ -27,14 +27,25 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <termios.h>
+#include <time.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 
 #include "display.h"
+#include "dump.h"
+#include "ingest.h"
 #include "list.h"
-
+#include "perf.h"
+#include "pktq.h"
+#include "ring.h"
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Only written while parsing the arguments or opening a library session,
+ * before any decoding thread is started, so all the instances can read it
+ * without locking */
 extern int debug_level;
 
 #define ARRAY_LENGTH(x) (sizeof (x) / sizeof (*(x)))
@@ -55,9 +66,20 @@ extern int debug_level;
 	print(3, DBG_TAG ": " msg "\n", ##__VA_ARGS__)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define memzero(x)	memset(&(x), 0, sizeof (x));
 
+static inline uint64_t
+time_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /* Maximum number of output buffers */
 #define MAX_OUT_BUF		16
 
@@ -70,9 +92,93 @@ extern int debug_level;
 /* Number of capture planes */
 #define CAP_PLANES		2
 
+/* Maximum number of streams decoded at the same time */
+#define MAX_INSTANCES		8
+
+/* Default amount of data read to find the stream parameters, and the
+ * stream duration analyzed at most then */
+#define PROBE_DEFAULT_SIZE	(1024 * 1024)
+#define PROBE_ANALYZE_US	1000000
+
+/* Live sources in low latency mode: the parameters come from the first
+ * frames, and few enough packets are in flight for the decoder to always
+ * work on the newest one */
+#define LOW_LATENCY_PROBE_SIZE	32768
+#define LOW_LATENCY_ANALYZE_US	100000
+#define LOW_LATENCY_OUT_QUEUED	2
+
 /* Maximum number of planes used in the application */
 #define MAX_PLANES		CAP_PLANES
 
+/* Maximum number of pending timestamps, enough for all the packets
+ * queued on OUTPUT plus the frames held by the decoder for reordering.
+ * Must be a power of two. */
+#define MAX_PENDING_TS		64
+
+/* Timestamps of a packet queued for decoding */
+struct ts_entry {
+	uint64_t pts;
+	uint64_t dts;
+	uint64_t duration;
+	uint64_t base;		/* start of the clip, in decoder time */
+	uint64_t offset;	/* start of the clip, in playlist time */
+	int64_t pos;		/* of the packet in the file, -1 if unknown */
+};
+
+/* Timing of a packet queued for decoding, looked up by PTS */
+struct ts_times {
+	uint64_t pts;
+	struct frame_times times;
+};
+
+/* Timestamps and timing of a queued packet, sent by the parser thread */
+struct ts_record {
+	struct ts_entry ts;
+	struct frame_times times;
+};
+
+/* Metadata of a decoded frame, from its extradata */
+#define EXTRADATA_CROP			(1 << 0)
+#define EXTRADATA_ASPECT_RATIO		(1 << 1)
+#define EXTRADATA_INTERLACE		(1 << 2)
+#define EXTRADATA_FRAME_RATE		(1 << 3)
+#define EXTRADATA_MASTERING_DISPLAY	(1 << 4)
+#define EXTRADATA_LIGHT_LEVEL		(1 << 5)
+
+struct extradata_info {
+	unsigned int flags;	/* EXTRADATA_* found */
+	unsigned int crop_x, crop_y, crop_w, crop_h;
+	unsigned int ar_x, ar_y;
+	unsigned int interlace;		/* enum msm_vidc_interlace_type */
+	unsigned int frame_rate;	/* in 1/0x10000 fps */
+	struct msm_vidc_mastering_display_colour_sei_payload mastering;
+	struct msm_vidc_content_light_level_sei_payload light_level;
+};
+
+/* The CPU side buffers of an instance are carved out of a few ION
+ * regions, each holding a handful of chunks */
+#define ION_ARENA_REGIONS	4
+#define ION_REGION_CHUNKS	4
+
+struct ion_chunk {
+	size_t offset;
+	size_t size;
+};
+
+struct ion_region {
+	int fd;
+	void *addr;
+	size_t size;		/* 0 when the region is not allocated */
+	int chunk_count;
+	struct ion_chunk chunks[ION_REGION_CHUNKS];	/* by offset */
+};
+
+struct ion_arena {
+	struct ion_region regions[ION_ARENA_REGIONS];
+	size_t size;		/* of the regions */
+	size_t used;		/* by the chunks */
+};
+
 /* video decoder related parameters */
 struct video {
 	char *name;
@@ -81,11 +187,17 @@ struct video {
 	/* Output queue related */
 	int out_buf_cnt;
 	int out_buf_size;
+	uint32_t out_fourcc;
+	int out_max_queued;		/* buffers in flight at most, 0 for all */
 	int out_buf_off[MAX_OUT_BUF];
 	char *out_buf_addr[MAX_OUT_BUF];
-	int out_buf_flag[MAX_OUT_BUF];
-	int out_ion_fd;
+	int out_buf_flag[MAX_OUT_BUF];	/* only used by the parser thread */
+	uint32_t out_buf_seq[MAX_OUT_BUF];
+	uint32_t out_seq;
+	int out_head;
+	int out_ion_fd;			/* of the arena region */
 	int out_ion_size;
+	size_t out_ion_off;		/* of the slab in the region */
 	void *out_ion_addr;
 
 	/* Capture queue related */
@@ -100,25 +212,77 @@ struct video {
 	int cap_buf_size;
 	int cap_buf_fd[MAX_CAP_BUF];
 	void *cap_buf_addr[MAX_CAP_BUF];
+	size_t cap_buf_alloc[MAX_CAP_BUF];	/* 0 if not allocated */
 
-	/* timestamp list for all pending frames */
-	struct list_head pending_ts_list;
+	/* timing of the frame held by each capture buffer */
+	struct frame_times cap_times[MAX_CAP_BUF];
+
+	/* OUTPUT buffers released by the decoder, to the parser thread */
+	struct ring out_free;
+	int out_free_data[MAX_OUT_BUF];
+	atomic_int parser_waiting;
+
+	/* timestamps of the queued packets, from the parser thread */
+	struct ring ts_queue;
+	struct ts_record ts_queue_data[MAX_PENDING_TS];
+
+	/* timestamps of all pending frames, a min-heap on the DTS */
+	struct ts_entry pending_ts[MAX_PENDING_TS];
+	int pending_ts_count;
+	/* timing of the pending frames, hashed on the PTS */
+	struct ts_times pending_times[MAX_PENDING_TS];
 	uint64_t cap_last_pts;
 	uint64_t pts_dts_delta;
 
 	/* Extradata stuff */
 	int extradata_index;
 	int extradata_size;
-	int extradata_ion_fd;
+	int extradata_ion_fd;		/* of the arena region */
+	size_t extradata_ion_off;
+	size_t extradata_ion_size;
 	void *extradata_ion_addr;
 	int extradata_off[MAX_CAP_BUF];
 	void *extradata_addr[MAX_CAP_BUF];
+	struct extradata_info extradata_info[MAX_CAP_BUF];
 
 	/* Metrics */
 	unsigned long total_captured;
+	int peak_out_queued;
+	int peak_cap_queued;
+
+	/* queue occupancy, sampled when buffers are queued */
+	int out_queued;
+	int cap_queued;
+	uint64_t out_queued_sum;
+	uint64_t cap_queued_sum;
+	unsigned long out_queued_samples;
+	unsigned long cap_queued_samples;
+
+	uint64_t bytes_queued;		/* stream data fed to the decoder */
+	unsigned long parser_stalls;	/* waits for an OUTPUT buffer */
+	uint64_t parser_stall_time;	/* us */
+
+	/* ION memory of the buffers the instance allocated and still
+	 * owns, the arena regions and the capture buffers, in bytes */
+	uint64_t ion_bytes;
+	uint64_t peak_ion_bytes;
+	struct ion_arena arena;
+
+	/* decoded frames per second over the last second */
+	uint64_t fps_time;
+	unsigned long fps_frames;
+	double fps;
+
+	/* decoder events */
+	unsigned long reconfigures;
+	unsigned long sys_errors;
+	unsigned long hw_overloads;
+	unsigned long hw_unsupported;
+	unsigned long release_unqueued;
 };
 
 struct instance {
+	int id;		/* position on the command line */
 	int width;
 	int height;
 	int fullscreen;
@@ -126,36 +290,106 @@ struct instance {
 	int fps_n, fps_d;
 	int depth;
 	int interlaced;
+	int ubwc;		/* compressed capture usable, 8 and 10-bit */
+	int ubwc_10bit;
 	int decode_order;
+	int low_latency;
 	int skip_frames;
 	int insert_sc;
 	int need_header;
+	int direct_write;
+	int nal_length_size;
 	int secure;
 	int continue_data_transfer;
+	int bench;
+	int latency_report;
+	char *report_path;
+	int queue_bytes;
+	int queue_ms;
+	int probesize;
+	char *dump_path;
+	char *checksum_path;
+	FILE *checksum_file;
+	int dump_scale;		/* one sample out of n dumped, 0 for all */
+
+	/* keyframe index mode: only the keyframes are demuxed and
+	 * decoded, and listed in the index file */
+	int keyframes;
+	char *index_path;
+	FILE *index_file;
+	char *trace_path;
+	int trace_marker;
+	char *stats_socket;
 	char *url;
+	char *playlist;
+	int loop;
+
+	/* All the urls given on the command line, and in the playlist.
+	 * Those the instance plays one after the other once started. */
+	char **urls;
+	int url_count;
+
+	/* Playlist clip played, its timestamps follow the previous ones */
+	int clip;
+	uint64_t clip_offset;	/* us */
+	uint64_t clip_end;	/* end of the packets sent, us */
+	atomic_int restart_pending;	/* decoder setup for a new codec */
 
 	/* video decoder related parameters */
 	struct video	video;
 
-	pthread_mutex_t lock;
-	pthread_cond_t cond;
+	/* eventfd waking up the parser thread waiting for a buffer */
+	int free_evfd;
 
 	/* Control */
-	int sigfd;
 	int paused;
 	int prerolled;
+
+	/* Seeking, the decoder is flushed while flush_pending is set */
+	atomic_int flush_pending;
+	int seek_requested;	/* by the main thread, until flushed */
+	int trick;		/* keyframe only playback direction, or 0 */
+	uint64_t position;	/* stream time of the last frame, in us */
+
+	/* Decoded frames waiting for presentation */
+	struct sched sched;
+	int draining;
 	int finish;  /* Flag set when decoding has been completed and all
 			threads finish */
 
 	int reconfigure_pending;
+	uint64_t reconfigure_time;	/* when the last one started */
 	int group;
 
+	/* Monotonic time in us when decoding started and finished */
+	uint64_t start_time;
+	uint64_t end_time;
+
+	/* Startup, the stream is probed while the rest is set up */
+	int probe_ret;
+	uint64_t probe_time;		/* us */
+	uint64_t first_frame_time;	/* us from the launch, 0 if none */
+
+	/* Per stage latency of the decoded frames */
+	uint64_t read_time;
+	int64_t read_pos;	/* of the packet being sent */
+	struct latency_stats latency;
+
 	struct display *display;
 	struct window *window;
 	struct list_head fb_list;
 
-	int stdin_valid;
-	struct termios stdin_termios;
+	/* Decoder clocks, following the load */
+	struct perf_governor perf;
+
+	/* Packets read ahead by the demux thread */
+	struct pktq pktq;
+
+	/* Decoded frames written out instead of displayed */
+	struct dump dump;
+
+	/* Elementary stream source, used instead of libavformat */
+	struct ingest ingest;
 
 	AVFormatContext *avctx;
 	AVStream *stream;
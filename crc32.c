@@ -0,0 +1,111 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * CRC-32
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32_POLY	0xedb88320
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+static int crc32_hw;
+
+#if defined(__aarch64__)
+/* The CRC32 instructions are optional in ARMv8.0, so they are only
+ * enabled for this function and checked for at runtime */
+__attribute__((target("+crc")))
+static uint32_t
+crc32_update_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	uint64_t v;
+
+	while (len && ((uintptr_t)data & 7)) {
+		crc = __crc32b(crc, *data++);
+		len--;
+	}
+
+	while (len >= 32) {
+		memcpy(&v, data, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, data + 8, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, data + 16, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, data + 24, 8);
+		crc = __crc32d(crc, v);
+		data += 32;
+		len -= 32;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, data, 8);
+		crc = __crc32d(crc, v);
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *data++);
+
+	return crc;
+}
+#endif
+
+static void
+crc32_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+
+		crc32_table[n] = c;
+	}
+
+#if defined(__aarch64__)
+	crc32_hw = !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+}
+
+uint32_t
+crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	crc = ~crc;
+
+#if defined(__aarch64__)
+	if (crc32_hw)
+		return ~crc32_update_hw(crc, data, len);
+#endif
+
+	while (len--)
+		crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
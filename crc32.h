@@ -0,0 +1,29 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * CRC-32 header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_CRC32_H
+#define INCLUDE_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Update a CRC-32 (same polynomial as zlib, start with 0) with data */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif /* INCLUDE_CRC32_H */
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <wayland-client.h>
 
@@ -18,6 +20,12 @@
 
 #define DBG_TAG "  disp"
 
+/* laid out as the entries of the dmabuf feedback format table */
+struct dmabuf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
@@ -31,10 +39,29 @@ struct display {
 	struct wp_presentation *presentation;
 	struct zlinux_dmabuf *dmabuf_legacy;
 	struct zwp_linux_dmabuf_v1 *dmabuf;
+	struct zwp_linux_dmabuf_feedback_v1 *dmabuf_feedback;
 	uint32_t drm_formats[32];
+	struct dmabuf_format drm_modifiers[128];
+	/* the layouts the compositor can put on a plane, from the scanout
+	 * tranches of the feedback */
+	struct dmabuf_format scanout_modifiers[64];
+
+	/* feedback being received, the format table is shared by the
+	 * tranches and the tranche formats index it */
+	const struct dmabuf_format *format_table;
+	size_t format_table_size;
+	uint16_t tranche_formats[128];
+	uint32_t tranche_flags;
+	int tranche_format_count;
+	bool feedback_pending;
+
+	clockid_t presentation_clock;
 	int compositor_version;
+	int dmabuf_version;
 	int seat_version;
 	int drm_format_count;
+	int drm_modifier_count;
+	int scanout_modifier_count;
 	int running;
 
 	struct window *keyboard_focus;
@@ -61,6 +88,7 @@ struct window {
 	bool fullscreen;
 
 	window_key_cb_t key_cb;
+	window_present_cb_t present_cb;
 	void *user_data;
 };
 
@@ -68,6 +96,10 @@ void
 fb_destroy(struct fb *fb)
 {
 	list_del(&fb->link);
+	if (fb->params)
+		zwp_linux_buffer_params_v1_destroy(fb->params);
+	if (fb->legacy_params)
+		zlinux_buffer_params_destroy(fb->legacy_params);
 	if (fb->sync_callback)
 		wl_callback_destroy(fb->sync_callback);
 	if (fb->presentation_feedback)
@@ -78,29 +110,26 @@ fb_destroy(struct fb *fb)
 }
 
 void
-fb_apply_extradata(struct fb *fb, const struct msm_vidc_extradata_header *hdr)
+fb_apply_extradata(struct fb *fb, const struct extradata_info *info)
 {
-	struct msm_vidc_aspect_ratio_payload *ar;
-	struct msm_vidc_output_crop_payload *crop;
-
-	if ((ar = extradata_header_find(hdr, MSM_VIDC_EXTRADATA_ASPECT_RATIO))) {
-		fb->ar_x = ar->aspect_width;
-		fb->ar_y = ar->aspect_height;
+	if (info->flags & EXTRADATA_ASPECT_RATIO) {
+		fb->ar_x = info->ar_x;
+		fb->ar_y = info->ar_y;
 	} else {
 		fb->ar_x = 1;
 		fb->ar_y = 1;
 	}
 
-	if ((crop = extradata_header_find(hdr, MSM_VIDC_EXTRADATA_OUTPUT_CROP))) {
-		fb->crop_x = crop->left;
-		fb->crop_y = crop->top;
-		fb->crop_w = crop->display_width;
-		fb->crop_h = crop->display_height;
+	if (info->flags & EXTRADATA_CROP) {
+		fb->crop_x = info->crop_x;
+		fb->crop_y = info->crop_y;
+		fb->crop_w = info->crop_w;
+		fb->crop_h = info->crop_h;
 	} else {
 		fb->crop_x = 0;
 		fb->crop_y = 0;
 		fb->crop_w = 0;
-		fb->crop_y = 0;
+		fb->crop_h = 0;
 	}
 }
 
@@ -122,6 +151,26 @@ window_set_key_callback(struct window *w, window_key_cb_t callback)
 	w->key_cb = callback;
 }
 
+void
+window_set_present_callback(struct window *w, window_present_cb_t callback)
+{
+	w->present_cb = callback;
+}
+
+/* Convert a time from the presentation clock to CLOCK_MONOTONIC */
+static uint64_t
+presentation_time_us(struct display *display, uint64_t tv_sec,
+		     uint32_t tv_nsec)
+{
+	uint64_t t = tv_sec * 1000000 + tv_nsec / 1000;
+
+	if (display->presentation_clock == CLOCK_MONOTONIC)
+		return t;
+
+	return t - time_us(display->presentation_clock) +
+		time_us(CLOCK_MONOTONIC);
+}
+
 static void
 handle_sync_output(void *data, struct wp_presentation_feedback *feedback,
 		   struct wl_output *output)
@@ -137,23 +186,34 @@ handle_presented(void *data, struct wp_presentation_feedback *feedback,
 	struct fb *fb = data;
 	uint64_t tv_sec = (uint64_t)tv_sec_hi << 32 | tv_sec_lo;
 
+	struct window *w = fb->window;
+
 	dbg("buffer %d displayed at %lu.%04u, %u.%04us till next refresh",
 	    fb->index, tv_sec, tv_nsec / 1000000, refresh / 1000000000,
 	    refresh / 1000000);
 
 	wp_presentation_feedback_destroy(feedback);
 	fb->presentation_feedback = NULL;
+
+	if (w->present_cb)
+		w->present_cb(w, fb,
+			      presentation_time_us(w->display, tv_sec, tv_nsec),
+			      refresh);
 }
 
 static void
 handle_discarded(void *data, struct wp_presentation_feedback *feedback)
 {
 	struct fb *fb = data;
+	struct window *w = fb->window;
 
 	dbg("buffer %d discarded", fb->index);
 
 	wp_presentation_feedback_destroy(feedback);
 	fb->presentation_feedback = NULL;
+
+	if (w->present_cb)
+		w->present_cb(w, fb, 0, 0);
 }
 
 static const struct wp_presentation_feedback_listener presentation_feedback_listener = {
@@ -162,14 +222,36 @@ static const struct wp_presentation_feedback_listener presentation_feedback_list
 	handle_discarded,
 };
 
+static void
+presentation_handle_clock_id(void *data, struct wp_presentation *presentation,
+			     uint32_t clk_id)
+{
+	struct display *d = data;
+
+	d->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_handle_clock_id,
+};
+
 static void
 sync_callback(void * data, struct wl_callback * callback, uint32_t time)
 {
 	struct fb *fb = data;
+	struct window *w;
 
 	wl_callback_destroy(callback);
-	if (fb)
-		fb->sync_callback = NULL;
+	if (!fb)
+		return;
+
+	fb->sync_callback = NULL;
+
+	/* without presentation feedback, use the commit being processed
+	 * by the compositor as the presentation of the buffer */
+	w = fb->window;
+	if (w->present_cb)
+		w->present_cb(w, fb, 0, 0);
 }
 
 static const struct wl_callback_listener sync_listener = {
@@ -550,6 +632,7 @@ create_succeeded(void *data,
 	wl_buffer_add_listener(fb->buffer, &buffer_listener, fb);
 
 	zwp_linux_buffer_params_v1_destroy(params);
+	fb->params = NULL;
 }
 
 static void
@@ -560,6 +643,7 @@ create_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
 	fb->buffer = NULL;
 
 	zwp_linux_buffer_params_v1_destroy(params);
+	fb->params = NULL;
 
 	err("zwp_linux_buffer_params.create failed");
 
@@ -582,6 +666,7 @@ dmabuf_legacy_create_succeeded(void *data,
 	wl_buffer_add_listener(fb->buffer, &buffer_listener, fb);
 
 	zlinux_buffer_params_destroy(params);
+	fb->legacy_params = NULL;
 }
 
 static void
@@ -592,6 +677,7 @@ dmabuf_legacy_create_failed(void *data, struct zlinux_buffer_params *params)
 	fb->buffer = NULL;
 
 	zlinux_buffer_params_destroy(params);
+	fb->legacy_params = NULL;
 
 	err("zlinux_buffer_params.create failed");
 
@@ -604,32 +690,72 @@ static const struct zlinux_buffer_params_listener dmabuf_legacy_params_listener
 };
 
 static int
-format_is_supported(struct display *display, uint32_t format)
+find_modifier(const struct dmabuf_format *list, int count, uint32_t format,
+	      uint64_t modifier)
 {
-	int i;
-
-	for (i = 0; i < display->drm_format_count; i++) {
-		if (display->drm_formats[i] == format)
+	for (int n = 0; n < count; n++) {
+		if (list[n].format == format && list[n].modifier == modifier)
 			return 1;
 	}
 
 	return 0;
 }
 
+/* Whether a layout is listed, the implicit modifier standing for the
+ * linear layout */
+static int
+has_modifier(const struct dmabuf_format *list, int count, uint32_t format,
+	     uint64_t modifier)
+{
+	if (find_modifier(list, count, format, modifier))
+		return 1;
+
+	return modifier == DRM_FORMAT_MOD_LINEAR &&
+		find_modifier(list, count, format, DRM_FORMAT_MOD_INVALID);
+}
+
+static void
+add_modifier(struct dmabuf_format *list, int *count, int max,
+	     uint32_t format, uint64_t modifier)
+{
+	if (*count == max || find_modifier(list, *count, format, modifier))
+		return;
+
+	list[*count].format = format;
+	list[*count].modifier = modifier;
+	(*count)++;
+}
+
 struct fb *
 window_create_buffer(struct window *window, int group, int index, int fd,
-		     uint32_t format, int width, int height, int n_planes,
-		     const int *plane_offsets, const int *plane_strides)
+		     uint32_t format, uint64_t modifier, int width, int height,
+		     int n_planes, const int *plane_offsets,
+		     const int *plane_strides)
 {
 	struct display *display = window->display;
 	struct fb *fb;
 
-#if 0
-	if (!format_is_supported(display, format)) {
-		err("unsupported display format");
-		return NULL;
+	/* the linear layout may only be advertised as the implicit one */
+	if (modifier == DRM_FORMAT_MOD_LINEAR && display->dmabuf &&
+	    display->dmabuf_version >= 3 &&
+	    !find_modifier(display->drm_modifiers, display->drm_modifier_count,
+			   format, DRM_FORMAT_MOD_LINEAR) &&
+	    find_modifier(display->drm_modifiers, display->drm_modifier_count,
+			  format, DRM_FORMAT_MOD_INVALID))
+		modifier = DRM_FORMAT_MOD_INVALID;
+
+	/* the compressed layouts are only used when advertised, the
+	 * compositor may still take a linear one it does not list */
+	if (!display_has_format(display, format, modifier)) {
+		if (modifier != DRM_FORMAT_MOD_LINEAR) {
+			err("display format %.4s:%016llx not supported",
+			    (char *)&format, (unsigned long long)modifier);
+			return NULL;
+		}
+
+		info("display format %.4s not advertised, trying anyway",
+		     (char *)&format);
 	}
-#endif
 
 	if (n_planes <= 0 || n_planes > FB_MAX_PLANES) {
 		err("invalid number of planes");
@@ -641,6 +767,7 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 	fb->index = index;
 	fb->fd = fd;
 	fb->format = format;
+	fb->modifier = modifier;
 	fb->width = width;
 	fb->height = height;
 	fb->window = window;
@@ -653,6 +780,11 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 
 	INIT_LIST_HEAD(&fb->link);
 
+	/*
+	 * Never wait for the compositor here: with create_immed the buffer
+	 * can be used right away, otherwise it becomes usable when the
+	 * created event is dispatched by the main loop.
+	 */
 	if (display->dmabuf) {
 		struct zwp_linux_buffer_params_v1 *params =
 			zwp_linux_dmabuf_v1_create_params(display->dmabuf);
@@ -660,12 +792,27 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 		for (int i = 0; i < fb->n_planes; i++) {
 			zwp_linux_buffer_params_v1_add(params, fb->fd, i,
 						       fb->offsets[i],
-						       fb->strides[i], 0, 0);
+						       fb->strides[i],
+						       fb->modifier >> 32,
+						       fb->modifier & 0xffffffff);
 		}
 
-		zwp_linux_buffer_params_v1_add_listener(params, &params_listener, fb);
-		zwp_linux_buffer_params_v1_create(params, fb->width, fb->height,
-						  fb->format, 0);
+		if (display->dmabuf_version >= 2) {
+			fb->buffer = zwp_linux_buffer_params_v1_create_immed(
+					params, fb->width, fb->height,
+					fb->format, 0);
+			wl_buffer_add_listener(fb->buffer, &buffer_listener,
+					       fb);
+			zwp_linux_buffer_params_v1_destroy(params);
+		} else {
+			fb->params = params;
+			zwp_linux_buffer_params_v1_add_listener(params,
+								&params_listener,
+								fb);
+			zwp_linux_buffer_params_v1_create(params, fb->width,
+							  fb->height,
+							  fb->format, 0);
+		}
 	} else {
 		struct zlinux_buffer_params *params =
 			zlinux_dmabuf_create_params(display->dmabuf_legacy);
@@ -673,21 +820,17 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 		for (int i = 0; i < fb->n_planes; i++) {
 			zlinux_buffer_params_add(params, fb->fd, i,
 						 fb->offsets[i],
-						 fb->strides[i], 0, 0);
+						 fb->strides[i],
+						 fb->modifier >> 32,
+						 fb->modifier & 0xffffffff);
 		}
 
+		fb->legacy_params = params;
 		zlinux_buffer_params_add_listener(params, &dmabuf_legacy_params_listener, fb);
 		zlinux_buffer_params_create(params, fb->width, fb->height,
 					    fb->format, 0);
 	}
 
-	wl_display_roundtrip(display->display);
-
-	if (!fb->buffer) {
-		fb_destroy(fb);
-		return NULL;
-	}
-
 	return fb;
 }
 
@@ -718,10 +861,167 @@ dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *zwp_linux_dmabuf,
 	d->drm_formats[d->drm_format_count++] = format;
 }
 
+static void
+dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *zwp_linux_dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	struct display *d = data;
+
+	add_modifier(d->drm_modifiers, &d->drm_modifier_count,
+		     ARRAY_LENGTH(d->drm_modifiers), format,
+		     (uint64_t)modifier_hi << 32 | modifier_lo);
+}
+
 static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
-	dmabuf_format
+	dmabuf_format,
+	dmabuf_modifier
+};
+
+static void
+feedback_done(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback)
+{
+	struct display *d = data;
+
+	d->feedback_pending = false;
+
+	dbg("dmabuf feedback: %d layouts, %d for scanout",
+	    d->drm_modifier_count, d->scanout_modifier_count);
+}
+
+static void
+feedback_format_table(void *data,
+		      struct zwp_linux_dmabuf_feedback_v1 *feedback,
+		      int32_t fd, uint32_t size)
+{
+	struct display *d = data;
+	void *table;
+
+	if (d->format_table)
+		munmap((void *)d->format_table, d->format_table_size);
+	d->format_table = NULL;
+	d->format_table_size = 0;
+
+	table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (table == MAP_FAILED) {
+		err("failed to map the dmabuf format table: %m");
+		return;
+	}
+
+	d->format_table = table;
+	d->format_table_size = size;
+}
+
+static void
+feedback_main_device(void *data,
+		     struct zwp_linux_dmabuf_feedback_v1 *feedback,
+		     struct wl_array *device)
+{
+}
+
+static void
+feedback_tranche_done(void *data,
+		      struct zwp_linux_dmabuf_feedback_v1 *feedback)
+{
+	struct display *d = data;
+	size_t entries = d->format_table_size / sizeof *d->format_table;
+	bool scanout = d->tranche_flags &
+		ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT;
+
+	/* a new feedback replaces the layouts of the previous one */
+	if (!d->feedback_pending) {
+		d->drm_modifier_count = 0;
+		d->scanout_modifier_count = 0;
+		d->feedback_pending = true;
+	}
+
+	for (int n = 0; n < d->tranche_format_count; n++) {
+		const struct dmabuf_format *f;
+		uint16_t index = d->tranche_formats[n];
+
+		if (index >= entries)
+			continue;
+
+		f = &d->format_table[index];
+
+		add_modifier(d->drm_modifiers, &d->drm_modifier_count,
+			     ARRAY_LENGTH(d->drm_modifiers),
+			     f->format, f->modifier);
+		if (scanout)
+			add_modifier(d->scanout_modifiers,
+				     &d->scanout_modifier_count,
+				     ARRAY_LENGTH(d->scanout_modifiers),
+				     f->format, f->modifier);
+	}
+
+	d->tranche_format_count = 0;
+	d->tranche_flags = 0;
+}
+
+static void
+feedback_tranche_target_device(void *data,
+			       struct zwp_linux_dmabuf_feedback_v1 *feedback,
+			       struct wl_array *device)
+{
+}
+
+static void
+feedback_tranche_formats(void *data,
+			 struct zwp_linux_dmabuf_feedback_v1 *feedback,
+			 struct wl_array *indices)
+{
+	struct display *d = data;
+	uint16_t *index;
+
+	wl_array_for_each(index, indices) {
+		if (d->tranche_format_count == ARRAY_LENGTH(d->tranche_formats))
+			break;
+
+		d->tranche_formats[d->tranche_format_count++] = *index;
+	}
+}
+
+static void
+feedback_tranche_flags(void *data,
+		       struct zwp_linux_dmabuf_feedback_v1 *feedback,
+		       uint32_t flags)
+{
+	struct display *d = data;
+
+	d->tranche_flags = flags;
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener feedback_listener = {
+	feedback_done,
+	feedback_format_table,
+	feedback_main_device,
+	feedback_tranche_done,
+	feedback_tranche_target_device,
+	feedback_tranche_formats,
+	feedback_tranche_flags,
 };
 
+int
+display_has_format(struct display *display, uint32_t format,
+		   uint64_t modifier)
+{
+	/* the modifiers are only advertised since version 3 */
+	if (!display->dmabuf || display->dmabuf_version < 3)
+		return 1;
+
+	return has_modifier(display->drm_modifiers,
+			    display->drm_modifier_count, format, modifier);
+}
+
+int
+display_can_scanout(struct display *display, uint32_t format,
+		    uint64_t modifier)
+{
+	return has_modifier(display->scanout_modifiers,
+			    display->scanout_modifier_count, format, modifier);
+}
+
 static void
 dmabuf_legacy_format(void *data, struct zlinux_dmabuf *zlinux_dmabuf,
 		     uint32_t format)
@@ -862,6 +1162,8 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->presentation = wl_registry_bind(registry, id,
 						   &wp_presentation_interface,
 						   1);
+		wp_presentation_add_listener(d->presentation,
+					     &presentation_listener, d);
 	} else if (!strcmp(interface, "zxdg_shell_v6")) {
 		d->xdg_shell = wl_registry_bind(registry, id,
 						&zxdg_shell_v6_interface, 1);
@@ -871,10 +1173,21 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->wl_shell = wl_registry_bind(registry, id,
 					       &wl_shell_interface, 1);
 	} else if (!strcmp(interface, "zwp_linux_dmabuf_v1")) {
+		/* version 2 adds create_immed, version 3 the modifiers and
+		 * version 4 the feedback, replacing the format events */
+		d->dmabuf_version = MIN(version, 4);
 		d->dmabuf = wl_registry_bind(registry, id,
-					     &zwp_linux_dmabuf_v1_interface, 1);
-		zwp_linux_dmabuf_v1_add_listener(d->dmabuf, &dmabuf_listener,
-						 d);
+					     &zwp_linux_dmabuf_v1_interface,
+					     d->dmabuf_version);
+		if (d->dmabuf_version >= 4) {
+			d->dmabuf_feedback =
+				zwp_linux_dmabuf_v1_get_default_feedback(d->dmabuf);
+			zwp_linux_dmabuf_feedback_v1_add_listener(
+				d->dmabuf_feedback, &feedback_listener, d);
+		} else {
+			zwp_linux_dmabuf_v1_add_listener(d->dmabuf,
+							 &dmabuf_listener, d);
+		}
 	} else if (!strcmp(interface, "zlinux_dmabuf")) {
 		d->dmabuf_legacy = wl_registry_bind(registry, id,
 						    &zlinux_dmabuf_interface, 1);
@@ -919,6 +1232,11 @@ display_destroy(struct display *display)
 		zxdg_shell_v6_destroy(display->xdg_shell);
 	if (display->wl_shell)
 		wl_shell_destroy(display->wl_shell);
+	if (display->dmabuf_feedback)
+		zwp_linux_dmabuf_feedback_v1_destroy(display->dmabuf_feedback);
+	if (display->format_table)
+		munmap((void *)display->format_table,
+		       display->format_table_size);
 	if (display->dmabuf)
 		zwp_linux_dmabuf_v1_destroy(display->dmabuf);
 	if (display->dmabuf_legacy)
@@ -945,12 +1263,16 @@ display_create(void)
 		goto fail;
 	}
 
+	display->presentation_clock = CLOCK_MONOTONIC;
 	display->registry = wl_display_get_registry(display->display);
 	wl_registry_add_listener(display->registry, &registry_listener,
 				 display);
 
 	wl_display_roundtrip(display->display);
 
+	/* and the formats of the globals bound */
+	wl_display_roundtrip(display->display);
+
 	if (!display->xdg_shell && !display->wl_shell) {
 		err("missing wayland shell");
 		goto fail;
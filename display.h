@@ -10,14 +10,46 @@
 struct display;
 struct window;
 struct fb;
+struct extradata_info;
 
 typedef void (*fb_release_cb_t)(struct fb *fb, void *data);
 
 typedef void (*window_key_cb_t)(struct window *w, uint32_t time, uint32_t key,
 				enum wl_keyboard_key_state state);
 
+/* Called when the compositor reports a buffer as presented, with the
+ * presentation time as CLOCK_MONOTONIC us and the output refresh period
+ * in ns (0 if unknown), or as discarded or done without presentation
+ * feedback, with a time of 0 */
+typedef void (*window_present_cb_t)(struct window *w, struct fb *fb,
+				    uint64_t time, uint32_t refresh);
+
 #define FB_MAX_PLANES 3
 
+/* DRM formats and layout modifiers of the decoder output, the Qualcomm
+ * modifiers are not in the headers of older kernels */
+#ifndef DRM_FORMAT_NV12
+#define DRM_FORMAT_NV12		0x3231564e	/* fourcc NV12 */
+#endif
+#ifndef DRM_FORMAT_P010
+#define DRM_FORMAT_P010		0x30313050	/* fourcc P010 */
+#endif
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR	0ull
+#endif
+#ifndef DRM_FORMAT_MOD_INVALID
+#define DRM_FORMAT_MOD_INVALID	((1ull << 56) - 1)
+#endif
+#ifndef DRM_FORMAT_MOD_QCOM_COMPRESSED
+#define DRM_FORMAT_MOD_QCOM_COMPRESSED	((0x05ull << 56) | 0x1)
+#endif
+#ifndef DRM_FORMAT_MOD_QCOM_DX
+#define DRM_FORMAT_MOD_QCOM_DX		((0x05ull << 56) | 0x2)
+#endif
+#ifndef DRM_FORMAT_MOD_QCOM_TIGHT
+#define DRM_FORMAT_MOD_QCOM_TIGHT	((0x05ull << 56) | 0x4)
+#endif
+
 struct fb {
 	struct window *window;
 	int group;
@@ -32,8 +64,12 @@ struct fb {
 	int ar_x, ar_y;
 	int crop_x, crop_y, crop_w, crop_h;
 	uint32_t format;
+	uint64_t modifier;
 	struct list_head link;
 	struct wl_buffer *buffer;
+	/* pending asynchronous creation of the buffer */
+	struct zwp_linux_buffer_params_v1 *params;
+	struct zlinux_buffer_params *legacy_params;
 	struct wl_callback *sync_callback;
 	struct wp_presentation_feedback *presentation_feedback;
 	fb_release_cb_t release_cb;
@@ -44,25 +80,38 @@ struct wl_display *display_get_wl_display(struct display *display);
 
 struct display *display_create(void);
 int display_is_running(struct display *display);
+
+/* Whether buffers of a format and layout can be shown, assumed so when
+ * the compositor does not advertise the modifiers. The linear layout is
+ * matched by the implicit modifier too. */
+int display_has_format(struct display *display, uint32_t format,
+		       uint64_t modifier);
+
+/* Whether the compositor can put buffers of a format and layout on a
+ * hardware plane, only known from the dmabuf feedback */
+int display_can_scanout(struct display *display, uint32_t format,
+			uint64_t modifier);
 struct window *display_create_window(struct display *display);
 void display_destroy(struct display *display);
 
 void window_set_user_data(struct window *w, void *data);
 void *window_get_user_data(struct window *w);
 void window_set_key_callback(struct window *w, window_key_cb_t handler);
+void window_set_present_callback(struct window *w,
+				 window_present_cb_t handler);
 void window_set_aspect_ratio(struct window *w, int ar_x, int ar_y);
 void window_toggle_fullscreen(struct window *w);
 
 void window_show_buffer(struct window *window, struct fb *fb,
 			fb_release_cb_t release_cb, void *cb_data);
 struct fb *window_create_buffer(struct window *window, int group, int index,
-				int fd, uint32_t format, int width, int height,
-				int n_planes, const int *plane_offsets,
+				int fd, uint32_t format, uint64_t modifier,
+				int width, int height, int n_planes,
+				const int *plane_offsets,
 				const int *plane_strides);
 void window_destroy(struct window *window);
 
-void fb_apply_extradata(struct fb *fb,
-			const struct msm_vidc_extradata_header *hdr);
+void fb_apply_extradata(struct fb *fb, const struct extradata_info *info);
 void fb_destroy(struct fb *fb);
 
 #endif /* !DISPLAY_H_ */
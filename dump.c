@@ -0,0 +1,399 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Raw frame dump
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/dma-buf.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "crc32.h"
+#include "dump.h"
+
+#define DBG_TAG "  dump"
+
+/* Rows gathered per writev() call, contiguous rows are merged */
+#define DUMP_IOV		256
+
+struct dump_iov {
+	struct iovec iov[DUMP_IOV];
+	int count;
+};
+
+static int
+dump_writev(struct dump *d, struct iovec *iov, int count)
+{
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = writev(d->fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		d->bytes += ret;
+
+		/* writes to a pipe may be partial */
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int
+dump_add(struct dump *d, struct dump_iov *v, const uint8_t *data, size_t len)
+{
+	if (v->count) {
+		struct iovec *last = &v->iov[v->count - 1];
+
+		if ((uint8_t *)last->iov_base + last->iov_len == data) {
+			last->iov_len += len;
+			return 0;
+		}
+	}
+
+	if (v->count == DUMP_IOV) {
+		if (dump_writev(d, v->iov, v->count) < 0)
+			return -1;
+		v->count = 0;
+	}
+
+	v->iov[v->count].iov_base = (void *)data;
+	v->iov[v->count].iov_len = len;
+	v->count++;
+
+	return 0;
+}
+
+/* Get the first visible row of a plane, their count and width */
+static const uint8_t *
+dump_plane_rows(const struct dump_frame *f, int p, int *rows, int *width)
+{
+	/* the chroma plane is subsampled in both directions */
+	int y = p ? f->y / 2 : f->y;
+	int x = p ? f->x & ~1 : f->x;
+
+	*rows = p ? (f->h + 1) / 2 : f->h;
+	*width = (p ? (f->w + 1) & ~1 : f->w) * f->cpp;
+
+	return f->data + f->plane_off[p] + (size_t)y * f->plane_stride[p] +
+		x * f->cpp;
+}
+
+void
+dump_frame_size(const struct dump_frame *f, int *w, int *h)
+{
+	int s = f->scale;
+
+	if (s <= 1) {
+		*w = f->w;
+		*h = f->h;
+		return;
+	}
+
+	/* even, the chroma being subsampled */
+	*w = ((f->w + s - 1) / s + 1) & ~1;
+	*h = ((f->h + s - 1) / s + 1) & ~1;
+}
+
+/* Write one sample out of scale of the visible area, a chroma sample
+ * being a U and V pair */
+static int
+dump_write_scaled(struct dump *d, const struct dump_frame *f)
+{
+	struct iovec iov;
+	uint8_t *dst;
+	size_t size;
+	int w, h;
+
+	dump_frame_size(f, &w, &h);
+
+	size = (size_t)w * h * 3 / 2 * f->cpp;
+	if (size > d->scaled_size) {
+		uint8_t *p = realloc(d->scaled, size);
+
+		if (!p)
+			return -1;
+		d->scaled = p;
+		d->scaled_size = size;
+	}
+
+	dst = d->scaled;
+
+	for (int p = 0; p < f->planes; p++) {
+		int sample = (p ? 2 : 1) * f->cpp;
+		int out_w = p ? w / 2 : w;
+		int out_h = p ? h / 2 : h;
+		const uint8_t *src;
+		int rows, width;
+
+		src = dump_plane_rows(f, p, &rows, &width);
+
+		for (int y = 0; y < out_h; y++) {
+			const uint8_t *row = src + (size_t)MIN(y * f->scale,
+				rows - 1) * f->plane_stride[p];
+
+			for (int x = 0; x < out_w; x++) {
+				memcpy(dst, row + MIN(x * f->scale,
+					width / sample - 1) * sample, sample);
+				dst += sample;
+			}
+		}
+	}
+
+	iov.iov_base = d->scaled;
+	iov.iov_len = dst - d->scaled;
+
+	return dump_writev(d, &iov, 1);
+}
+
+/* Gather the visible rows of the frame, without copying them */
+static int
+dump_write_frame(struct dump *d, const struct dump_frame *f)
+{
+	struct dump_iov v;
+
+	if (f->planes && f->scale > 1)
+		return dump_write_scaled(d, f);
+
+	v.count = 0;
+
+	if (!f->planes) {
+		if (dump_add(d, &v, f->data, f->size) < 0)
+			return -1;
+		return dump_writev(d, v.iov, v.count);
+	}
+
+	for (int p = 0; p < f->planes; p++) {
+		const uint8_t *row;
+		int rows, w;
+
+		row = dump_plane_rows(f, p, &rows, &w);
+		for (int n = 0; n < rows; n++) {
+			if (dump_add(d, &v, row, w) < 0)
+				return -1;
+			row += f->plane_stride[p];
+		}
+	}
+
+	return dump_writev(d, v.iov, v.count);
+}
+
+static void
+dump_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+
+	/* not all heaps need or support it */
+	if (fd >= 0)
+		ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+uint32_t
+dump_checksum(const struct dump_frame *f)
+{
+	uint32_t crc = 0;
+
+	dump_sync(f->fd, DMA_BUF_SYNC_START);
+
+	if (!f->planes)
+		crc = crc32_update(crc, f->data, f->size);
+
+	for (int p = 0; p < f->planes; p++) {
+		const uint8_t *row;
+		int rows, w;
+
+		row = dump_plane_rows(f, p, &rows, &w);
+		for (int n = 0; n < rows; n++) {
+			crc = crc32_update(crc, row, w);
+			row += f->plane_stride[p];
+		}
+	}
+
+	dump_sync(f->fd, DMA_BUF_SYNC_END);
+
+	return crc;
+}
+
+static void *
+dump_thread_func(void *args)
+{
+	struct dump *d = args;
+	struct dump_frame f;
+	eventfd_t val;
+
+	trace_thread("dump");
+	dbg("Dump thread started");
+
+	for (;;) {
+		if (!ring_pop(&d->queue, &f)) {
+			if (atomic_load(&d->stop))
+				break;
+
+			/* the main thread signals every frame after queuing
+			 * it, so no wake up is lost */
+			eventfd_read(d->queue_evfd, &val);
+			continue;
+		}
+
+		if (!d->error) {
+			dump_sync(f.fd, DMA_BUF_SYNC_START);
+
+			if (dump_write_frame(d, &f) < 0) {
+				/* keep giving back the buffers */
+				err("failed to write frame: %m");
+				d->error = 1;
+			} else {
+				d->frames++;
+			}
+
+			dump_sync(f.fd, DMA_BUF_SYNC_END);
+		}
+
+		/* there is room for all the queued frames in the ring */
+		ring_push(&d->done, &f.index);
+		eventfd_write(d->done_evfd, 1);
+	}
+
+	dbg("Dump thread finished");
+
+	return NULL;
+}
+
+int
+dump_open(struct dump *d, const char *path)
+{
+	memset(d, 0, sizeof (*d));
+
+	if (!strcmp(path, "-"))
+		d->fd = dup(STDOUT_FILENO);
+	else
+		d->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			     0644);
+	if (d->fd < 0) {
+		err("failed to open %s: %m", path);
+		return -1;
+	}
+
+	d->queue_evfd = eventfd(0, EFD_CLOEXEC);
+	d->done_evfd = eventfd(0, EFD_CLOEXEC);
+	if (d->queue_evfd < 0 || d->done_evfd < 0) {
+		err("failed to create eventfd: %m");
+		goto err;
+	}
+
+	ring_init(&d->queue, d->queue_data, DUMP_MAX_FRAMES,
+		  sizeof (struct dump_frame));
+	ring_init(&d->done, d->done_data, DUMP_MAX_FRAMES, sizeof (int));
+	atomic_init(&d->stop, 0);
+
+	if (pthread_create(&d->thread, NULL, dump_thread_func, d)) {
+		err("failed to start dump thread");
+		goto err;
+	}
+
+	d->started = 1;
+
+	info("dumping frames to %s", path);
+
+	return 0;
+
+err:
+	if (d->queue_evfd >= 0)
+		close(d->queue_evfd);
+	if (d->done_evfd >= 0)
+		close(d->done_evfd);
+	close(d->fd);
+	return -1;
+}
+
+void
+dump_close(struct dump *d)
+{
+	if (!d->started)
+		return;
+
+	/* the frames still queued are written first */
+	atomic_store(&d->stop, 1);
+	eventfd_write(d->queue_evfd, 1);
+	pthread_join(d->thread, NULL);
+	d->started = 0;
+
+	info("dumped %lu frames, %" PRIu64 " bytes", d->frames, d->bytes);
+
+	close(d->queue_evfd);
+	close(d->done_evfd);
+	close(d->fd);
+	free(d->scaled);
+	d->scaled = NULL;
+}
+
+int
+dump_frame(struct dump *d, const struct dump_frame *f)
+{
+	if (!ring_push(&d->queue, f))
+		return -1;
+
+	d->pending++;
+	eventfd_write(d->queue_evfd, 1);
+
+	return 0;
+}
+
+int
+dump_take(struct dump *d, int *index)
+{
+	if (!ring_pop(&d->done, index))
+		return 0;
+
+	d->pending--;
+
+	return 1;
+}
+
+void
+dump_wait(struct dump *d)
+{
+	eventfd_t val;
+
+	eventfd_read(d->done_evfd, &val);
+}
+
+int
+dump_get_fd(struct dump *d)
+{
+	return d->done_evfd;
+}
@@ -0,0 +1,110 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Raw frame dump header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_DUMP_H
+#define INCLUDE_DUMP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+/* Frames queued to the writer at most, a power of two */
+#define DUMP_MAX_FRAMES		32
+
+/* A decoded frame to write, straight from the capture buffer mapping */
+struct dump_frame {
+	int index;		/* capture buffer index */
+	int fd;			/* dmabuf of the capture buffer */
+	const uint8_t *data;
+	size_t size;
+
+	/* NV12 or P010 layout, when planes is 0 the whole buffer is
+	 * written */
+	int planes;
+	int cpp;		/* bytes per sample */
+	int plane_off[2];
+	int plane_stride[2];
+
+	/* visible rectangle */
+	int x, y, w, h;
+
+	/* one sample out of scale kept in both directions, 0 or 1 to
+	 * write the frame as is */
+	int scale;
+};
+
+/*
+ * The frames are written by a thread of their own, so that the decoder
+ * never waits on the disk or pipe reader. The capture buffers stay
+ * owned by the writer until it reports them back as done.
+ */
+struct dump {
+	int fd;
+	pthread_t thread;
+	int started;
+	atomic_int stop;
+
+	/* frames to write, from the main thread */
+	struct ring queue;
+	struct dump_frame queue_data[DUMP_MAX_FRAMES];
+	int queue_evfd;
+
+	/* capture buffers written, to the main thread */
+	struct ring done;
+	int done_data[DUMP_MAX_FRAMES];
+	int done_evfd;
+
+	/* frames queued and not reported done, main thread only */
+	int pending;
+
+	/* subsampled frame, written by the writer thread */
+	uint8_t *scaled;
+	size_t scaled_size;
+
+	/* Metrics, written by the writer thread */
+	unsigned long frames;
+	uint64_t bytes;
+	int error;
+};
+
+/* Open the output, "-" is the standard output, and start the writer */
+int dump_open(struct dump *d, const char *path);
+void dump_close(struct dump *d);
+
+/* Queue a frame, the capture buffer must not be reused until done */
+int dump_frame(struct dump *d, const struct dump_frame *f);
+
+/* Get the index of a capture buffer written, returns 0 if none */
+int dump_take(struct dump *d, int *index);
+
+/* Wait for the writer to report frames done, the eventfd becomes
+ * readable when it does */
+void dump_wait(struct dump *d);
+int dump_get_fd(struct dump *d);
+
+/* Size of a frame as written, once subsampled */
+void dump_frame_size(const struct dump_frame *f, int *w, int *h);
+
+/* CRC-32 of the visible area of a frame, as it would be written */
+uint32_t dump_checksum(const struct dump_frame *f);
+
+#endif /* INCLUDE_DUMP_H */
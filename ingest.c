@@ -0,0 +1,424 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Elementary stream ingest
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/videodev2.h>
+#include <media/msm_vidc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "ingest.h"
+
+#define DBG_TAG "ingest"
+
+/* Bytes read from the standard input at once, the bytes read past the
+ * end of an access unit are the only ones copied */
+#define INGEST_READ_SIZE	(64 * 1024)
+
+/* Period in ms at which the interrupt callback is checked while
+ * waiting for data */
+#define INGEST_POLL_MS		100
+
+/* Properties of a NAL unit that matter to split access units */
+#define NAL_VCL			(1 << 0)
+#define NAL_FIRST		(1 << 1)	/* starts an access unit */
+#define NAL_KEY			(1 << 2)
+
+int
+ingest_is_url(const char *url)
+{
+	return !strcmp(url, "-") || !strncmp(url, "shm:", 4) ||
+		!strncmp(url, "fd:", 3);
+}
+
+/* Classify a NAL unit from its header and the first byte of its
+ * payload, which holds the first slice flag of the VCL units. The
+ * rules are those of the first VCL unit of a picture detection in the
+ * H.264 (7.4.1.2.3) and HEVC (7.4.2.4.4) specifications, without
+ * comparing the slice headers. */
+static int
+nal_flags(uint32_t codec, const uint8_t *nal)
+{
+	int type;
+
+	if (codec == V4L2_PIX_FMT_HEVC) {
+		type = (nal[0] >> 1) & 0x3f;
+
+		if (type < 32)
+			return NAL_VCL | (nal[2] & 0x80 ? NAL_FIRST : 0) |
+				(type >= 16 && type <= 23 ? NAL_KEY : 0);
+
+		/* VPS, SPS, PPS, AUD, prefix SEI and reserved types */
+		if ((type >= 32 && type <= 35) || type == 39 ||
+		    (type >= 41 && type <= 44) || (type >= 48 && type <= 55))
+			return NAL_FIRST;
+
+		return 0;
+	}
+
+	type = nal[0] & 0x1f;
+
+	if (type >= 1 && type <= 5)
+		return NAL_VCL | (nal[1] & 0x80 ? NAL_FIRST : 0) |
+			(type == 5 ? NAL_KEY : 0);
+
+	/* SEI, SPS, PPS, AUD and prefix or reserved types */
+	if ((type >= 6 && type <= 9) || (type >= 14 && type <= 18))
+		return NAL_FIRST;
+
+	return 0;
+}
+
+static ssize_t
+ingest_read_fd(struct ingest *in, uint8_t *dst, size_t size)
+{
+	struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+	ssize_t ret;
+
+	for (;;) {
+		if (in->interrupt(in->opaque))
+			return -1;
+
+		ret = poll(&pfd, 1, INGEST_POLL_MS);
+		if (ret < 0 && errno != EINTR) {
+			err("failed to poll the standard input: %m");
+			return -1;
+		}
+		if (ret <= 0)
+			continue;
+
+		ret = read(in->fd, dst, size);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err("failed to read the standard input: %m");
+		}
+
+		return ret;
+	}
+}
+
+/*
+ * The byte stream is read straight into the buffer, until the start of
+ * the next access unit shows up: a NAL unit opening a picture once the
+ * current one has a VCL unit. What was read past it is kept for the
+ * next call.
+ */
+static int
+ingest_read_stdin(struct ingest *in, uint8_t *dst, size_t size,
+		  struct ingest_unit *unit)
+{
+	size_t need = in->codec == V4L2_PIX_FMT_HEVC ? 3 : 2;
+	size_t len, scan = 0;
+	int vcl = 0;
+	ssize_t ret;
+
+	if (in->carry_len > size) {
+		err("access unit too big for stream buffer");
+		return -1;
+	}
+
+	memcpy(dst, in->carry, in->carry_len);
+	len = in->carry_len;
+	in->carry_len = 0;
+
+	for (;;) {
+		while (scan + 3 + need <= len) {
+			const uint8_t *p = dst + scan;
+			size_t end = scan;
+			int flags;
+
+			if (p[0] || p[1] || p[2] != 1) {
+				scan++;
+				continue;
+			}
+
+			flags = nal_flags(in->codec, p + 3);
+
+			if (vcl && (flags & NAL_FIRST)) {
+				/* the zero byte of a 4 byte start code */
+				if (end > 0 && !dst[end - 1])
+					end--;
+
+				in->carry_len = len - end;
+				memcpy(in->carry, dst + end, in->carry_len);
+
+				return end;
+			}
+
+			if (flags & NAL_VCL)
+				vcl = 1;
+			if (flags & NAL_KEY)
+				unit->key = 1;
+
+			scan += 3;
+		}
+
+		if (in->eof)
+			return len;
+
+		if (len == size) {
+			err("access unit too big (more than %zu bytes) for "
+			    "stream buffer", size);
+			return -1;
+		}
+
+		ret = ingest_read_fd(in, dst + len,
+				     MIN(size - len, INGEST_READ_SIZE));
+		if (ret < 0)
+			return -1;
+
+		if (!ret)
+			in->eof = 1;
+		len += ret;
+	}
+}
+
+static void
+futex_wait(uint32_t *addr, uint32_t val, int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000,
+	};
+
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int
+ingest_read_shm(struct ingest *in, uint8_t *dst, size_t size,
+		struct ingest_unit *unit)
+{
+	struct ingest_shm_header *shm = in->shm;
+	struct ingest_shm_slot *slot;
+	uint32_t head, tail, len;
+
+	tail = __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+		if (head != tail)
+			break;
+
+		/* eos is set after the last head update */
+		if (__atomic_load_n(&shm->eos, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) ==
+			    tail)
+				return 0;
+			continue;
+		}
+
+		if (in->interrupt(in->opaque))
+			return -1;
+
+		futex_wait(&shm->head, head, INGEST_POLL_MS);
+	}
+
+	slot = (struct ingest_shm_slot *)((uint8_t *)(shm + 1) +
+		(size_t)(tail % in->shm_slots) * in->shm_slot_size);
+
+	/* read once, the producer can still write the slot */
+	len = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+	if (len > in->shm_slot_size - sizeof (*slot) || len > size) {
+		err("access unit too big (size=%u) for stream buffer", len);
+		return -1;
+	}
+
+	memcpy(dst, slot->data, len);
+	unit->pts = slot->pts;
+	unit->key = !!(slot->flags & INGEST_SHM_KEY);
+
+	__atomic_store_n(&shm->tail, tail + 1, __ATOMIC_RELEASE);
+	futex_wake(&shm->tail);
+
+	return len;
+}
+
+int
+ingest_read(struct ingest *in, uint8_t *dst, size_t size,
+	    struct ingest_unit *unit)
+{
+	unit->pts = INGEST_PTS_NONE;
+	unit->key = 0;
+
+	if (in->type == INGEST_SHM)
+		return ingest_read_shm(in, dst, size, unit);
+
+	return ingest_read_stdin(in, dst, size, unit);
+}
+
+size_t
+ingest_max_size(const struct ingest *in)
+{
+	if (in->type == INGEST_SHM)
+		return in->shm_slot_size - sizeof (struct ingest_shm_slot);
+
+	return 0;
+}
+
+static int
+ingest_open_shm(struct ingest *in, int fd)
+{
+	struct ingest_shm_header *shm;
+	uint32_t slots, slot_size;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		err("failed to get the ring size: %m");
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < sizeof (*shm)) {
+		err("ring too small (size=%jd)", (intmax_t)st.st_size);
+		close(fd);
+		return -1;
+	}
+
+	shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		err("failed to map the ring: %m");
+		return -1;
+	}
+
+	if (shm->magic != INGEST_SHM_MAGIC ||
+	    shm->version != INGEST_SHM_VERSION) {
+		err("not an ingest ring, or of an unsupported version");
+		goto fail;
+	}
+
+	if (shm->codec != V4L2_PIX_FMT_H264 &&
+	    shm->codec != V4L2_PIX_FMT_HEVC) {
+		err("unsupported ring codec %.4s", (char *)&shm->codec);
+		goto fail;
+	}
+
+	/* the layout is checked and used from a copy, the producer may
+	 * still write the header */
+	slots = __atomic_load_n(&shm->slots, __ATOMIC_RELAXED);
+	slot_size = __atomic_load_n(&shm->slot_size, __ATOMIC_RELAXED);
+	if (!slots || slot_size <= sizeof (struct ingest_shm_slot) ||
+	    slot_size % 8 ||
+	    sizeof (*shm) + (uint64_t)slots * slot_size >
+	    (uint64_t)st.st_size) {
+		err("invalid ring layout: %u slots of %u bytes in %jd bytes",
+		    slots, slot_size, (intmax_t)st.st_size);
+		goto fail;
+	}
+
+	in->type = INGEST_SHM;
+	in->shm = shm;
+	in->shm_size = st.st_size;
+	in->shm_slots = slots;
+	in->shm_slot_size = slot_size;
+	in->codec = shm->codec;
+	in->width = shm->width;
+	in->height = shm->height;
+	in->fps_n = shm->fps_n;
+	in->fps_d = shm->fps_d;
+
+	info("ingest ring of %u slots of %u bytes, %.4s %ux%u", slots,
+	     slot_size, (char *)&shm->codec, shm->width, shm->height);
+
+	return 0;
+
+fail:
+	munmap(shm, st.st_size);
+	return -1;
+}
+
+int
+ingest_open(struct ingest *in, const char *url, uint32_t codec,
+	    int (*interrupt)(void *opaque), void *opaque)
+{
+	char *end;
+	long fd;
+
+	memset(in, 0, sizeof (*in));
+	in->fd = -1;
+	in->interrupt = interrupt;
+	in->opaque = opaque;
+
+	if (!strncmp(url, "shm:", 4)) {
+		fd = open(url + 4, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			err("failed to open %s: %m", url + 4);
+			return -1;
+		}
+
+		return ingest_open_shm(in, fd);
+	}
+
+	if (!strncmp(url, "fd:", 3)) {
+		fd = strtol(url + 3, &end, 10);
+		if (end == url + 3 || *end || fd < 0 || fd > INT_MAX) {
+			err("invalid file descriptor %s", url + 3);
+			return -1;
+		}
+
+		return ingest_open_shm(in, fd);
+	}
+
+	if (codec != V4L2_PIX_FMT_H264 && codec != V4L2_PIX_FMT_HEVC) {
+		err("the codec of the standard input must be given, "
+		    "h264 or hevc");
+		return -1;
+	}
+
+	/* the carry holds at most a read, and a start code cut by it */
+	in->carry = malloc(INGEST_READ_SIZE + 8);
+	if (!in->carry) {
+		err("failed to allocate the ingest buffer");
+		return -1;
+	}
+
+	in->type = INGEST_STDIN;
+	in->fd = STDIN_FILENO;
+	in->codec = codec;
+
+	return 0;
+}
+
+void
+ingest_close(struct ingest *in)
+{
+	if (in->shm)
+		munmap(in->shm, in->shm_size);
+	free(in->carry);
+
+	memset(in, 0, sizeof (*in));
+	in->fd = -1;
+}
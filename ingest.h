@@ -0,0 +1,134 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Elementary stream ingest header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_INGEST_H
+#define INCLUDE_INGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sources of H.264 or HEVC access units that bypass libavformat, for
+ * producers that already have an elementary stream:
+ *
+ *  - "-": an Annex-B byte stream on the standard input, split into
+ *    access units, the codec must be given
+ *  - "shm:<path>" or "fd:<n>": a ring of access units with their PTS in
+ *    shared memory, e.g. a memfd inherited from the producer
+ *
+ * The access units are read straight into the OUTPUT buffers.
+ */
+enum ingest_type {
+	INGEST_NONE,
+	INGEST_STDIN,
+	INGEST_SHM,
+};
+
+/* Layout of the shared memory ring, as written by the producer */
+#define INGEST_SHM_MAGIC	0x48533456	/* "V4SH" */
+#define INGEST_SHM_VERSION	1
+
+/* Set on access units starting with a random access point */
+#define INGEST_SHM_KEY		(1 << 0)
+
+#define INGEST_PTS_NONE		((uint64_t)-1)
+
+/* Frame rate assumed when neither the source nor the options tell */
+#define INGEST_DEFAULT_FPS	30
+
+/*
+ * The header is followed by the slots, of slot_size bytes each. The
+ * producer fills the slot at head % slots then increments head, the
+ * consumer increments tail once done with the slot at tail % slots.
+ * Both are free running and accessed atomically, the ring is full when
+ * head - tail equals slots. A side waiting for the other may sleep on
+ * the futex of the counter it waits for, both wake it after an update.
+ * The producer sets eos once the last access unit is in the ring.
+ */
+struct ingest_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t codec;		/* V4L2_PIX_FMT_H264 or V4L2_PIX_FMT_HEVC */
+	uint32_t width;		/* 0 if unknown */
+	uint32_t height;
+	uint32_t fps_n;		/* 0 if unknown */
+	uint32_t fps_d;
+	uint32_t slots;
+	uint32_t slot_size;	/* slot header included, a multiple of 8 */
+	uint32_t eos;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t reserved[4];	/* the slots start 64 bytes in */
+};
+
+struct ingest_shm_slot {
+	uint64_t pts;		/* us, INGEST_PTS_NONE if unknown */
+	uint32_t size;
+	uint32_t flags;
+	uint8_t data[];
+};
+
+struct ingest_unit {
+	uint64_t pts;		/* us, INGEST_PTS_NONE if unknown */
+	int key;
+};
+
+struct ingest {
+	enum ingest_type type;
+	uint32_t codec;
+	int width, height;	/* 0 if unknown */
+	int fps_n, fps_d;
+
+	/* checked while waiting for data, stops reading when it returns
+	 * non zero */
+	int (*interrupt)(void *opaque);
+	void *opaque;
+
+	/* standard input: the bytes read past the end of the last access
+	 * unit, which start the next one */
+	int fd;
+	uint8_t *carry;
+	size_t carry_len;
+	int eof;
+
+	/* shared memory ring */
+	struct ingest_shm_header *shm;
+	size_t shm_size;
+	uint32_t shm_slots;		/* layout as checked at open */
+	uint32_t shm_slot_size;
+};
+
+/* Tell whether an url names an ingest source */
+int ingest_is_url(const char *url);
+
+/* Open an ingest source, codec is the V4L2 pixel format of the stream
+ * on the standard input, the ring tells its own */
+int ingest_open(struct ingest *in, const char *url, uint32_t codec,
+		int (*interrupt)(void *opaque), void *opaque);
+void ingest_close(struct ingest *in);
+
+/* Largest access unit the source can provide, 0 if unbounded */
+size_t ingest_max_size(const struct ingest *in);
+
+/* Read the next access unit into dst, returns its size, 0 at the end of
+ * the stream or -1 on error or when interrupted */
+int ingest_read(struct ingest *in, uint8_t *dst, size_t size,
+		struct ingest_unit *unit);
+
+#endif /* INCLUDE_INGEST_H */
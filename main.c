@@ -26,15 +26,24 @@
 #include <linux/input.h>
 #include <linux/videodev2.h>
 #include <media/msm_vidc.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <poll.h>
 #include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <termios.h>
 #include <unistd.h>
 
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "args.h"
 #include "common.h"
 #include "video.h"
@@ -45,48 +54,146 @@
 #define av_err(errnum, fmt, ...) \
 	err(fmt ": %s", ##__VA_ARGS__, av_err2str(errnum))
 
-/* This is the size of the buffer for the compressed stream.
- * It limits the maximum compressed frame size. */
-#define STREAM_BUUFER_SIZE	(1024 * 1024)
+/* Bounds of the size of the buffer for the compressed stream, which
+ * limits the maximum compressed frame size */
+#define STREAM_BUFFER_MIN	(64 * 1024)
+#define STREAM_BUFFER_MAX	(16 * 1024 * 1024)
+/* smallest buffer for the keyframes of a stream, unless below half its
+ * raw frame */
+#define STREAM_BUFFER_KEYFRAME	(1024 * 1024)
+
+/* Number of average frames the stream buffer slab holds on top of two
+ * of the largest frames */
+#define STREAM_SLAB_FRAMES	8
+
+/* Number of stream buffers, packed in the slab */
+#define STREAM_BUFFERS		MAX_OUT_BUF
+
+/* Capture buffers needed on top of the decoder minimum: one on screen
+ * and one waiting for the compositor */
+#define CAPTURE_EXTRA_DISPLAY	2
+#define CAPTURE_EXTRA_HEADLESS	1
+
+/* Capture buffers absorbing the write latency when dumping frames */
+#define CAPTURE_EXTRA_DUMP	4
+
+/* Capture buffers to use if the decoder minimum is unknown */
+#define CAPTURE_DEFAULT_COUNT	4
+
+/* Seek steps of the arrow keys, in us */
+#define SEEK_STEP		10000000
+#define SEEK_LONG_STEP		60000000
+
+/* Keyframe only playback directions, 0 is normal playback */
+#define TRICK_NONE		0
+#define TRICK_FORWARD		1
+#define TRICK_REWIND		-1
+
+/* Stream time stepped back between the keyframes shown when rewinding */
+#define TRICK_REWIND_STEP	1000000
 
 static void stream_close(struct instance *i);
+static int stream_probe(struct instance *i, const char *url,
+			AVFormatContext **avctx);
+static int stream_setup(struct instance *i, AVFormatContext *avctx);
+static void stream_buffer_size(struct instance *i, unsigned int *size,
+			       unsigned int *slab_size);
+static void handle_dump(struct instance *i);
 
-static const int event_type[] = {
-	V4L2_EVENT_MSM_VIDC_FLUSH_DONE,
-	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT,
-	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT,
-	V4L2_EVENT_MSM_VIDC_SYS_ERROR,
-	V4L2_EVENT_MSM_VIDC_HW_OVERLOAD,
-	V4L2_EVENT_MSM_VIDC_HW_UNSUPPORTED,
-	V4L2_EVENT_MSM_VIDC_RELEASE_BUFFER_REFERENCE,
-	V4L2_EVENT_MSM_VIDC_RELEASE_UNQUEUED_BUFFER,
-};
+static struct fb *
+find_fb(struct instance *i, int group, int index)
+{
+	struct fb *fb;
+
+	list_for_each_entry(fb, &i->fb_list, link) {
+		if (fb->group == group && fb->index == index && fb->buffer)
+			return fb;
+	}
+
+	return NULL;
+}
 
+/* Create the window buffers of all the capture buffers up front, the
+ * compositor creates them asynchronously */
 static int
-subscribe_events(struct instance *i)
+create_fbs(struct instance *i)
 {
-	const int n_events = sizeof(event_type) / sizeof(event_type[0]);
-	int idx;
+	struct video *vid = &i->video;
+	uint64_t modifier;
+	uint32_t format;
+	struct fb *fb;
 
-	for (idx = 0; idx < n_events; idx++) {
-		if (video_subscribe_event(i, event_type[idx]))
+	video_drm_format(vid->cap_buf_format, &format, &modifier);
+
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		fb = window_create_buffer(i->window, i->group, n,
+					  vid->cap_buf_fd[n],
+					  format, modifier,
+					  vid->cap_w, vid->cap_h,
+					  vid->cap_planes_count,
+					  vid->cap_plane_off,
+					  vid->cap_plane_stride);
+		if (!fb) {
+			err("could not create framebuffer for "
+			    "video buffer %d", n);
 			return -1;
+		}
+
+		list_add_tail(&fb->link, &i->fb_list);
 	}
 
 	return 0;
 }
 
-static struct fb *
-find_fb(struct instance *i, int group, int index)
+static int
+capture_buffer_count(struct instance *i)
+{
+	int count;
+
+	count = video_min_capture_buffers(i);
+	if (count <= 0)
+		return CAPTURE_DEFAULT_COUNT;
+
+	if (i->dump_path)
+		count += CAPTURE_EXTRA_DUMP;
+	else if (i->window)
+		count += CAPTURE_EXTRA_DISPLAY;
+	else
+		count += CAPTURE_EXTRA_HEADLESS;
+
+	dbg("using %d capture buffers", count);
+
+	return MIN(count, MAX_CAP_BUF);
+}
+
+/*
+ * Get the capture buffers ready for a format change while the capture
+ * queue is flushed: the frames still waiting for presentation are
+ * dropped, the buffers held by the compositor are left to it so that
+ * the last frame stays on screen, and only the buffers that do not fit
+ * the new format are allocated again.
+ */
+static void
+prepare_capture(struct instance *i)
 {
 	struct fb *fb;
 
+	sched_clear(&i->sched);
+
+	/* the writer must be done with the buffers first */
+	while (i->dump.pending) {
+		dump_wait(&i->dump);
+		handle_dump(i);
+	}
+
 	list_for_each_entry(fb, &i->fb_list, link) {
-		if (fb->group == group && fb->index == index && fb->buffer)
-			return fb;
+		if (fb->group == i->group && fb->busy)
+			video_detach_capture_buffer(i, fb->index);
 	}
 
-	return NULL;
+	if (video_prepare_capture(i, capture_buffer_count(i),
+				  i->width, i->height))
+		err("failed to prepare capture buffers, retrying on setup");
 }
 
 static int
@@ -96,6 +203,9 @@ restart_capture(struct instance *i)
 	struct fb *fb, *next;
 	int n;
 
+	/* The scheduled frames belong to the old buffers */
+	sched_clear(&i->sched);
+
 	/*
 	 * Destroy window buffers that are not in use by the
 	 * wayland compositor; buffers in use will be destroyed
@@ -106,12 +216,13 @@ restart_capture(struct instance *i)
 			fb_destroy(fb);
 	}
 
-	/* Stop capture and release buffers */
-	if (vid->cap_buf_cnt > 0 && video_stop_capture(i))
+	/* Stop capture, the buffers are kept for the new setup */
+	if (vid->cap_buf_cnt > 0 && video_release_capture(i))
 		return -1;
 
 	/* Setup capture queue with new parameters */
-	if (video_setup_capture(i, 4, i->width, i->height))
+	if (video_setup_capture(i, capture_buffer_count(i),
+				i->width, i->height))
 		return -1;
 
 	/* Start streaming */
@@ -130,6 +241,9 @@ restart_capture(struct instance *i)
 	 */
 	i->group++;
 
+	if (i->window && create_fbs(i))
+		return -1;
+
 	return 0;
 }
 
@@ -187,13 +301,17 @@ pic_struct_to_string(int pic)
 	return "unknown";
 }
 
+static void seek_flush_done(struct instance *i);
+
 static int
 handle_video_event(struct instance *i)
 {
 	struct v4l2_event event;
+	int ret;
 
-	if (video_dequeue_event(i, &event))
-		return -1;
+	ret = video_dequeue_event(i, &event);
+	if (ret < 0)
+		return ret;
 
 	switch (event.type) {
 	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT: {
@@ -242,10 +360,16 @@ handle_video_event(struct instance *i)
 		i->width = width;
 		i->height = height;
 		i->reconfigure_pending = 1;
+		i->reconfigure_time = time_us(CLOCK_MONOTONIC);
+		i->video.reconfigures++;
+		perf_reconfigure(i);
 
 		/* flush capture queue, we will reconfigure it when flush
 		 * done event is received */
 		video_flush(i, V4L2_QCOM_CMD_FLUSH_CAPTURE);
+
+		/* meanwhile, get the buffers ready for the new format */
+		prepare_capture(i);
 		break;
 	}
 	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT:
@@ -265,22 +389,31 @@ handle_video_event(struct instance *i)
 			restart_capture(i);
 			i->reconfigure_pending = 0;
 		}
+
+		if (atomic_load(&i->flush_pending) &&
+		    (flags & V4L2_QCOM_CMD_FLUSH_OUTPUT))
+			seek_flush_done(i);
 		break;
 	}
 	case V4L2_EVENT_MSM_VIDC_SYS_ERROR:
 		dbg("SYS Error received");
+		i->video.sys_errors++;
 		break;
 	case V4L2_EVENT_MSM_VIDC_HW_OVERLOAD:
 		dbg("HW Overload received");
+		i->video.hw_overloads++;
+		perf_overload(i);
 		break;
 	case V4L2_EVENT_MSM_VIDC_HW_UNSUPPORTED:
 		dbg("HW Unsupported received");
+		i->video.hw_unsupported++;
 		break;
 	case V4L2_EVENT_MSM_VIDC_RELEASE_BUFFER_REFERENCE:
 		dbg("Release buffer reference");
 		break;
 	case V4L2_EVENT_MSM_VIDC_RELEASE_UNQUEUED_BUFFER:
 		dbg("Release unqueued buffer");
+		i->video.release_unqueued++;
 		break;
 	default:
 		dbg("unknown event type occurred %x", event.type);
@@ -294,51 +427,139 @@ static void
 cleanup(struct instance *i)
 {
 	stream_close(i);
+	ingest_close(&i->ingest);
 	if (i->window)
 		window_destroy(i->window);
-	if (i->display)
-		display_destroy(i->display);
-	if (i->sigfd != 1)
-		close(i->sigfd);
 	if (i->video.fd)
 		video_close(i);
 }
 
-struct ts_entry {
-	uint64_t pts;
-	uint64_t dts;
-	uint64_t duration;
-	uint64_t base;
-	struct list_head link;
-};
-
 #define TIMESTAMP_NONE	((uint64_t)-1)
 
+static void
+ts_sift_up(struct ts_entry *heap, int n)
+{
+	struct ts_entry e = heap[n];
+
+	while (n > 0) {
+		int parent = (n - 1) / 2;
+
+		if (heap[parent].dts <= e.dts)
+			break;
+
+		heap[n] = heap[parent];
+		n = parent;
+	}
+
+	heap[n] = e;
+}
+
+static void
+ts_sift_down(struct ts_entry *heap, int count, int n)
+{
+	struct ts_entry e = heap[n];
+
+	for (;;) {
+		int child = 2 * n + 1;
+
+		if (child >= count)
+			break;
+
+		if (child + 1 < count && heap[child + 1].dts < heap[child].dts)
+			child++;
+
+		if (e.dts <= heap[child].dts)
+			break;
+
+		heap[n] = heap[child];
+		n = child;
+	}
+
+	heap[n] = e;
+}
+
+/* Remove the entry with the lowest DTS */
+static void
+ts_remove_min(struct video *vid)
+{
+	if (!vid->pending_ts_count)
+		return;
+
+	vid->pending_ts[0] = vid->pending_ts[--vid->pending_ts_count];
+
+	if (vid->pending_ts_count)
+		ts_sift_down(vid->pending_ts, vid->pending_ts_count, 0);
+}
+
 static struct ts_entry *
-ts_insert(struct video *vid, uint64_t pts, uint64_t dts, uint64_t duration,
-	  uint64_t base)
+ts_min(struct video *vid)
+{
+	return vid->pending_ts_count ? &vid->pending_ts[0] : NULL;
+}
+
+static struct ts_times *
+ts_times_slot(struct video *vid, uint64_t pts)
+{
+	uint64_t hash = pts * 0x9e3779b97f4a7c15ull;
+
+	return &vid->pending_times[(hash >> 32) & (MAX_PENDING_TS - 1)];
+}
+
+static void
+ts_insert(struct video *vid, const struct ts_entry *ts,
+	  const struct frame_times *times)
 {
-	struct ts_entry *l;
+	if (ts->pts != TIMESTAMP_NONE) {
+		struct ts_times *slot = ts_times_slot(vid, ts->pts);
+
+		slot->pts = ts->pts;
+		slot->times = *times;
+	}
 
-	l = malloc(sizeof (*l));
-	if (!l)
-		return NULL;
+	/* entries without DTS can never be picked as the lowest one */
+	if (ts->dts == TIMESTAMP_NONE)
+		return;
 
-	l->pts = pts;
-	l->dts = dts;
-	l->duration = duration;
-	l->base = base;
+	/* the decoder dropped frames without returning them, forget about
+	 * the oldest one */
+	if (vid->pending_ts_count == MAX_PENDING_TS) {
+		dbg("pending timestamps full, drop dts %" PRIu64,
+		    vid->pending_ts[0].dts);
+		ts_remove_min(vid);
+	}
 
-	list_add_tail(&l->link, &vid->pending_ts_list);
+	vid->pending_ts[vid->pending_ts_count] = *ts;
 
-	return l;
+	ts_sift_up(vid->pending_ts, vid->pending_ts_count++);
 }
 
+/* Move the timestamps sent by the parser thread to the heap */
 static void
-ts_remove(struct ts_entry *l)
+ts_collect(struct video *vid)
+{
+	struct ts_record rec;
+
+	while (ring_pop(&vid->ts_queue, &rec))
+		ts_insert(vid, &rec.ts, &rec.times);
+}
+
+/* Take the timing of the frame with the given PTS, if still known */
+static bool
+ts_take_times(struct video *vid, uint64_t pts, struct frame_times *times)
 {
-	list_del(&l->link);
-	free(l);
+	struct ts_times *slot;
+
+	if (pts == TIMESTAMP_NONE)
+		return false;
+
+	slot = ts_times_slot(vid, pts);
+	if (slot->pts != pts)
+		return false;
+
+	*times = slot->times;
+	slot->pts = TIMESTAMP_NONE;
+
+	return true;
 }
 
 static int
@@ -377,19 +598,43 @@ parse_frame(struct instance *i, AVPacket *pkt)
 	return 0;
 }
 
+/* eventfd waking up the main loop from the other threads */
+static int wake_evfd = -1;
+
+/* Monotonic time in us when the program started */
+static uint64_t launch_time;
+
+/* Account the time to the first picture, shown or decoded when not
+ * displaying */
+static void
+first_frame(struct instance *i)
+{
+	if (i->first_frame_time)
+		return;
+
+	i->first_frame_time = MAX(time_us(CLOCK_MONOTONIC) - launch_time, 1);
+
+	info("first frame of %s after %.1f ms (probe %.1f ms)", i->url,
+	     i->first_frame_time / 1e3, i->probe_time / 1e3);
+}
+
 static void
 finish(struct instance *i)
 {
-	pthread_mutex_lock(&i->lock);
 	i->finish = 1;
-	pthread_cond_signal(&i->cond);
-	pthread_mutex_unlock(&i->lock);
+
+	pktq_abort(&i->pktq);
+
+	/* wake up the parser thread if waiting for a buffer and the main
+	 * loop to notice the instance is gone */
+	eventfd_write(i->free_evfd, 1);
+	if (wake_evfd >= 0)
+		eventfd_write(wake_evfd, 1);
 }
 
 static int
 send_eos(struct instance *i, int buf_index)
 {
-	struct video *vid = &i->video;
 	struct timeval tv;
 
 	tv.tv_sec = 0;
@@ -400,16 +645,14 @@ send_eos(struct instance *i, int buf_index)
 				V4L2_QCOM_BUF_TIMESTAMP_INVALID, tv) < 0)
 		return -1;
 
-	vid->out_buf_flag[buf_index] = 1;
-
 	return 0;
 }
 
 static char *
 dump_pkt(const uint8_t *data, size_t size)
 {
-	static char *buf;
-	static size_t buf_size;
+	static __thread char *buf;
+	static __thread size_t buf_size;
 	size_t s = size * 3 + 1;
 
 	if (!buf || buf_size < s) {
@@ -435,20 +678,71 @@ dump_pkt(const uint8_t *data, size_t size)
 
 
 /*
- * Escape start codes in BDU
+ * Get the length of the run of non zero bytes at the start of data,
+ * rounded down to whole blocks. An escape is only ever needed after two
+ * zero bytes, so such a run is copied as is.
+ */
+static size_t
+zero_free_run(const uint8_t *data, size_t size)
+{
+	size_t len = 0;
+
+#if defined(__aarch64__)
+	while (size - len >= 16) {
+		uint8x16_t v = vld1q_u8(data + len);
+
+		if (vmaxvq_u8(vceqzq_u8(v)))
+			break;
+		len += 16;
+	}
+#else
+	while (size - len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, data + len, 8);
+		if ((v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL)
+			break;
+		len += 8;
+	}
+#endif
+
+	return len;
+}
+
+/*
+ * Escape start codes in BDU, returns -1 if dst is too small
  */
 static int
 rbdu_escape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
 {
 	uint8_t *dstp = dst;
+	uint8_t *dst_end = dst + dst_size;
 	const uint8_t *srcp = src;
 	const uint8_t *end = src + src_size;
 	int count = 0;
 
 	while (srcp < end) {
+		if (!count) {
+			size_t run = zero_free_run(srcp, end - srcp);
+
+			if (run) {
+				if (run > (size_t)(dst_end - dstp))
+					return -1;
+
+				memcpy(dstp, srcp, run);
+				dstp += run;
+				srcp += run;
+				continue;
+			}
+		}
+
 		if (count == 2 && *srcp <= 0x03) {
+			if (dst_end - dstp < 2)
+				return -1;
 			*dstp++ = 0x03;
 			count = 0;
+		} else if (dstp == dst_end) {
+			return -1;
 		}
 
 		if (*srcp == 0)
@@ -471,7 +765,11 @@ vc1_write_bdu(uint8_t *dst, int dst_size,
 	      uint8_t *bdu, int bdu_size,
 	      uint8_t type)
 {
-	int len;
+	int len, n;
+
+	/* the start code and the flushing byte */
+	if (dst_size < 5)
+		return -1;
 
 	/* add start code */
 	dst[0] = 0x00;
@@ -481,7 +779,10 @@ vc1_write_bdu(uint8_t *dst, int dst_size,
 	len = 4;
 
 	/* escape start codes */
-	len += rbdu_escape(dst + len, dst_size - len, bdu, bdu_size);
+	n = rbdu_escape(dst + len, dst_size - len - 1, bdu, bdu_size);
+	if (n < 0)
+		return -1;
+	len += n;
 
 	/* add flushing byte at the end of the BDU */
 	dst[len++] = 0x80;
@@ -546,859 +847,2816 @@ write_sequence_header_vc1(struct instance *i, uint8_t *data, int size)
 	return -1;
 }
 
+static const uint8_t nal_start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+/*
+ * Write a NAL unit prefixed with an Annex-B start code
+ */
 static int
-write_sequence_header(struct instance *i, uint8_t *data, int size)
+nal_write_annexb(uint8_t *dst, int dst_size, const uint8_t *nal, int nal_size)
 {
-	AVCodecParameters *codecpar = i->stream->codecpar;
+	int len = sizeof (nal_start_code) + nal_size;
 
-	switch (codecpar->codec_id) {
-	case AV_CODEC_ID_WMV3:
-	case AV_CODEC_ID_VC1:
-		return write_sequence_header_vc1(i, data, size);
-	default:
-		return 0;
-	}
+	if (len > dst_size)
+		return -1;
+
+	memcpy(dst, nal_start_code, sizeof (nal_start_code));
+	memcpy(dst + sizeof (nal_start_code), nal, nal_size);
+
+	return len;
 }
 
+/*
+ * Write parameter sets stored as a list of 16-bit size prefixed NAL units,
+ * as found in the avcC and hvcC boxes
+ */
 static int
-send_pkt(struct instance *i, int buf_index, AVPacket *pkt)
+nal_write_param_sets(uint8_t *dst, int dst_size, const uint8_t **src,
+		     const uint8_t *end, int count)
 {
-	struct video *vid = &i->video;
-	struct timeval tv;
-	uint64_t pts, dts, duration, start_time;
-	int flags;
-	int size;
-	uint8_t *data;
-	const char *hex;
-	AVRational vid_timebase;
-	AVRational v4l_timebase = { 1, 1000000 };
-	AVCodecParameters *codecpar = i->stream->codecpar;
+	const uint8_t *p = *src;
+	int len = 0;
 
-	data = (uint8_t *)vid->out_buf_addr[buf_index];
-	size = 0;
+	while (count--) {
+		int nal_size, n;
 
-	if (i->need_header) {
-		int n = write_sequence_header(i, data, vid->out_buf_size);
-		if (n > 0)
-			size += n;
+		if (end - p < 2)
+			return -1;
 
-		switch (codecpar->codec_id) {
-		case AV_CODEC_ID_WMV3:
-		case AV_CODEC_ID_VC1:
-			if (vc1_find_sc(pkt->data, MIN(10, pkt->size)) < 0)
-				i->insert_sc = 1;
-			break;
-		default:
-			break;
-		}
+		nal_size = p[0] << 8 | p[1];
+		p += 2;
 
-		i->need_header = 0;
-	}
+		if (end - p < nal_size)
+			return -1;
 
-	if ((codecpar->codec_id == AV_CODEC_ID_WMV3 ||
-	     codecpar->codec_id == AV_CODEC_ID_VC1) &&
-	    i->insert_sc) {
-		size += vc1_write_bdu(data + size, vid->out_buf_size - size,
-				      pkt->data, pkt->size, 0x0d);
-	} else {
-		memcpy(data + size, pkt->data, pkt->size);
-		size += pkt->size;
+		n = nal_write_annexb(dst + len, dst_size - len, p, nal_size);
+		if (n < 0)
+			return -1;
+
+		len += n;
+		p += nal_size;
 	}
 
-	flags = 0;
+	*src = p;
 
-	vid_timebase = i->stream->time_base;
+	return len;
+}
 
-	start_time = 0;
-	if (i->stream->start_time != AV_NOPTS_VALUE)
-		start_time = av_rescale_q(i->stream->start_time,
-					  vid_timebase, v4l_timebase);
+static int
+write_sequence_header_h264(struct instance *i, uint8_t *data, int size)
+{
+	AVCodecParameters *codecpar = i->stream->codecpar;
+	const uint8_t *p = codecpar->extradata;
+	const uint8_t *end = p + codecpar->extradata_size;
+	int count, len, n;
 
-	pts = TIMESTAMP_NONE;
-	if (pkt->pts != AV_NOPTS_VALUE)
-		pts = av_rescale_q(pkt->pts, vid_timebase, v4l_timebase);
+	/* avcC: version, profile, compat, level, length size, SPS count */
+	if (end - p < 6)
+		goto invalid;
 
-	dts = TIMESTAMP_NONE;
-	if (pkt->dts != AV_NOPTS_VALUE)
-		dts = av_rescale_q(pkt->dts, vid_timebase, v4l_timebase);
+	count = p[5] & 0x1f;
+	p += 6;
 
-	duration = TIMESTAMP_NONE;
-	if (pkt->duration) {
-		duration = av_rescale_q(pkt->duration,
-					vid_timebase, v4l_timebase);
-	}
+	len = nal_write_param_sets(data, size, &p, end, count);
+	if (len < 0 || end - p < 1)
+		goto invalid;
 
-	if (debug_level > 3)
-		hex = dump_pkt(data, size);
-	else
-		hex = "";
+	/* PPS count */
+	count = *p++;
 
-	dbg("input size=%d pts=%" PRIi64 " dts=%" PRIi64 " duration=%" PRIu64
-	     " start_time=%" PRIi64 "%s", size, pts, dts, duration,
-	     start_time, hex);
+	n = nal_write_param_sets(data + len, size - len, &p, end, count);
+	if (n < 0)
+		goto invalid;
 
-	if (pts != TIMESTAMP_NONE) {
-		tv.tv_sec = pts / 1000000;
-		tv.tv_usec = pts % 1000000;
-	} else {
-		flags |= V4L2_QCOM_BUF_TIMESTAMP_INVALID;
-		tv.tv_sec = 0;
-		tv.tv_usec = 0;
-	}
+	return len + n;
 
-	if ((pkt->flags & AV_PKT_FLAG_KEY) &&
-	    pts != TIMESTAMP_NONE && dts != TIMESTAMP_NONE)
-		vid->pts_dts_delta = pts - dts;
+invalid:
+	err("cannot parse H264 codec data");
+	return -1;
+}
 
-	if (video_queue_buf_out(i, buf_index, size, flags, tv) < 0)
-		return -1;
+static int
+write_sequence_header_hevc(struct instance *i, uint8_t *data, int size)
+{
+	AVCodecParameters *codecpar = i->stream->codecpar;
+	const uint8_t *p = codecpar->extradata;
+	const uint8_t *end = p + codecpar->extradata_size;
+	int arrays, len = 0;
 
-	pthread_mutex_lock(&i->lock);
-	ts_insert(vid, pts, dts, duration, start_time);
-	pthread_mutex_unlock(&i->lock);
+	/* hvcC: 22 bytes of configuration, then the NAL unit arrays */
+	if (end - p < 23)
+		goto invalid;
 
-	vid->out_buf_flag[buf_index] = 1;
+	p += 22;
+	arrays = *p++;
 
-	return 0;
-}
+	while (arrays--) {
+		int count, n;
 
-static int
-get_buffer_unlocked(struct instance *i)
-{
-	struct video *vid = &i->video;
+		/* array completeness and NAL type, then the NAL count */
+		if (end - p < 3)
+			goto invalid;
+
+		count = p[1] << 8 | p[2];
+		p += 3;
 
-	for (int n = 0; n < vid->out_buf_cnt; n++) {
-		if (!vid->out_buf_flag[n])
-			return n;
+		n = nal_write_param_sets(data + len, size - len, &p, end,
+					 count);
+		if (n < 0)
+			goto invalid;
+
+		len += n;
 	}
 
+	return len;
+
+invalid:
+	err("cannot parse HEVC codec data");
 	return -1;
 }
 
-/* This threads is responsible for parsing the stream and
- * feeding video decoder with consecutive frames to decode */
-static void *
-parser_thread_func(void *args)
+static int
+write_sequence_header(struct instance *i, uint8_t *data, int size)
 {
-	struct instance *i = (struct instance *)args;
-	AVPacket pkt;
-	int buf, parse_ret;
+	AVCodecParameters *codecpar = i->stream->codecpar;
 
-	dbg("Parser thread started");
+	switch (codecpar->codec_id) {
+	case AV_CODEC_ID_WMV3:
+	case AV_CODEC_ID_VC1:
+		return write_sequence_header_vc1(i, data, size);
+	case AV_CODEC_ID_H264:
+		if (!i->nal_length_size)
+			return 0;
+		return write_sequence_header_h264(i, data, size);
+	case AV_CODEC_ID_HEVC:
+		if (!i->nal_length_size)
+			return 0;
+		return write_sequence_header_hevc(i, data, size);
+	default:
+		return 0;
+	}
+}
 
-	av_init_packet(&pkt);
+/*
+ * Rewrite length prefixed NAL units (AVCC/HVCC) into Annex-B byte stream
+ * format while copying them into the OUTPUT buffer
+ */
+static int
+nal_convert_annexb(uint8_t *dst, int dst_size, const uint8_t *src,
+		   int src_size, int length_size)
+{
+	const uint8_t *end = src + src_size;
+	int len = 0;
 
-	while (1) {
-		parse_ret = parse_frame(i, &pkt);
-		if (parse_ret == AVERROR(EAGAIN))
-			continue;
+	while (end - src >= length_size) {
+		uint32_t nal_size = 0;
+		int n;
 
+		for (int k = 0; k < length_size; k++)
+			nal_size = nal_size << 8 | *src++;
 
-		buf = -1;
+		if (nal_size > (uint32_t)(end - src))
+			return -1;
 
-		pthread_mutex_lock(&i->lock);
-		while (!i->finish && (buf = get_buffer_unlocked(i)) < 0)
-			pthread_cond_wait(&i->cond, &i->lock);
-		pthread_mutex_unlock(&i->lock);
+		n = nal_write_annexb(dst + len, dst_size - len, src, nal_size);
+		if (n < 0)
+			return -1;
 
-		if (buf < 0) {
-			/* decoding stopped before parsing ended, abort */
-			break;
-		}
+		len += n;
+		src += nal_size;
+	}
 
-		if (parse_ret < 0) {
-			if (parse_ret == AVERROR_EOF)
-				dbg("Queue end of stream");
-			else
-				av_err(parse_ret, "Parsing failed");
+	return len;
+}
 
-			send_eos(i, buf);
-			break;
-		}
+/*
+ * Tell whether a packet of length prefixed NAL units carries parameter
+ * sets, only the NAL unit headers are read
+ */
+static int
+nal_has_param_sets(enum AVCodecID codec, const uint8_t *p, int size,
+		   int length_size)
+{
+	const uint8_t *end = p + size;
 
-		if (send_pkt(i, buf, &pkt) < 0)
-			break;
+	while (end - p > length_size) {
+		uint32_t nal_size = 0;
+		int type;
 
-		av_packet_unref(&pkt);
-	}
+		for (int k = 0; k < length_size; k++)
+			nal_size = nal_size << 8 | *p++;
 
-	av_packet_unref(&pkt);
+		if (!nal_size || nal_size > (uint32_t)(end - p))
+			break;
 
-	dbg("Parser thread finished");
+		if (codec == AV_CODEC_ID_HEVC) {
+			/* VPS, SPS or PPS */
+			type = (p[0] >> 1) & 0x3f;
+			if (type >= 32 && type <= 34)
+				return 1;
+		} else {
+			/* SPS or PPS */
+			type = p[0] & 0x1f;
+			if (type == 7 || type == 8)
+				return 1;
+		}
 
-	return NULL;
+		p += nal_size;
+	}
+
+	return 0;
 }
 
-static void
-buffer_released(struct fb *fb, void *data)
+/*
+ * Get the NAL length prefix size from avcC/hvcC codec data; returns 0 if
+ * the codec data is missing or the stream is already in Annex-B format
+ */
+static int
+nal_length_size(AVCodecParameters *codecpar)
 {
-	struct instance *i = data;
-	int n = fb->index;
+	const uint8_t *p = codecpar->extradata;
+	int size = codecpar->extradata_size;
 
-	if (fb->group != i->group) {
-		fb_destroy(fb);
-		return;
+	switch (codecpar->codec_id) {
+	case AV_CODEC_ID_H264:
+		if (size < 7 || p[0] != 1)
+			return 0;
+		return (p[4] & 0x03) + 1;
+	case AV_CODEC_ID_HEVC:
+		if (size < 23 || (!p[0] && !p[1] && p[2] <= 1))
+			return 0;
+		return (p[21] & 0x03) + 1;
+	default:
+		return 0;
 	}
+}
 
-	if (!i->reconfigure_pending)
-		video_queue_buf_cap(i, n);
+/* Duration of a frame in us, 0 if the frame rate is unknown */
+static uint64_t
+frame_period(struct instance *i)
+{
+	if (i->fps_n > 0 && i->fps_d > 0)
+		return 1000000LL * i->fps_d / i->fps_n;
+
+	return 0;
 }
 
-static struct fb *
-get_fb(struct instance *i, int n)
+/* Duration of the content of a packet in us, or of a frame when the
+ * container does not tell */
+static uint64_t
+packet_duration(struct instance *i, AVPacket *pkt)
 {
-	struct video *vid = &i->video;
-	struct fb *fb;
+	AVRational v4l_timebase = { 1, 1000000 };
 
-	fb = find_fb(i, i->group, n);
-	if (!fb) {
-		fb = window_create_buffer(i->window, i->group, n,
-					  vid->cap_buf_fd[n],
-					  vid->cap_buf_format,
-					  vid->cap_w, vid->cap_h,
-					  vid->cap_planes_count,
-					  vid->cap_plane_off,
-					  vid->cap_plane_stride);
-		if (fb)
-			list_add_tail(&fb->link, &i->fb_list);
-	}
+	if (pkt->duration > 0)
+		return av_rescale_q(pkt->duration, i->stream->time_base,
+				    v4l_timebase);
 
-	return fb;
+	return frame_period(i);
 }
 
+/* Queue an OUTPUT buffer holding size bytes of a packet, with its times
+ * in us from start_time */
 static int
-handle_video_capture(struct instance *i)
+queue_pkt(struct instance *i, int buf_index, int size, uint64_t pts,
+	  uint64_t dts, uint64_t duration, uint64_t start_time, int key)
 {
 	struct video *vid = &i->video;
 	struct timeval tv;
-	uint32_t flags;
-	uint64_t pts;
-	unsigned int bytesused;
-	struct msm_vidc_extradata_header *extradata;
-	bool busy;
-	int ret, n;
+	struct ts_record rec;
+	int flags = 0;
+	const char *hex;
 
-	/* capture buffer is ready */
+	/* the clips of a playlist follow each other on the decoder */
+	if (pts != TIMESTAMP_NONE) {
+		uint64_t end = MAX(pts, start_time) - start_time +
+			i->clip_offset +
+			(duration != TIMESTAMP_NONE ? duration :
+			 frame_period(i));
 
-	ret = video_dequeue_capture(i, &n, &bytesused, &flags, &tv, &extradata);
-	if (ret < 0) {
-		err("dequeue capture buffer fail");
-		return ret;
+		i->clip_end = MAX(i->clip_end, end);
+		pts += i->clip_offset;
 	}
 
-	if (flags & V4L2_QCOM_BUF_TIMESTAMP_INVALID)
-		pts = TIMESTAMP_NONE;
+	if (dts != TIMESTAMP_NONE)
+		dts += i->clip_offset;
+
+	if (debug_level > 3)
+		hex = dump_pkt((uint8_t *)vid->out_buf_addr[buf_index], size);
 	else
-		pts = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+		hex = "";
 
-	busy = false;
+	dbg("input size=%d pts=%" PRIi64 " dts=%" PRIi64 " duration=%" PRIu64
+	     " start_time=%" PRIi64 "%s", size, pts, dts, duration,
+	     start_time, hex);
 
-	if (bytesused > 0) {
-		struct ts_entry *l, *min = NULL;
-		int pending = 0;
+	if (pts != TIMESTAMP_NONE) {
+		tv.tv_sec = pts / 1000000;
+		tv.tv_usec = pts % 1000000;
+	} else {
+		flags |= V4L2_QCOM_BUF_TIMESTAMP_INVALID;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	}
 
-		vid->total_captured++;
+	if (key && pts != TIMESTAMP_NONE && dts != TIMESTAMP_NONE)
+		vid->pts_dts_delta = pts - dts;
 
-		pthread_mutex_lock(&i->lock);
+	/* the record must be there before the decoder returns the frame */
+	memzero(rec);
+	rec.ts.pts = pts;
+	rec.ts.dts = dts;
+	rec.ts.duration = duration;
+	rec.ts.base = start_time + i->clip_offset;
+	rec.ts.offset = i->clip_offset;
+	rec.ts.pos = i->read_pos;
+	rec.times.t[STAGE_READ] = i->read_time;
+	rec.times.t[STAGE_QUEUED] = time_us(CLOCK_MONOTONIC);
 
-		/* PTS are expected to be monotonically increasing,
-		 * so when unknown use the lowest pending DTS */
-		list_for_each_entry(l, &vid->pending_ts_list, link) {
-			if (l->dts == TIMESTAMP_NONE)
-				continue;
-			if (min == NULL || min->dts > l->dts)
-				min = l;
-			pending++;
-		}
+	if (!ring_push(&vid->ts_queue, &rec))
+		dbg("timestamp queue full, drop pts %" PRIu64, pts);
 
-		if (min) {
-			dbg("pending %d min pts %" PRIi64
-			    " dts %" PRIi64
-			    " duration %" PRIi64, pending,
-			    min->pts, min->dts, min->duration);
-		}
+	if (video_queue_buf_out(i, buf_index, size, flags, tv) < 0)
+		return -1;
 
-		if (pts == TIMESTAMP_NONE) {
-			dbg("no pts on frame");
-			if (min && vid->pts_dts_delta != TIMESTAMP_NONE) {
-				dbg("reuse dts %" PRIu64
-				    " delta %" PRIu64,
-				    min->dts, vid->pts_dts_delta);
-				pts = min->dts + vid->pts_dts_delta;
-			}
-		}
+	return 0;
+}
 
-		if (pts == TIMESTAMP_NONE) {
-			if (min && vid->cap_last_pts != TIMESTAMP_NONE)
-				pts = vid->cap_last_pts + min->duration;
-			else
-				pts = 0;
+static int
+send_pkt(struct instance *i, int buf_index, AVPacket *pkt)
+{
+	struct video *vid = &i->video;
+	uint64_t pts, dts, duration, start_time;
+	int size;
+	uint8_t *data;
+	AVRational vid_timebase;
+	AVRational v4l_timebase = { 1, 1000000 };
+	AVCodecParameters *codecpar = i->stream->codecpar;
 
-			dbg("guessing pts %" PRIu64, pts);
-		}
+	data = (uint8_t *)vid->out_buf_addr[buf_index];
+	size = 0;
 
-		vid->cap_last_pts = pts;
+	/* as the bitstream filter does, the parameter sets also go before
+	 * the keyframes that do not carry them */
+	if (i->need_header ||
+	    (i->nal_length_size && (pkt->flags & AV_PKT_FLAG_KEY) &&
+	     !nal_has_param_sets(codecpar->codec_id, pkt->data, pkt->size,
+				 i->nal_length_size))) {
+		int n = write_sequence_header(i, data, vid->out_buf_size);
+		if (n > 0)
+			size += n;
+	}
 
-		if (min != NULL) {
-			pts -= min->base;
-			ts_remove(min);
+	if (i->need_header) {
+		switch (codecpar->codec_id) {
+		case AV_CODEC_ID_WMV3:
+		case AV_CODEC_ID_VC1:
+			if (vc1_find_sc(pkt->data, MIN(10, pkt->size)) < 0)
+				i->insert_sc = 1;
+			break;
+		default:
+			break;
 		}
 
-		pthread_mutex_unlock(&i->lock);
-
-		if (i->window) {
-			struct fb *fb = get_fb(i, n);
-			if (!fb) {
-				err("could not get framebuffer for "
-				    "video buffer %d", n);
-				return -1;
-			}
+		i->need_header = 0;
+	}
 
-			info("show buffer pts=%" PRIu64, pts);
+	if ((codecpar->codec_id == AV_CODEC_ID_WMV3 ||
+	     codecpar->codec_id == AV_CODEC_ID_VC1) &&
+	    i->insert_sc) {
+		int n = vc1_write_bdu(data + size, vid->out_buf_size - size,
+				      pkt->data, pkt->size, 0x0d);
+		if (n < 0) {
+			err("packet too big (size=%d) for stream buffer",
+			    pkt->size);
+			return -1;
+		}
 
-			fb_apply_extradata(fb, extradata);
-			window_show_buffer(i->window, fb,
-					   buffer_released, i);
-			busy = true;
+		size += n;
+	} else if (i->nal_length_size) {
+		int n = nal_convert_annexb(data + size,
+					   vid->out_buf_size - size,
+					   pkt->data, pkt->size,
+					   i->nal_length_size);
+		if (n < 0) {
+			err("cannot convert packet (size=%d) to annex-b",
+			    pkt->size);
+			return -1;
 		}
 
-		i->prerolled = 1;
+		size += n;
+	} else {
+		if (pkt->size > vid->out_buf_size - size) {
+			err("packet too big (size=%d) for stream buffer",
+			    pkt->size);
+			return -1;
+		}
 
+		memcpy(data + size, pkt->data, pkt->size);
+		size += pkt->size;
 	}
 
-	if (!busy && !i->reconfigure_pending)
-		video_queue_buf_cap(i, n);
+	vid_timebase = i->stream->time_base;
 
-	if (flags & V4L2_QCOM_BUF_FLAG_EOS) {
-		info("End of stream");
-		finish(i);
-	}
+	start_time = 0;
+	if (i->stream->start_time != AV_NOPTS_VALUE)
+		start_time = av_rescale_q(i->stream->start_time,
+					  vid_timebase, v4l_timebase);
 
-	return 0;
-}
+	pts = TIMESTAMP_NONE;
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pts = av_rescale_q(pkt->pts, vid_timebase, v4l_timebase);
 
-static int
-handle_video_output(struct instance *i)
-{
-	struct video *vid = &i->video;
-	int ret, n;
+	dts = TIMESTAMP_NONE;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		dts = av_rescale_q(pkt->dts, vid_timebase, v4l_timebase);
 
-	ret = video_dequeue_output(i, &n);
-	if (ret < 0) {
-		err("dequeue output buffer fail");
-		return ret;
+	duration = TIMESTAMP_NONE;
+	if (pkt->duration) {
+		duration = av_rescale_q(pkt->duration,
+					vid_timebase, v4l_timebase);
 	}
 
-	pthread_mutex_lock(&i->lock);
-	vid->out_buf_flag[n] = 0;
-	pthread_cond_signal(&i->cond);
-	pthread_mutex_unlock(&i->lock);
+	i->read_pos = pkt->pos;
 
-	return 0;
+	return queue_pkt(i, buf_index, size, pts, dts, duration, start_time,
+			 pkt->flags & AV_PKT_FLAG_KEY);
 }
 
+/* Get a free OUTPUT buffer, waiting for the decoder to release one */
 static int
-handle_signal(struct instance *i)
+get_buffer(struct instance *i)
 {
-	struct signalfd_siginfo siginfo;
-	sigset_t sigmask;
+	struct video *vid = &i->video;
+	eventfd_t val;
+	int n;
 
-	if (read(i->sigfd, &siginfo, sizeof (siginfo)) < 0) {
-		perror("signalfd/read");
-		return -1;
-	}
+	for (;;) {
+		while (ring_pop(&vid->out_free, &n))
+			vid->out_buf_flag[n] = 0;
 
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, siginfo.ssi_signo);
-	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+		if (i->finish)
+			return -1;
 
-	finish(i);
+		/* no new packet goes to the decoder while it is flushed */
+		if (!atomic_load(&i->flush_pending)) {
+			n = video_get_buf_out(i);
+			if (n >= 0)
+				return n;
+		}
 
-	return 0;
-}
+		/* advertise the wait before checking the ring again, the
+		 * main thread only signals a waiting parser */
+		atomic_store(&vid->parser_waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
 
-static int
-setup_signal(struct instance *i)
+		if ((ring_empty(&vid->out_free) ||
+		     atomic_load(&i->flush_pending)) && !i->finish) {
+			uint64_t start = time_us(CLOCK_MONOTONIC);
+
+			trace(i->id, TRACE_PARSER_WAIT, 0, 0);
+			eventfd_read(i->free_evfd, &val);
+			trace(i->id, TRACE_PARSER_WAKE, 0, 0);
+
+			vid->parser_stalls++;
+			vid->parser_stall_time +=
+				time_us(CLOCK_MONOTONIC) - start;
+		}
+
+		atomic_store(&vid->parser_waiting, 0);
+	}
+}
+
+/* Stream time of the first frame, in us */
+static int64_t
+stream_start_time(struct instance *i)
 {
-	sigset_t sigmask;
-	int fd;
+	AVRational v4l_timebase = { 1, 1000000 };
 
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	sigaddset(&sigmask, SIGTERM);
+	if (i->stream->start_time == AV_NOPTS_VALUE)
+		return 0;
 
-	fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
-	if (fd < 0) {
-		perror("signalfd");
+	return av_rescale_q(i->stream->start_time, i->stream->time_base,
+			    v4l_timebase);
+}
+
+/* Time of a packet from the start of the stream in us, or -1 */
+static int64_t
+packet_time(struct instance *i, AVPacket *pkt)
+{
+	AVRational v4l_timebase = { 1, 1000000 };
+	int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+	if (ts == AV_NOPTS_VALUE)
 		return -1;
+
+	return av_rescale_q(ts, i->stream->time_base, v4l_timebase) -
+		stream_start_time(i);
+}
+
+/* Move the demuxer to the keyframe before target, in us from the start
+ * of the stream */
+static int
+demux_seek(struct instance *i, int64_t target)
+{
+	AVRational v4l_timebase = { 1, 1000000 };
+	int64_t ts;
+	int ret;
+
+	ts = av_rescale_q(MAX(target, 0) + stream_start_time(i),
+			  v4l_timebase, i->stream->time_base);
+
+	ret = av_seek_frame(i->avctx, i->stream->index, ts,
+			    AVSEEK_FLAG_BACKWARD);
+	if (ret < 0) {
+		av_err(ret, "Seeking failed");
+		return ret;
 	}
 
-	sigprocmask(SIG_BLOCK, &sigmask, NULL);
-	i->sigfd = fd;
+	/* drop the data of the packets read before the seek */
+	if (i->bsf)
+		av_bsf_flush(i->bsf);
+	i->bsf_data_pending = 0;
 
 	return 0;
 }
 
-enum {
-	EV_VIDEO,
-	EV_DISPLAY,
-	EV_STDIN,
-	EV_SIGNAL,
-	EV_COUNT
-};
+/* Open the clip following the one read ahead, while the parser still
+ * feeds the decoder with the current one, returns -1 at the end of the
+ * playlist */
+static int
+clip_open_next(struct instance *i, int *index, AVFormatContext **next)
+{
+	int n = *index;
+
+	/* skip the clips that cannot be played, giving up after a whole
+	 * round of the playlist */
+	for (int tries = 0; tries < i->url_count; tries++) {
+		if (++n == i->url_count) {
+			if (!i->loop)
+				return -1;
+			n = 0;
+		}
+
+		if (!stream_probe(i, i->urls[n], next)) {
+			*index = n;
+			return 0;
+		}
+	}
+
+	return -1;
+}
 
+/*
+ * Move on to the next clip at the end of the current one. The demuxer
+ * of the current clip is kept until the parser is done with its
+ * packets, and kept for good when a seek comes first. Returns -1 at the
+ * end of the playlist.
+ */
 static int
-kbd_init(struct instance *i)
+demux_next_clip(struct instance *i, int *index, AVFormatContext **next)
 {
-	struct termios newt;
+	int ret;
 
-	if (tcgetattr(STDIN_FILENO, &i->stdin_termios) < 0)
+	if (!*next && clip_open_next(i, index, next) < 0)
 		return -1;
 
-	newt = i->stdin_termios;
-	newt.c_lflag &= ~ICANON;
-	newt.c_lflag &= ~ECHO;
+	ret = pktq_put_next(&i->pktq);
+	if (ret < 0)
+		return -1;
 
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) < 0)
+	/* the seek is done on the current clip */
+	if (ret == PKTQ_SEEK)
+		return 0;
+
+	stream_close(i);
+	i->bsf_data_pending = 0;
+	i->url = i->urls[*index];
+	i->clip = *index;
+
+	ret = stream_setup(i, *next);
+	*next = NULL;
+	if (ret < 0)
 		return -1;
 
-	i->stdin_valid = 1;
+	info("Playing %s", i->url);
 
-	return STDIN_FILENO;
+	return 0;
 }
 
-static int
-kbd_handle_key(struct instance *i)
+/* This thread reads the stream ahead of the decoder, so that network
+ * jitter is absorbed by the packet queue */
+static void *
+demux_thread_func(void *args)
 {
-	uint8_t key[3];
+	struct instance *i = (struct instance *)args;
+	AVFormatContext *next = NULL;
+	AVPacket pkt;
+	int64_t target = 0, key_time = -1;
+	int mode = TRICK_NONE;
+	int clip = i->clip;
 	int ret;
 
-	ret = read(STDIN_FILENO, key, 3);
-	if (ret < 0)
-		return -1;
+	trace_thread("demux %d", i->id);
+	dbg("Demux thread started");
 
-	if (key[0] == 's') {
-		info("Frame Step");
-		i->prerolled = 0;
+	av_init_packet(&pkt);
+
+	while (1) {
+		if (pktq_take_seek(&i->pktq, &target, &mode)) {
+			info("Seeking to %.3f s", target / 1e6);
+
+			/* the marker flushes the decoder even if the seek
+			 * failed, the playback mode changes anyway */
+			demux_seek(i, target);
+			key_time = -1;
+
+			if (pktq_put_flush(&i->pktq, mode) < 0)
+				break;
+		}
+
+		ret = parse_frame(i, &pkt);
+		if (ret == AVERROR(EAGAIN))
+			continue;
+
+		if (ret == AVERROR_EOF && i->stream &&
+		    !demux_next_clip(i, &clip, &next))
+			continue;
+
+		/* stay around for a seek back until the instance is
+		 * finished */
+		if (ret < 0) {
+			pktq_put_end(&i->pktq, ret);
+			if (pktq_wait_seek(&i->pktq) < 0)
+				break;
+			continue;
+		}
+
+		if ((mode != TRICK_NONE || i->keyframes) &&
+		    !(pkt.flags & AV_PKT_FLAG_KEY)) {
+			av_packet_unref(&pkt);
+			continue;
+		}
+
+		if (mode == TRICK_REWIND) {
+			int64_t t = packet_time(i, &pkt);
+
+			/* stepping back may land on the keyframe already
+			 * sent when keyframes are far apart */
+			if (key_time >= 0 && t >= key_time) {
+				av_packet_unref(&pkt);
+			} else {
+				ret = pktq_put(&i->pktq, &pkt,
+					       time_us(CLOCK_MONOTONIC), 0);
+				if (ret < 0)
+					break;
+				if (ret == PKTQ_SEEK)
+					continue;
+
+				key_time = MAX(t, 0);
+			}
+
+			if (target <= 0) {
+				info("Rewound to the start of the stream");
+				pktq_seek(&i->pktq, 0, TRICK_NONE);
+				continue;
+			}
+
+			target = MIN(target, key_time) - TRICK_REWIND_STEP;
+			demux_seek(i, target);
+			continue;
+		}
+
+		if (pktq_put(&i->pktq, &pkt, time_us(CLOCK_MONOTONIC),
+			     packet_duration(i, &pkt)) < 0)
+			break;
 	}
 
-	return 0;
+	if (next)
+		avformat_close_input(&next);
+
+	dbg("Demux thread finished");
+
+	return NULL;
 }
 
-static void
-kbd_shutdown(struct instance *i)
+/* Abort blocking network reads once the instance is finished */
+static int
+demux_interrupt(void *data)
+{
+	struct instance *i = data;
+
+	return i->finish;
+}
+
+/* Drop what the decoder holds from before a seek, the main thread
+ * completes the flush once the decoder reports it done */
+static int
+seek_flush(struct instance *i, int mode)
 {
-	if (i->stdin_valid)
-		tcsetattr(STDIN_FILENO, TCSANOW, &i->stdin_termios);
+	atomic_store(&i->flush_pending, 1);
+
+	if (video_flush(i, V4L2_QCOM_CMD_FLUSH_OUTPUT |
+			V4L2_QCOM_CMD_FLUSH_CAPTURE) < 0)
+		return -1;
+
+	if (!i->skip_frames && !mode != !i->trick &&
+	    video_set_pictype_decode(i, mode != TRICK_NONE) < 0)
+		return -1;
+
+	i->trick = mode;
+
+	/* the decoder needs the parameter sets again */
+	i->need_header = 1;
+
+	return 0;
 }
 
-void main_loop(struct instance *i)
+/*
+ * Start feeding the decoder with a new clip, its timestamps following
+ * the ones of the previous clip. The decoder takes a clip of the same
+ * codec as is, resolution changes included; otherwise it is drained and
+ * set up again by the main thread.
+ */
+static int
+clip_start(struct instance *i)
 {
 	struct video *vid = &i->video;
-	struct wl_display *wl_display = NULL;
-	struct pollfd pfd[EV_COUNT];
-	int ev[EV_COUNT];
-	short revents;
-	int nfds = 0;
-	int ret;
+	unsigned int size, slab_size;
+	eventfd_t val;
+	int buf;
 
-	dbg("main thread started");
+	i->clip_offset = i->clip_end;
+	i->need_header = 1;
+	i->insert_sc = 0;
 
-	for (int i = 0; i < EV_COUNT; i++)
-		ev[i] = -1;
+	stream_buffer_size(i, &size, &slab_size);
 
-	memset(pfd, 0, sizeof (pfd));
+	if (i->fourcc == vid->out_fourcc && size <= (unsigned)vid->out_buf_size)
+		return 0;
 
-	pfd[nfds].fd = vid->fd;
-	pfd[nfds].events = POLLOUT | POLLWRNORM | POLLPRI;
-	ev[EV_VIDEO] = nfds++;
+	buf = get_buffer(i);
+	if (buf < 0)
+		return -1;
 
-	if (i->display) {
-		wl_display = display_get_wl_display(i->display);
-		pfd[nfds].fd = wl_display_get_fd(wl_display);
-		pfd[nfds].events = POLLIN;
-		ev[EV_DISPLAY] = nfds++;
-	}
+	atomic_store(&i->restart_pending, 1);
 
-	ret = kbd_init(i);
-	if (ret >= 0) {
-		pfd[nfds].fd = ret;
-		pfd[nfds].events = POLLIN;
-		ev[EV_STDIN] = nfds++;
-	}
+	if (send_eos(i, buf) < 0)
+		return -1;
 
-	if (i->sigfd != -1) {
-		pfd[nfds].fd = i->sigfd;
-		pfd[nfds].events = POLLIN;
-		ev[EV_SIGNAL] = nfds++;
-	}
+	while (atomic_load(&i->restart_pending) && !i->finish)
+		eventfd_read(i->free_evfd, &val);
+
+	return i->finish ? -1 : 0;
+}
+
+/* This threads is responsible for parsing the stream and
+ * feeding video decoder with consecutive frames to decode */
+static void *
+parser_thread_func(void *args)
+{
+	struct instance *i = (struct instance *)args;
+	AVPacket pkt;
+	int buf, parse_ret, mode;
+	int next_clip = 0;
+
+	trace_thread("parser %d", i->id);
+	dbg("Parser thread started");
+
+	av_init_packet(&pkt);
+
+	while (1) {
+		parse_ret = pktq_get(&i->pktq, &pkt, &i->read_time, &mode);
 
-	while (!i->finish) {
-		if (i->display) {
-			if (!display_is_running(i->display))
+		if (parse_ret == PKTQ_FLUSH) {
+			if (seek_flush(i, mode) < 0) {
+				finish(i);
 				break;
+			}
+			continue;
+		}
 
-			while (wl_display_prepare_read(wl_display) != 0)
-				wl_display_dispatch_pending(wl_display);
+		if (parse_ret == PKTQ_NEXT) {
+			next_clip = 1;
+			continue;
+		}
 
-			ret = wl_display_flush(wl_display);
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					pfd[ev[EV_DISPLAY]].events |= POLLOUT;
-				else if (errno != EPIPE) {
-					err("wl_display_flush: %m");
-					wl_display_cancel_read(wl_display);
-					break;
-				}
+		/* the demuxer is set up for the clip once its first packet
+		 * is queued */
+		if (next_clip && !parse_ret) {
+			next_clip = 0;
+			if (clip_start(i) < 0) {
+				finish(i);
+				break;
 			}
 		}
 
-		if (i->paused && i->prerolled)
-			pfd[ev[EV_VIDEO]].events &= ~(POLLIN | POLLRDNORM);
-		else
-			pfd[ev[EV_VIDEO]].events |= POLLIN | POLLRDNORM;
+		if (parse_ret == AVERROR_EXIT)
+			break;
 
-		ret = poll(pfd, nfds, -1);
-		if (ret <= 0) {
-			err("poll error");
+		buf = get_buffer(i);
+		if (buf < 0) {
+			/* decoding stopped before parsing ended, abort */
 			break;
 		}
 
-		if (i->display) {
-			ret = wl_display_read_events(wl_display);
-			if (ret < 0) {
-				err("wl_display_read_events: %m");
-				break;
-			}
+		if (parse_ret < 0) {
+			if (parse_ret == AVERROR_EOF)
+				dbg("Queue end of stream");
+			else
+				av_err(parse_ret, "Parsing failed");
 
-			ret = wl_display_dispatch_pending(wl_display);
-			if (ret < 0) {
-				err("wl_display_dispatch_pending: %m");
-				break;
-			}
+			/* a seek may still come before the last frame
+			 * is presented */
+			send_eos(i, buf);
+			continue;
+		}
+
+		if (send_pkt(i, buf, &pkt) < 0) {
+			finish(i);
+			break;
+		}
+
+		av_packet_unref(&pkt);
+	}
+
+	av_packet_unref(&pkt);
+
+	dbg("Parser thread finished");
+
+	return NULL;
+}
+
+/* Feed the decoder from an ingest source, in place of the demuxer and
+ * parser threads: the access units are read straight into the OUTPUT
+ * buffers */
+static void *
+ingest_thread_func(void *args)
+{
+	struct instance *i = (struct instance *)args;
+	struct video *vid = &i->video;
+	struct ingest_unit unit;
+	uint64_t frames = 0;
+	int buf, size;
+
+	trace_thread("ingest %d", i->id);
+	dbg("Ingest thread started");
+
+	while (1) {
+		buf = get_buffer(i);
+		if (buf < 0)
+			break;
+
+		size = ingest_read(&i->ingest, (uint8_t *)vid->out_buf_addr[buf],
+				   vid->out_buf_size, &unit);
+		if (size < 0 && i->finish)
+			break;
+
+		if (size <= 0) {
+			dbg("Queue end of stream");
+			send_eos(i, buf);
+			break;
+		}
+
+		i->read_time = time_us(CLOCK_MONOTONIC);
+		i->read_pos = -1;
+
+		/* the byte stream has no timestamps, they follow the
+		 * frame rate in the order the access units come */
+		if (unit.pts == INGEST_PTS_NONE)
+			unit.pts = frames * frame_period(i);
+		frames++;
+
+		if (queue_pkt(i, buf, size, unit.pts, TIMESTAMP_NONE,
+			      frame_period(i) ?: TIMESTAMP_NONE, 0,
+			      unit.key) < 0) {
+			finish(i);
+			break;
 		}
+	}
+
+	dbg("Ingest thread finished");
+
+	return NULL;
+}
+
+/* Forget the frames decoded before a seek, once the decoder flushed */
+static void
+seek_flush_done(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct sched_frame frame;
+
+	dbg("Seek flush done");
+
+	ts_collect(vid);
+	vid->pending_ts_count = 0;
+	for (int n = 0; n < MAX_PENDING_TS; n++)
+		vid->pending_times[n].pts = TIMESTAMP_NONE;
+	vid->cap_last_pts = TIMESTAMP_NONE;
+
+	while (sched_take(&i->sched, &frame)) {
+		memzero(vid->cap_times[frame.index]);
+		video_queue_buf_cap(i, frame.index);
+	}
+	sched_reset_clock(&i->sched);
+
+	i->seek_requested = 0;
+	atomic_store(&i->flush_pending, 0);
+	eventfd_write(i->free_evfd, 1);
+}
+
+/* Account the latency of the frame held by a capture buffer, once */
+static void
+frame_done(struct instance *i, int n)
+{
+	struct frame_times *times = &i->video.cap_times[n];
+
+	if (!times->t[STAGE_DECODED])
+		return;
+
+	latency_add_frame(&i->latency, times);
+
+	if (i->low_latency && times->t[STAGE_READ]) {
+		uint64_t last = times->t[STAGE_PRESENTED] ?:
+			times->t[STAGE_SHOWN] ?: times->t[STAGE_DECODED];
+
+		dbg("frame latency %.3f ms", (last - times->t[STAGE_READ]) / 1e3);
+	}
+	memzero(*times);
+}
+
+/* Describe the visible area of a capture buffer */
+static void
+capture_frame(struct instance *i, int n,
+	      const struct extradata_info *extradata,
+	      struct dump_frame *f)
+{
+	struct video *vid = &i->video;
+
+	memset(f, 0, sizeof (*f));
+	f->index = n;
+	f->fd = vid->cap_buf_fd[n];
+	f->data = vid->cap_buf_addr[n];
+	f->size = vid->cap_buf_size;
+
+	/* other formats are used as the decoder laid them out */
+	if (vid->cap_buf_format == V4L2_PIX_FMT_NV12)
+		f->cpp = 1;
+	else if (vid->cap_buf_format == V4L2_PIX_FMT_P010)
+		f->cpp = 2;
+	else
+		return;
+
+	f->planes = 2;
+	for (int p = 0; p < 2; p++) {
+		f->plane_off[p] = vid->cap_plane_off[p];
+		f->plane_stride[p] = vid->cap_plane_stride[p];
+	}
+
+	f->w = vid->cap_w;
+	f->h = vid->cap_h;
+
+	if ((extradata->flags & EXTRADATA_CROP) &&
+	    extradata->crop_w && extradata->crop_h &&
+	    extradata->crop_x + extradata->crop_w <= (unsigned)vid->cap_w &&
+	    extradata->crop_y + extradata->crop_h <= (unsigned)vid->cap_h) {
+		f->x = extradata->crop_x;
+		f->y = extradata->crop_y;
+		f->w = extradata->crop_w;
+		f->h = extradata->crop_h;
+	}
+}
+
+/* Hand a decoded frame to the writer thread */
+static int
+dump_capture(struct instance *i, int n,
+	     const struct extradata_info *extradata)
+{
+	struct dump_frame f;
+
+	capture_frame(i, n, extradata, &f);
+	f.scale = i->dump_scale;
+
+	return dump_frame(&i->dump, &f);
+}
+
+/* List a decoded keyframe: its PTS, the offset of its packet in the
+ * file and the size of the frame as dumped */
+static void
+index_capture(struct instance *i, int n, uint64_t pts, int64_t pos,
+	      const struct extradata_info *extradata)
+{
+	struct dump_frame f;
+	int w, h;
+
+	capture_frame(i, n, extradata, &f);
+	f.scale = i->dump_scale;
+	dump_frame_size(&f, &w, &h);
+
+	fprintf(i->index_file, "%" PRIu64 " %" PRId64 " %dx%d\n", pts, pos,
+		w, h);
+}
+
+static void
+checksum_capture(struct instance *i, int n, uint64_t pts,
+		 const struct extradata_info *extradata)
+{
+	struct dump_frame f;
+
+	capture_frame(i, n, extradata, &f);
+
+	fprintf(i->checksum_file, "%" PRIu64 " %08x\n", pts,
+		dump_checksum(&f));
+}
+
+/* Give the buffers written by the writer thread back to the decoder */
+static void
+handle_dump(struct instance *i)
+{
+	int n;
+
+	while (dump_take(&i->dump, &n)) {
+		frame_done(i, n);
+
+		if (!i->reconfigure_pending)
+			video_queue_buf_cap(i, n);
+	}
+}
+
+static void
+buffer_presented(struct window *w, struct fb *fb, uint64_t time,
+		 uint32_t refresh)
+{
+	struct instance *i = window_get_user_data(w);
+
+	trace(i->id, TRACE_PRESENTED, fb->index, time);
+	sched_presented(&i->sched, time, refresh);
+
+	if (fb->group != i->group)
+		return;
+
+	if (time)
+		i->video.cap_times[fb->index].t[STAGE_PRESENTED] = time;
+
+	frame_done(i, fb->index);
+}
+
+static void
+buffer_released(struct fb *fb, void *data)
+{
+	struct instance *i = data;
+	int n = fb->index;
+
+	trace(i->id, TRACE_RELEASED, n, 0);
+
+	if (fb->group != i->group) {
+		fb_destroy(fb);
+		return;
+	}
+
+	/* no presentation feedback was received for this frame */
+	frame_done(i, n);
+
+	if (!i->reconfigure_pending)
+		video_queue_buf_cap(i, n);
+}
+
+/* Refresh the decoding rate once per second, and let the governor
+ * adjust the clocks to it */
+static void
+update_fps(struct instance *i, uint64_t now)
+{
+	struct video *vid = &i->video;
+
+	vid->fps_frames++;
+
+	if (!vid->fps_time) {
+		vid->fps_time = now;
+		vid->fps_frames = 0;
+	} else if (now - vid->fps_time >= 1000000) {
+		vid->fps = vid->fps_frames * 1e6 / (now - vid->fps_time);
+		vid->fps_time = now;
+		vid->fps_frames = 0;
+
+		perf_update(i, vid->fps);
+	}
+}
+
+/* Set the decoder up again for a clip of another codec, once it output
+ * all the frames of the previous clip */
+static int
+restart_decoder(struct instance *i)
+{
+	struct video *vid = &i->video;
+	unsigned int size, slab_size;
+
+	info("Restarting the decoder for %s", i->url);
+
+	/* the frames of the previous clip not shown yet are dropped */
+	prepare_capture(i);
+
+	ts_collect(vid);
+	vid->pending_ts_count = 0;
+	vid->cap_last_pts = TIMESTAMP_NONE;
+
+	if (video_release_capture(i) || video_stop_output(i))
+		return -1;
+
+	stream_buffer_size(i, &size, &slab_size);
+
+	if (video_setup_output(i, i->fourcc, size, slab_size, STREAM_BUFFERS))
+		return -1;
+
+	if (video_set_control(i))
+		return -1;
+
+	if (video_stream(i, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			 VIDIOC_STREAMON))
+		return -1;
+
+	if (restart_capture(i))
+		return -1;
+
+	atomic_store(&i->restart_pending, 0);
+	eventfd_write(i->free_evfd, 1);
+
+	return 0;
+}
+
+static int
+handle_video_capture(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct timeval tv;
+	uint32_t flags;
+	uint64_t pts;
+	unsigned int bytesused;
+	const struct extradata_info *extradata;
+	bool busy;
+	int ret, n;
+
+	/* capture buffer is ready */
+
+	ret = video_dequeue_capture(i, &n, &bytesused, &flags, &tv, &extradata);
+	if (ret < 0)
+		return ret;
+
+	if (flags & V4L2_QCOM_BUF_TIMESTAMP_INVALID)
+		pts = TIMESTAMP_NONE;
+	else
+		pts = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+
+	busy = false;
+
+	if (bytesused > 0) {
+		struct ts_entry *min;
+		struct frame_times *times = &vid->cap_times[n];
+		uint64_t offset;
+		int64_t pos;
+		int pending;
+
+		vid->total_captured++;
+		update_fps(i, time_us(CLOCK_MONOTONIC));
+
+		if (extradata && (extradata->flags & EXTRADATA_FRAME_RATE))
+			perf_frame_rate(i, extradata->frame_rate);
+
+		ts_collect(vid);
+
+		/* PTS are expected to be monotonically increasing,
+		 * so when unknown use the lowest pending DTS */
+		min = ts_min(vid);
+		pending = vid->pending_ts_count;
+
+		if (min) {
+			dbg("pending %d min pts %" PRIi64
+			    " dts %" PRIi64
+			    " duration %" PRIi64, pending,
+			    min->pts, min->dts, min->duration);
+		}
+
+		if (pts == TIMESTAMP_NONE) {
+			dbg("no pts on frame");
+			if (min && vid->pts_dts_delta != TIMESTAMP_NONE) {
+				dbg("reuse dts %" PRIu64
+				    " delta %" PRIu64,
+				    min->dts, vid->pts_dts_delta);
+				pts = min->dts + vid->pts_dts_delta;
+			}
+		}
+
+		if (pts == TIMESTAMP_NONE) {
+			if (min && vid->cap_last_pts != TIMESTAMP_NONE)
+				pts = vid->cap_last_pts + min->duration;
+			else
+				pts = 0;
+
+			dbg("guessing pts %" PRIu64, pts);
+		}
+
+		vid->cap_last_pts = pts;
+
+		/* the frame timing is keyed by the PTS, which the decoder
+		 * copies from the packet to the frame */
+		if (!ts_take_times(vid, vid->cap_last_pts, times) &&
+		    !(min && ts_take_times(vid, min->pts, times)))
+			memzero(*times);
+
+		times->t[STAGE_DECODED] = time_us(CLOCK_MONOTONIC);
+
+		offset = 0;
+		pos = -1;
+		if (min != NULL) {
+			pts -= min->base;
+			offset = min->offset;
+			pos = min->pos;
+			ts_remove_min(vid);
+		}
+
+		i->position = pts;
+
+		if (i->reconfigure_time && !i->reconfigure_pending) {
+			uint64_t t = time_us(CLOCK_MONOTONIC) -
+				i->reconfigure_time;
+
+			info("reconfigured in %.1f ms", t / 1e3);
+			histogram_add(&i->latency.reconfigure, t);
+			i->reconfigure_time = 0;
+		}
+
+		if (i->checksum_file && !i->reconfigure_pending &&
+		    !atomic_load(&i->flush_pending))
+			checksum_capture(i, n, pts, extradata);
+
+		if (i->index_file && !i->reconfigure_pending &&
+		    !atomic_load(&i->flush_pending))
+			index_capture(i, n, pts, pos, extradata);
+
+		if (i->reconfigure_pending || atomic_load(&i->flush_pending)) {
+			/* the buffer may be reused for the new format, or
+			 * the frame is from before a seek */
+			memzero(*times);
+		} else if (i->dump_path) {
+			if (dump_capture(i, n, extradata) < 0) {
+				err("too many frames being written");
+				frame_done(i, n);
+			} else {
+				busy = true;
+			}
+			first_frame(i);
+		} else if (i->window) {
+			struct fb *fb = find_fb(i, i->group, n);
+			if (!fb) {
+				/* the compositor did not create it yet */
+				dbg("framebuffer for video buffer %d not "
+				    "ready, dropping frame", n);
+				memzero(*times);
+				goto done;
+			}
+
+			dbg("schedule buffer pts=%" PRIu64, pts);
+
+			/* the playlist time is continuous across clips */
+			fb_apply_extradata(fb, extradata);
+			if (sched_push(&i->sched, n, fb, pts + offset) < 0) {
+				err("too many frames scheduled, dropping frame");
+				frame_done(i, n);
+			} else {
+				busy = true;
+			}
+		} else {
+			frame_done(i, n);
+			first_frame(i);
+		}
+
+done:
+		i->prerolled = 1;
+	}
+
+	if (!busy && !i->reconfigure_pending)
+		video_queue_buf_cap(i, n);
+
+	if (flags & V4L2_QCOM_BUF_FLAG_EOS) {
+		/* the end of a clip, not of the playlist */
+		if (atomic_load(&i->restart_pending)) {
+			if (restart_decoder(i) < 0)
+				finish(i);
+			return 0;
+		}
+
+		/* the stream goes on from the seek target */
+		if (i->seek_requested || atomic_load(&i->flush_pending))
+			return 0;
+
+		info("End of stream");
+		i->end_time = time_us(CLOCK_MONOTONIC);
+
+		/* let the scheduled frames be presented first */
+		if (i->sched.count)
+			i->draining = 1;
+		else
+			finish(i);
+	}
+
+	return 0;
+}
+
+/* Present or drop the scheduled frames that are due, returns the poll
+ * timeout until the next frame is due */
+static int
+present_frames(struct instance *i, uint64_t now)
+{
+	struct sched_frame frame;
+	int timeout;
+
+	for (;;) {
+		switch (sched_next(&i->sched, now, i->paused || i->trick,
+				   &frame, &timeout)) {
+		case SCHED_DROP:
+			trace(i->id, TRACE_DROP, frame.index, frame.pts);
+			memzero(i->video.cap_times[frame.index]);
+			video_queue_buf_cap(i, frame.index);
+			break;
+
+		case SCHED_SHOW:
+			trace(i->id, TRACE_SHOW, frame.index, frame.pts);
+			info("show buffer pts=%" PRIu64, frame.pts);
+			window_show_buffer(i->window, frame.fb,
+					   buffer_released, i);
+			first_frame(i);
+			i->video.cap_times[frame.index].t[STAGE_SHOWN] =
+				time_us(CLOCK_MONOTONIC);
+			break;
+
+		case SCHED_WAIT:
+			if (i->draining && !i->sched.count)
+				finish(i);
+			return timeout;
+		}
+	}
+}
+
+static void
+handle_video_output(struct instance *i)
+{
+	struct video *vid = &i->video;
+	int freed = 0;
+	int n;
+
+	while (!video_dequeue_output(i, &n)) {
+		/* there is room for all the buffers in the ring */
+		ring_push(&vid->out_free, &n);
+		freed++;
+	}
+
+	if (!freed)
+		return;
+
+	/* the parser is woken once for all the buffers freed, and fills
+	 * them in one go */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load(&vid->parser_waiting))
+		eventfd_write(i->free_evfd, 1);
+}
+
+/*
+ * The device is non blocking, so a burst of buffers completed by the
+ * decoder, e.g. after a flush or in decode order, is drained in one
+ * wakeup rather than one poll and display round trip per buffer. The
+ * frames scheduled meanwhile are presented with a single display flush
+ * at the top of the main loop.
+ */
+static void
+handle_video(struct instance *i, short revents)
+{
+	if (revents & (POLLIN | POLLRDNORM)) {
+		/* a paused instance only decodes a frame on a step */
+		while (!i->finish && !(i->paused && i->prerolled) &&
+		       !handle_video_capture(i))
+			;
+	}
+
+	if (revents & (POLLOUT | POLLWRNORM))
+		handle_video_output(i);
+
+	if (revents & POLLPRI) {
+		while (!i->finish && !handle_video_event(i))
+			;
+	}
+}
+
+static void
+pktq_dump(struct instance *i)
+{
+	struct pktq *q = &i->pktq;
+	uint64_t duration;
+	size_t bytes;
+	int count;
+
+	pktq_depth(q, &count, &bytes, &duration);
+
+	info("packet queue for %s: %d packets, %zu bytes, %" PRIu64 " ms "
+	     "(peak %d packets, %zu bytes, %" PRIu64 " ms), %lu underruns",
+	     i->url, count, bytes, duration / 1000, q->peak_count,
+	     q->peak_bytes, q->peak_duration / 1000, q->underruns);
+}
+
+/* Signal and terminal state shared by all instances */
+static int sigfd = -1;
+static int stdin_valid;
+static struct termios stdin_termios;
+
+static int
+handle_signal(struct instance *inst, int count)
+{
+	struct signalfd_siginfo siginfo;
+	sigset_t sigmask;
+
+	if (read(sigfd, &siginfo, sizeof (siginfo)) < 0) {
+		perror("signalfd/read");
+		return -1;
+	}
+
+	if (siginfo.ssi_signo == SIGUSR1) {
+		for (int n = 0; n < count; n++) {
+			latency_dump(&inst[n].latency, inst[n].url);
+			pktq_dump(&inst[n]);
+		}
+		return 0;
+	}
+
+	if (siginfo.ssi_signo == SIGUSR2) {
+		stats_write_json(stderr, inst, count);
+		return 0;
+	}
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, siginfo.ssi_signo);
+	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+
+	for (int n = 0; n < count; n++)
+		finish(&inst[n]);
+
+	return 0;
+}
+
+static int
+setup_signal(void)
+{
+	sigset_t sigmask;
+	int fd;
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGUSR2);
+
+	fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+	if (fd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	sigfd = fd;
+
+	return 0;
+}
+
+/* Listening socket serving the live counters */
+static int stats_fd = -1;
+
+static int
+setup_stats_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memzero(addr);
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof (addr.sun_path)) {
+		err("stats socket path too long: %s", path);
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		err("failed to create stats socket: %m");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+		err("failed to listen on %s: %m", path);
+		close(fd);
+		return -1;
+	}
+
+	stats_fd = fd;
+
+	return 0;
+}
+
+/* Reply to a client with the counters, then hang up */
+static void
+handle_stats_client(struct instance *inst, int count)
+{
+	char *buf;
+	size_t size;
+	FILE *f;
+	int fd;
+
+	fd = accept(stats_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	f = open_memstream(&buf, &size);
+	if (f) {
+		stats_write_json(f, inst, count);
+		fclose(f);
+
+		/* the reply fits in the socket buffer, a client that does
+		 * not read is not waited for */
+		if (write(fd, buf, size) < 0)
+			dbg("failed to send stats: %m");
+		free(buf);
+	}
+
+	close(fd);
+}
+
+/* The video and dump entries come last, one per decoding instance */
+enum {
+	EV_DISPLAY,
+	EV_STDIN,
+	EV_SIGNAL,
+	EV_STATS,
+	EV_WAKE,
+	EV_VIDEO,
+	EV_DUMP = EV_VIDEO + MAX_INSTANCES,
+	EV_COUNT = EV_DUMP + MAX_INSTANCES
+};
+
+static int
+kbd_init(void)
+{
+	struct termios newt;
+
+	if (tcgetattr(STDIN_FILENO, &stdin_termios) < 0)
+		return -1;
+
+	newt = stdin_termios;
+	newt.c_lflag &= ~ICANON;
+	newt.c_lflag &= ~ECHO;
+
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) < 0)
+		return -1;
+
+	stdin_valid = 1;
+
+	return STDIN_FILENO;
+}
+
+static void
+seek_to(struct instance *i, int64_t target, int mode)
+{
+	if (i->ingest.type) {
+		info("Cannot seek a live source");
+		return;
+	}
+
+	if (pktq_seek(&i->pktq, MAX(target, 0), mode) < 0)
+		return;
+
+	/* the end of stream the decoder may still give out is from
+	 * before the seek */
+	i->seek_requested = 1;
+	i->draining = 0;
+}
+
+static void
+seek_relative(struct instance *i, int64_t delta)
+{
+	seek_to(i, (int64_t)i->position + delta, i->trick);
+}
+
+/* Start keyframe only playback in a direction, or stop it when already
+ * going that way */
+static void
+set_trick(struct instance *i, int mode)
+{
+	if (i->trick == mode)
+		mode = TRICK_NONE;
+
+	info("%s", mode == TRICK_FORWARD ? "Fast forward" :
+	     mode == TRICK_REWIND ? "Rewind" : "Play");
+
+	seek_to(i, i->position, mode);
+}
+
+static int
+kbd_handle_key(struct instance *inst, int count)
+{
+	uint8_t key[3] = { 0 };
+	int64_t delta = 0;
+	int ret;
+
+	ret = read(STDIN_FILENO, key, 3);
+	if (ret < 0)
+		return -1;
+
+	if (key[0] == 's') {
+		info("Frame Step");
+		for (int n = 0; n < count; n++)
+			inst[n].prerolled = 0;
+	}
+
+	if (key[0] == ']' || key[0] == '[') {
+		for (int n = 0; n < count; n++)
+			set_trick(&inst[n], key[0] == ']' ? TRICK_FORWARD :
+				  TRICK_REWIND);
+	}
+
+	/* arrow keys */
+	if (ret == 3 && key[0] == '\e' && key[1] == '[') {
+		switch (key[2]) {
+		case 'C':
+			delta = SEEK_STEP;
+			break;
+		case 'D':
+			delta = -SEEK_STEP;
+			break;
+		case 'A':
+			delta = SEEK_LONG_STEP;
+			break;
+		case 'B':
+			delta = -SEEK_LONG_STEP;
+			break;
+		}
+	}
+
+	if (delta) {
+		for (int n = 0; n < count; n++)
+			seek_relative(&inst[n], delta);
+	}
+
+	return 0;
+}
+
+static int
+stdin_ingested(struct instance *inst, int count)
+{
+	for (int n = 0; n < count; n++) {
+		if (inst[n].ingest.type == INGEST_STDIN)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+kbd_shutdown(void)
+{
+	if (stdin_valid)
+		tcsetattr(STDIN_FILENO, TCSANOW, &stdin_termios);
+}
+
+static int
+instances_running(struct instance *inst, int count)
+{
+	int running = 0;
+
+	for (int n = 0; n < count; n++) {
+		if (!inst[n].finish)
+			running++;
+	}
+
+	return running;
+}
+
+void main_loop(struct instance *inst, int count)
+{
+	struct display *display = inst[0].display;
+	struct wl_display *wl_display = NULL;
+	struct pollfd pfd[EV_COUNT];
+	int ev[EV_COUNT];
+	short revents;
+	int nfds = 0;
+	int ret;
+
+	dbg("main thread started");
+
+	for (int i = 0; i < EV_COUNT; i++)
+		ev[i] = -1;
+
+	memset(pfd, 0, sizeof (pfd));
+
+	for (int n = 0; n < count; n++) {
+		pfd[nfds].fd = inst[n].video.fd;
+		pfd[nfds].events = POLLOUT | POLLWRNORM | POLLPRI;
+		ev[EV_VIDEO + n] = nfds++;
+
+		if (inst[n].dump_path) {
+			pfd[nfds].fd = dump_get_fd(&inst[n].dump);
+			pfd[nfds].events = POLLIN;
+			ev[EV_DUMP + n] = nfds++;
+		}
+	}
+
+	if (display) {
+		wl_display = display_get_wl_display(display);
+		pfd[nfds].fd = wl_display_get_fd(wl_display);
+		pfd[nfds].events = POLLIN;
+		ev[EV_DISPLAY] = nfds++;
+	}
+
+	/* the standard input may carry a stream instead of the keys */
+	ret = -1;
+	if (!stdin_ingested(inst, count))
+		ret = kbd_init();
+	if (ret >= 0) {
+		pfd[nfds].fd = ret;
+		pfd[nfds].events = POLLIN;
+		ev[EV_STDIN] = nfds++;
+	}
+
+	if (sigfd != -1) {
+		pfd[nfds].fd = sigfd;
+		pfd[nfds].events = POLLIN;
+		ev[EV_SIGNAL] = nfds++;
+	}
+
+	if (stats_fd != -1) {
+		pfd[nfds].fd = stats_fd;
+		pfd[nfds].events = POLLIN;
+		ev[EV_STATS] = nfds++;
+	}
+
+	pfd[nfds].fd = wake_evfd;
+	pfd[nfds].events = POLLIN;
+	ev[EV_WAKE] = nfds++;
+
+	while (instances_running(inst, count)) {
+		int timeout = -1;
+
+		if (display) {
+			uint64_t now = time_us(CLOCK_MONOTONIC);
+
+			if (!display_is_running(display))
+				break;
+
+			for (int n = 0; n < count; n++) {
+				struct instance *i = &inst[n];
+				int t;
+
+				if (!i->window || i->finish)
+					continue;
+
+				t = present_frames(i, now);
+				if (t >= 0 && (timeout < 0 || t < timeout))
+					timeout = t;
+			}
+
+			while (wl_display_prepare_read(wl_display) != 0)
+				wl_display_dispatch_pending(wl_display);
+
+			ret = wl_display_flush(wl_display);
+			if (ret < 0) {
+				if (errno == EAGAIN)
+					pfd[ev[EV_DISPLAY]].events |= POLLOUT;
+				else if (errno != EPIPE) {
+					err("wl_display_flush: %m");
+					wl_display_cancel_read(wl_display);
+					break;
+				}
+			}
+		}
+
+		for (int n = 0; n < count; n++) {
+			struct instance *i = &inst[n];
+			struct pollfd *p = &pfd[ev[EV_VIDEO + n]];
+
+			/* a negative fd makes poll ignore the entry */
+			if (i->finish)
+				p->fd = -1;
+
+			if (i->paused && i->prerolled)
+				p->events &= ~(POLLIN | POLLRDNORM);
+			else
+				p->events |= POLLIN | POLLRDNORM;
+		}
+
+		ret = poll(pfd, nfds, timeout);
+		if (ret < 0) {
+			err("poll error");
+			break;
+		}
+
+		if (ret == 0) {
+			/* a scheduled frame is due */
+			if (display)
+				wl_display_cancel_read(wl_display);
+			continue;
+		}
+
+		if (display) {
+			ret = wl_display_read_events(wl_display);
+			if (ret < 0) {
+				err("wl_display_read_events: %m");
+				break;
+			}
+
+			ret = wl_display_dispatch_pending(wl_display);
+			if (ret < 0) {
+				err("wl_display_dispatch_pending: %m");
+				break;
+			}
+		}
+
+		for (int n = 0; n < count; n++) {
+			struct instance *i = &inst[n];
+
+			revents = pfd[ev[EV_VIDEO + n]].revents;
+			if (revents)
+				handle_video(i, revents);
+		}
+
+		for (int n = 0; n < count; n++) {
+			if (ev[EV_DUMP + n] < 0 || !pfd[ev[EV_DUMP + n]].revents)
+				continue;
+
+			dump_wait(&inst[n].dump);
+			handle_dump(&inst[n]);
+		}
+
+		if (ev[EV_DISPLAY] >= 0) {
+			revents = pfd[ev[EV_DISPLAY]].revents;
+			if (revents & POLLOUT)
+				pfd[ev[EV_DISPLAY]].events &= ~POLLOUT;
+		}
+
+		if (ev[EV_STDIN] >= 0 && pfd[ev[EV_STDIN]].revents)
+			kbd_handle_key(inst, count);
+
+		if (ev[EV_SIGNAL] >= 0 && pfd[ev[EV_SIGNAL]].revents)
+			handle_signal(inst, count);
+
+		if (ev[EV_STATS] >= 0 && pfd[ev[EV_STATS]].revents)
+			handle_stats_client(inst, count);
+
+		if (pfd[ev[EV_WAKE]].revents) {
+			eventfd_t val;
+
+			eventfd_read(wake_evfd, &val);
+		}
+	}
+
+	kbd_shutdown();
+
+	dbg("main thread finished");
+}
+
+static void
+handle_window_key(struct window *window, uint32_t time, uint32_t key,
+		  enum wl_keyboard_key_state state)
+{
+	struct instance *i = window_get_user_data(window);
+
+	if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
+		return;
+
+	switch (key) {
+	case KEY_ESC:
+		finish(i);
+		break;
+
+	case KEY_SPACE:
+		info("%s", i->paused ? "Resume" : "Pause");
+		i->paused = !i->paused;
+		sched_reset_clock(&i->sched);
+		if (!i->avctx)
+			break;
+		if (i->paused)
+			av_read_pause(i->avctx);
+		else
+			av_read_play(i->avctx);
+		break;
+
+	case KEY_S:
+		info("Frame Step");
+		i->prerolled = 0;
+		break;
+
+	case KEY_F:
+		if (i->window)
+			window_toggle_fullscreen(i->window);
+		break;
+
+	case KEY_RIGHT:
+		seek_relative(i, SEEK_STEP);
+		break;
+
+	case KEY_LEFT:
+		seek_relative(i, -SEEK_STEP);
+		break;
+
+	case KEY_UP:
+		seek_relative(i, SEEK_LONG_STEP);
+		break;
+
+	case KEY_DOWN:
+		seek_relative(i, -SEEK_LONG_STEP);
+		break;
+
+	case KEY_RIGHTBRACE:
+		set_trick(i, TRICK_FORWARD);
+		break;
+
+	case KEY_LEFTBRACE:
+		set_trick(i, TRICK_REWIND);
+		break;
+	}
+}
+
+/* Whether to decode to a compressed format rather than its linear one:
+ * the frames the compositor can scan out are shown on an overlay plane
+ * without being composited, and the compressed ones save bandwidth
+ * otherwise */
+static int
+prefer_compressed(struct display *display, uint32_t compressed,
+		  uint32_t linear)
+{
+	uint64_t modifier;
+	uint32_t format;
+
+	video_drm_format(compressed, &format, &modifier);
+	if (!display_has_format(display, format, modifier))
+		return 0;
+	if (display_can_scanout(display, format, modifier))
+		return 1;
+
+	video_drm_format(linear, &format, &modifier);
+	return !display_can_scanout(display, format, modifier);
+}
+
+static int
+setup_window(struct instance *i, struct display *display)
+{
+	i->display = display;
+	i->window = display_create_window(i->display);
+	if (!i->window)
+		return -1;
+
+	i->ubwc = prefer_compressed(display, V4L2_PIX_FMT_NV12_UBWC,
+				    V4L2_PIX_FMT_NV12);
+	i->ubwc_10bit = prefer_compressed(display, V4L2_PIX_FMT_NV12_TP10_UBWC,
+					  V4L2_PIX_FMT_P010);
+
+	window_set_user_data(i->window, i);
+	window_set_key_callback(i->window, handle_window_key);
+	window_set_present_callback(i->window, buffer_presented);
+
+	if (i->fullscreen)
+		window_toggle_fullscreen(i->window);
+
+	return 0;
+}
+
+static void
+stream_close(struct instance *i)
+{
+	i->stream = NULL;
+	if (i->bsf)
+		av_bsf_free(&i->bsf);
+	if (i->avctx)
+		avformat_close_input(&i->avctx);
+}
+
+static int
+get_av_log_level(void)
+{
+	if (debug_level >= 5)
+		return AV_LOG_TRACE;
+	if (debug_level >= 4)
+		return AV_LOG_DEBUG;
+	if (debug_level >= 3)
+		return AV_LOG_VERBOSE;
+	if (debug_level >= 2)
+		return AV_LOG_INFO;
+	if (debug_level >= 1)
+		return AV_LOG_ERROR;
+	return AV_LOG_QUIET;
+}
+
+/* Get the decoder format of a codec, and the bitstream filter turning
+ * its packets into a byte stream, returns 0 if it cannot be decoded */
+static uint32_t
+stream_codec(AVCodecParameters *codecpar, const AVBitStreamFilter **filter)
+{
+	*filter = NULL;
+
+	switch (codecpar->codec_id) {
+	case AV_CODEC_ID_H263:
+		return V4L2_PIX_FMT_H263;
+	case AV_CODEC_ID_H264:
+		*filter = av_bsf_get_by_name("h264_mp4toannexb");
+		return V4L2_PIX_FMT_H264;
+	case AV_CODEC_ID_HEVC:
+		*filter = av_bsf_get_by_name("hevc_mp4toannexb");
+		return V4L2_PIX_FMT_HEVC;
+	case AV_CODEC_ID_MPEG2VIDEO:
+		return V4L2_PIX_FMT_MPEG2;
+	case AV_CODEC_ID_MPEG4:
+		return V4L2_PIX_FMT_MPEG4;
+	case AV_CODEC_ID_MSMPEG4V3:
+		return V4L2_PIX_FMT_DIVX_311;
+	case AV_CODEC_ID_WMV3:
+		return V4L2_PIX_FMT_VC1_ANNEX_G;
+	case AV_CODEC_ID_VC1:
+		return V4L2_PIX_FMT_VC1_ANNEX_G;
+	case AV_CODEC_ID_VP8:
+		return V4L2_PIX_FMT_VP8;
+	case AV_CODEC_ID_VP9:
+		return V4L2_PIX_FMT_VP9;
+	default:
+		return 0;
+	}
+}
+
+/* Open a stream and check it has video to decode */
+static int
+stream_probe(struct instance *i, const char *url, AVFormatContext **avctx)
+{
+	const AVBitStreamFilter *filter;
+	AVCodecParameters *codecpar;
+	int ret;
+
+	*avctx = avformat_alloc_context();
+	if (!*avctx) {
+		err("failed to allocate format context");
+		return -1;
+	}
+
+	(*avctx)->interrupt_callback.callback = demux_interrupt;
+	(*avctx)->interrupt_callback.opaque = i;
+
+	/* the stream parameters are usually known from the first frames,
+	 * reading further only delays the first picture */
+	if (i->probesize) {
+		(*avctx)->probesize = i->probesize;
+		(*avctx)->max_analyze_duration = i->low_latency ?
+			LOW_LATENCY_ANALYZE_US : PROBE_ANALYZE_US;
+	}
+
+	/* hand out the packets as soon as they are read */
+	if (i->low_latency)
+		(*avctx)->flags |= AVFMT_FLAG_NOBUFFER;
+
+	ret = avformat_open_input(avctx, url, NULL, NULL);
+	if (ret < 0) {
+		av_err(ret, "failed to open %s", url);
+		goto fail;
+	}
+
+	ret = avformat_find_stream_info(*avctx, NULL);
+	if (ret < 0) {
+		av_err(ret, "failed to get streams info");
+		goto fail;
+	}
+
+	av_dump_format(*avctx, -1, url, 0);
+
+	ret = av_find_best_stream(*avctx, AVMEDIA_TYPE_VIDEO, -1, -1,
+				  NULL, 0);
+	if (ret < 0) {
+		av_err(ret, "stream does not seem to contain video");
+		goto fail;
+	}
+
+	codecpar = (*avctx)->streams[ret]->codecpar;
+	if (!stream_codec(codecpar, &filter)) {
+		err("cannot decode %s", avcodec_get_name(codecpar->codec_id));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	avformat_close_input(avctx);
+	return -1;
+}
+
+/* Use a stream opened by stream_probe() as the input */
+static int
+stream_setup(struct instance *i, AVFormatContext *avctx)
+{
+	const AVBitStreamFilter *filter;
+	AVCodecParameters *codecpar;
+	AVRational framerate;
+	int ret;
+
+	i->avctx = avctx;
+	i->stream = avctx->streams[av_find_best_stream(avctx,
+						       AVMEDIA_TYPE_VIDEO,
+						       -1, -1, NULL, 0)];
+	codecpar = i->stream->codecpar;
+
+	/* the demuxers that can skip over the other frames without reading
+	 * them do, the demux thread drops them for the others */
+	if (i->keyframes)
+		i->stream->discard = AVDISCARD_NONKEY;
+
+	i->width = codecpar->width ?: 320;
+	i->height = codecpar->height ?: 240;
+	i->need_header = 1;
+
+	framerate = av_stream_get_r_frame_rate(i->stream);
+	i->fps_n = framerate.num;
+	i->fps_d = framerate.den;
+
+	i->fourcc = stream_codec(codecpar, &filter);
+
+	/* in direct write mode, the default, length prefixed NAL units are
+	 * converted while being copied into the OUTPUT buffers, which saves
+	 * the extra packet allocation and copy done by the bitstream filter */
+	i->nal_length_size = 0;
+	if (i->direct_write && filter) {
+		i->nal_length_size = nal_length_size(codecpar);
+		filter = NULL;
+	}
+
+	if (filter) {
+		ret = av_bsf_alloc(filter, &i->bsf);
+		if (ret < 0) {
+			av_err(ret, "cannot allocate bistream filter");
+			goto fail;
+		}
+
+		avcodec_parameters_copy(i->bsf->par_in, codecpar);
+		i->bsf->time_base_in = i->stream->time_base;
+
+		ret = av_bsf_init(i->bsf);
+		if (ret < 0) {
+			av_err(ret, "failed to initialize bitstream filter");
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	stream_close(i);
+	return -1;
+}
+
+static int
+stream_open(struct instance *i)
+{
+	AVFormatContext *avctx;
+
+	if (stream_probe(i, i->url, &avctx))
+		return -1;
+
+	return stream_setup(i, avctx);
+}
+
+static int
+instance_init(struct instance *i, const struct instance *options,
+	      char *url)
+{
+	*i = *options;
+	i->url = url;
+
+	i->free_evfd = eventfd(0, EFD_CLOEXEC);
+	if (i->free_evfd < 0) {
+		err("failed to create eventfd: %m");
+		return -1;
+	}
+
+	if (pktq_init(&i->pktq, i->queue_bytes, i->queue_ms)) {
+		close(i->free_evfd);
+		return -1;
+	}
+
+	ring_init(&i->video.out_free, i->video.out_free_data,
+		  ARRAY_LENGTH(i->video.out_free_data), sizeof (int));
+	ring_init(&i->video.ts_queue, i->video.ts_queue_data,
+		  ARRAY_LENGTH(i->video.ts_queue_data),
+		  sizeof (struct ts_record));
+	atomic_init(&i->video.parser_waiting, 0);
+	atomic_init(&i->restart_pending, 0);
+
+	for (int n = 0; n < MAX_PENDING_TS; n++)
+		i->video.pending_times[n].pts = TIMESTAMP_NONE;
+	INIT_LIST_HEAD(&i->fb_list);
+	sched_init(&i->sched);
+	i->sched.latest = i->low_latency;
+	if (i->low_latency)
+		i->video.out_max_queued = LOW_LATENCY_OUT_QUEUED;
+	i->video.pts_dts_delta = TIMESTAMP_NONE;
+	i->video.cap_last_pts = TIMESTAMP_NONE;
+	i->video.extradata_index = -1;
+	i->video.extradata_size = 0;
+	i->video.extradata_ion_fd = -1;
+
+	return 0;
+}
+
+/* Maximum bitrate in kbit/s of the main profile/tier of each level */
+struct level_bitrate {
+	int level;
+	int bitrate;
+};
+
+static const struct level_bitrate h264_levels[] = {
+	{ 10, 64 }, { 11, 192 }, { 12, 384 }, { 13, 768 },
+	{ 20, 2000 }, { 21, 4000 }, { 22, 4000 },
+	{ 30, 10000 }, { 31, 14000 }, { 32, 20000 },
+	{ 40, 20000 }, { 41, 50000 }, { 42, 50000 },
+	{ 50, 135000 }, { 51, 240000 }, { 52, 240000 },
+};
+
+/* HEVC levels are coded as 30 times the level number */
+static const struct level_bitrate hevc_levels[] = {
+	{ 30, 128 }, { 60, 1500 }, { 63, 3000 }, { 90, 6000 },
+	{ 93, 10000 }, { 120, 12000 }, { 123, 20000 },
+	{ 150, 25000 }, { 153, 40000 }, { 156, 60000 },
+	{ 180, 60000 }, { 183, 120000 }, { 186, 240000 },
+};
+
+static int64_t
+level_max_bitrate(AVCodecParameters *codecpar)
+{
+	const struct level_bitrate *levels;
+	int count;
+
+	switch (codecpar->codec_id) {
+	case AV_CODEC_ID_H264:
+		levels = h264_levels;
+		count = ARRAY_LENGTH(h264_levels);
+		break;
+	case AV_CODEC_ID_HEVC:
+		levels = hevc_levels;
+		count = ARRAY_LENGTH(hevc_levels);
+		break;
+	default:
+		return 0;
+	}
+
+	for (int n = 0; n < count; n++) {
+		if (levels[n].level >= codecpar->level)
+			return levels[n].bitrate * 1000LL;
+	}
+
+	return 0;
+}
+
+/*
+ * Size the stream buffers from the stream properties. A compressed
+ * frame can not be larger than half the raw frame (the lowest minimum
+ * compression ratio of the codec levels), nor, in practice, than the
+ * data sent in one second at the peak bitrate of the level. The bitrate
+ * of the container is only an average, keyframes go far above it, so it
+ * only sizes the slab the buffers are packed in: two of the largest
+ * frames plus a few average ones.
+ */
+static void
+stream_buffer_size(struct instance *i, unsigned int *size,
+		   unsigned int *slab_size)
+{
+	AVCodecParameters *codecpar;
+	int64_t raw, bitrate, peak, max, avg;
+	int bpp;
+
+	/* an ingest source tells at most the largest access unit */
+	if (i->ingest.type) {
+		max = ingest_max_size(&i->ingest);
+		if (!max)
+			max = (int64_t)i->width * i->height * 3 / 4;
+
+		*size = MIN(MAX(max, STREAM_BUFFER_MIN), STREAM_BUFFER_MAX);
+		*slab_size = 2 * *size + STREAM_SLAB_FRAMES * (*size / 8);
+		return;
+	}
+
+	codecpar = i->stream->codecpar;
+	bpp = codecpar->bits_per_raw_sample > 8 ? 2 : 1;
+
+	raw = (int64_t)i->width * i->height * 3 / 2 * bpp;
+	max = raw / 2;
+
+	peak = level_max_bitrate(codecpar);
+	if (peak)
+		max = MIN(max, peak / 8);
+
+	/* room for a keyframe whatever the level claims */
+	max = MAX(max, MIN(raw / 2, STREAM_BUFFER_KEYFRAME));
+	max = MIN(MAX(max, STREAM_BUFFER_MIN), STREAM_BUFFER_MAX);
+
+	bitrate = codecpar->bit_rate;
+	if (!bitrate && i->avctx->bit_rate > 0)
+		bitrate = i->avctx->bit_rate;
+	if (!bitrate)
+		bitrate = peak;
+
+	avg = max / 8;
+	if (bitrate && i->fps_n > 0 && i->fps_d > 0)
+		avg = MIN(avg, bitrate / 8 * i->fps_d / i->fps_n);
+
+	*size = max;
+	*slab_size = 2 * max + STREAM_SLAB_FRAMES * avg;
+
+	dbg("stream buffers: bitrate %" PRIi64 " level %d, frame %u "
+	    "slab %u", bitrate, codecpar->level, *size, *slab_size);
+}
+
+/* Set up an instance fed by an ingest source, the stream properties
+ * not given by the source come from the options */
+static int
+ingest_setup(struct instance *i)
+{
+	struct ingest *in = &i->ingest;
 
-		for (int idx = 0; idx < nfds; idx++) {
-			revents = pfd[idx].revents;
-			if (!revents)
-				continue;
+	if (ingest_open(in, i->url, i->fourcc, demux_interrupt, i))
+		return -1;
 
-			if (idx == ev[EV_VIDEO]) {
-				if (revents & (POLLIN | POLLRDNORM))
-					handle_video_capture(i);
-				if (revents & (POLLOUT | POLLWRNORM))
-					handle_video_output(i);
-				if (revents & POLLPRI)
-					handle_video_event(i);
+	i->fourcc = in->codec;
 
-			} else if (idx == ev[EV_DISPLAY]) {
-				if (revents & POLLOUT)
-					pfd[ev[EV_DISPLAY]].events &= ~POLLOUT;
+	if (in->width && in->height) {
+		i->width = in->width;
+		i->height = in->height;
+	}
 
-			} else if (idx == ev[EV_STDIN]) {
-				kbd_handle_key(i);
-				break;
+	if (in->fps_n && in->fps_d) {
+		i->fps_n = in->fps_n;
+		i->fps_d = in->fps_d;
+	}
 
-			} else if (idx == ev[EV_SIGNAL]) {
-				handle_signal(i);
-				break;
-			}
-		}
+	/* the decoder reports the actual size once it parsed the SPS */
+	if (!i->width || !i->height) {
+		i->width = 320;
+		i->height = 240;
 	}
 
-	kbd_shutdown(i);
+	if (!i->fps_n || !i->fps_d) {
+		i->fps_n = INGEST_DEFAULT_FPS;
+		i->fps_d = 1;
+	}
 
-	dbg("main thread finished");
+	/* the parameter sets are in band */
+	i->need_header = 0;
+	i->nal_length_size = 0;
+
+	return 0;
 }
 
-static void
-handle_window_key(struct window *window, uint32_t time, uint32_t key,
-		  enum wl_keyboard_key_state state)
+/* Probe the stream, while the device and the display are set up */
+static void *
+probe_thread_func(void *args)
 {
-	struct instance *i = window_get_user_data(window);
+	struct instance *i = args;
+	uint64_t start = time_us(CLOCK_MONOTONIC);
 
-	if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
-		return;
+	if (ingest_is_url(i->url))
+		i->probe_ret = ingest_setup(i);
+	else
+		i->probe_ret = stream_open(i);
+	i->probe_time = time_us(CLOCK_MONOTONIC) - start;
 
-	switch (key) {
-	case KEY_ESC:
-		finish(i);
-		break;
+	dbg("stream probed in %.1f ms", i->probe_time / 1e3);
 
-	case KEY_SPACE:
-		info("%s", i->paused ? "Resume" : "Pause");
-		i->paused = !i->paused;
-		if (i->paused)
-			av_read_pause(i->avctx);
-		else
-			av_read_play(i->avctx);
-		break;
+	return NULL;
+}
 
-	case KEY_S:
-		info("Frame Step");
-		i->prerolled = 0;
-		break;
+static int
+instance_open(struct instance *i)
+{
+	if (video_open(i, i->video.name))
+		return -1;
 
-	case KEY_F:
-		if (i->window)
-			window_toggle_fullscreen(i->window);
-		break;
-	}
+	if (video_subscribe_events(i))
+		return -1;
+
+	if (i->secure && video_set_secure(i))
+		return -1;
+
+	return 0;
 }
 
+/* Set up what depends on the stream parameters, once probed */
 static int
-setup_display(struct instance *i)
+instance_setup(struct instance *i)
 {
+	unsigned int size, slab_size;
 	AVRational ar;
 
-	i->display = display_create();
-	if (!i->display)
-		return -1;
+	stream_buffer_size(i, &size, &slab_size);
 
-	i->window = display_create_window(i->display);
-	if (!i->window)
+	if (video_setup_output(i, i->fourcc, size, slab_size, STREAM_BUFFERS))
 		return -1;
 
-	window_set_user_data(i->window, i);
-	window_set_key_callback(i->window, handle_window_key);
+	if (i->window && i->avctx) {
+		ar = av_guess_sample_aspect_ratio(i->avctx, i->stream, NULL);
+		window_set_aspect_ratio(i->window, ar.num, ar.den);
+	}
 
-	ar = av_guess_sample_aspect_ratio(i->avctx, i->stream, NULL);
-	window_set_aspect_ratio(i->window, ar.num, ar.den);
+	return 0;
+}
 
-	if (i->fullscreen)
-		window_toggle_fullscreen(i->window);
+static int
+instance_start(struct instance *i)
+{
+	if (video_set_control(i))
+		return -1;
+
+	if (video_stream(i, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			 VIDIOC_STREAMON))
+		return -1;
+
+	if (restart_capture(i))
+		return -1;
 
 	return 0;
 }
 
 static void
-stream_close(struct instance *i)
+bench_report(struct instance *inst, int count, uint64_t cpu_time)
 {
-	i->stream = NULL;
-	if (i->bsf)
-		av_bsf_free(&i->bsf);
-	if (i->avctx)
-		avformat_close_input(&i->avctx);
-}
+	uint64_t start = UINT64_MAX, end = 0;
+	unsigned long frames = 0;
+	double wall;
+
+	for (int n = 0; n < count; n++) {
+		struct instance *i = &inst[n];
+		struct video *vid = &i->video;
+
+		wall = (i->end_time - i->start_time) / 1e6;
+
+		printf("%s: %lu frames in %.3f s, %.2f fps, "
+		       "first frame %.1f ms (probe %.1f ms), "
+		       "peak queued OUTPUT %d/%d CAPTURE %d/%d "
+		       "packets %d (%zu bytes, %" PRIu64 " ms), "
+		       "%lu underruns, peak ION %.1f MiB\n",
+		       i->url, vid->total_captured, wall,
+		       wall > 0 ? vid->total_captured / wall : 0.0,
+		       i->first_frame_time / 1e3, i->probe_time / 1e3,
+		       vid->peak_out_queued, vid->out_buf_cnt,
+		       vid->peak_cap_queued, vid->cap_buf_cnt,
+		       i->pktq.peak_count, i->pktq.peak_bytes,
+		       i->pktq.peak_duration / 1000, i->pktq.underruns,
+		       vid->peak_ion_bytes / 1048576.0);
+
+		frames += vid->total_captured;
+		start = MIN(start, i->start_time);
+		end = MAX(end, i->end_time);
+	}
 
-static int
-get_av_log_level(void)
-{
-	if (debug_level >= 5)
-		return AV_LOG_TRACE;
-	if (debug_level >= 4)
-		return AV_LOG_DEBUG;
-	if (debug_level >= 3)
-		return AV_LOG_VERBOSE;
-	if (debug_level >= 2)
-		return AV_LOG_INFO;
-	if (debug_level >= 1)
-		return AV_LOG_ERROR;
-	return AV_LOG_QUIET;
+	wall = (end - start) / 1e6;
+
+	printf("total: %lu frames in %.3f s, %.2f fps, "
+	       "cpu %.3f s (%.1f%%), %.1f us cpu per frame\n",
+	       frames, wall, wall > 0 ? frames / wall : 0.0,
+	       cpu_time / 1e6, wall > 0 ? cpu_time / 1e4 / wall : 0.0,
+	       frames ? (double)cpu_time / frames : 0.0);
 }
 
-static int
-stream_open(struct instance *i)
+/* Write the final counters of all the instances, for the benchmarks */
+static void
+write_report(const char *path, struct instance *inst, int count)
 {
-	const AVBitStreamFilter *filter;
-	AVCodecParameters *codecpar;
-	AVRational framerate;
-	int codec;
-	int ret;
-
-	av_log_set_level(get_av_log_level());
-
-	av_register_all();
-	avformat_network_init();
+	FILE *f;
 
-	ret = avformat_open_input(&i->avctx, i->url, NULL, NULL);
-	if (ret < 0) {
-		av_err(ret, "failed to open %s", i->url);
-		goto fail;
+	if (!strcmp(path, "-"))
+		f = stdout;
+	else
+		f = fopen(path, "we");
+	if (!f) {
+		err("failed to open %s: %m", path);
+		return;
 	}
 
-	ret = avformat_find_stream_info(i->avctx, NULL);
-	if (ret < 0) {
-		av_err(ret, "failed to get streams info");
-		goto fail;
-	}
+	stats_write_json(f, inst, count);
 
-	av_dump_format(i->avctx, -1, i->url, 0);
+	if (f == stdout)
+		fflush(f);
+	else
+		fclose(f);
+}
 
-	ret = av_find_best_stream(i->avctx, AVMEDIA_TYPE_VIDEO, -1, -1,
-				  NULL, 0);
-	if (ret < 0) {
-		av_err(ret, "stream does not seem to contain video");
-		goto fail;
+/* Name of the output file of an instance, with the instance number
+ * appended to the path when there are several */
+static int
+output_name(char *name, size_t size, const char *path, int count, int n)
+{
+	if (count > 1 && !strcmp(path, "-")) {
+		err("cannot write several streams to the standard output");
+		return -1;
 	}
 
-	i->stream = i->avctx->streams[ret];
-	codecpar = i->stream->codecpar;
+	if (count > 1)
+		snprintf(name, size, "%s.%d", path, n);
+	else
+		snprintf(name, size, "%s", path);
 
-	i->width = codecpar->width ?: 320;
-	i->height = codecpar->height ?: 240;
-	i->need_header = 1;
+	return 0;
+}
 
-	framerate = av_stream_get_r_frame_rate(i->stream);
-	i->fps_n = framerate.num;
-	i->fps_d = framerate.den;
+static int
+open_outputs(struct instance *inst, int count, const struct instance *options)
+{
+	char name[PATH_MAX];
 
-	filter = NULL;
+	for (int n = 0; n < count; n++) {
+		struct instance *i = &inst[n];
 
-	switch (codecpar->codec_id) {
-	case AV_CODEC_ID_H263:
-		codec = V4L2_PIX_FMT_H263;
-		break;
-	case AV_CODEC_ID_H264:
-		codec = V4L2_PIX_FMT_H264;
-		filter = av_bsf_get_by_name("h264_mp4toannexb");
-		break;
-	case AV_CODEC_ID_HEVC:
-		codec = V4L2_PIX_FMT_HEVC;
-		filter = av_bsf_get_by_name("hevc_mp4toannexb");
-		break;
-	case AV_CODEC_ID_MPEG2VIDEO:
-		codec = V4L2_PIX_FMT_MPEG2;
-		break;
-	case AV_CODEC_ID_MPEG4:
-		codec = V4L2_PIX_FMT_MPEG4;
-		break;
-	case AV_CODEC_ID_MSMPEG4V3:
-		codec = V4L2_PIX_FMT_DIVX_311;
-		break;
-	case AV_CODEC_ID_WMV3:
-		codec = V4L2_PIX_FMT_VC1_ANNEX_G;
-		break;
-	case AV_CODEC_ID_VC1:
-		codec = V4L2_PIX_FMT_VC1_ANNEX_G;
-		break;
-	case AV_CODEC_ID_VP8:
-		codec = V4L2_PIX_FMT_VP8;
-		break;
-	case AV_CODEC_ID_VP9:
-		codec = V4L2_PIX_FMT_VP9;
-		break;
-	default:
-		err("cannot decode %s", avcodec_get_name(codecpar->codec_id));
-		goto fail;
-	}
+		if (options->dump_path) {
+			if (output_name(name, sizeof (name),
+					options->dump_path, count, n))
+				return -1;
+			if (dump_open(&i->dump, name))
+				return -1;
+		}
 
-	i->fourcc = codec;
+		if (options->index_path) {
+			if (output_name(name, sizeof (name),
+					options->index_path, count, n))
+				return -1;
 
-	if (filter) {
-		ret = av_bsf_alloc(filter, &i->bsf);
-		if (ret < 0) {
-			av_err(ret, "cannot allocate bistream filter");
-			goto fail;
+			if (!strcmp(name, "-"))
+				i->index_file = stdout;
+			else
+				i->index_file = fopen(name, "we");
+			if (!i->index_file) {
+				err("failed to open %s: %m", name);
+				return -1;
+			}
 		}
 
-		avcodec_parameters_copy(i->bsf->par_in, codecpar);
-		i->bsf->time_base_in = i->stream->time_base;
+		if (options->checksum_path) {
+			if (output_name(name, sizeof (name),
+					options->checksum_path, count, n))
+				return -1;
 
-		ret = av_bsf_init(i->bsf);
-		if (ret < 0) {
-			av_err(ret, "failed to initialize bitstream filter");
-			goto fail;
+			if (!strcmp(name, "-"))
+				i->checksum_file = stdout;
+			else
+				i->checksum_file = fopen(name, "we");
+			if (!i->checksum_file) {
+				err("failed to open %s: %m", name);
+				return -1;
+			}
 		}
 	}
 
 	return 0;
+}
 
-fail:
-	stream_close(i);
-	return -1;
+static void
+instance_destroy(struct instance *i)
+{
+	dump_close(&i->dump);
+	if (i->checksum_file && i->checksum_file != stdout)
+		fclose(i->checksum_file);
+	if (i->index_file && i->index_file != stdout)
+		fclose(i->index_file);
+	cleanup(i);
+
+	pktq_destroy(&i->pktq);
+
+	if (i->free_evfd >= 0)
+		close(i->free_evfd);
 }
 
 int main(int argc, char **argv)
 {
-	struct instance inst;
-	pthread_t parser_thread;
+	static struct instance inst[MAX_INSTANCES];
+	struct instance options;
+	struct display *display = NULL;
+	pthread_t parser_thread[MAX_INSTANCES];
+	pthread_t demux_thread[MAX_INSTANCES];
+	pthread_t probe_thread[MAX_INSTANCES];
+	uint64_t cpu_time;
+	int count, started, probing;
 	int ret;
 
-	ret = parse_args(&inst, argc, argv);
+	launch_time = time_us(CLOCK_MONOTONIC);
+
+	ret = parse_args(&options, argc, argv);
 	if (ret) {
 		print_usage(argv[0]);
 		return 1;
 	}
 
-	inst.sigfd = -1;
-	pthread_mutex_init(&inst.lock, 0);
-	pthread_cond_init(&inst.cond, 0);
+	count = options.playlist ? 1 : options.url_count;
+	started = 0;
+	probing = 0;
 
-	INIT_LIST_HEAD(&inst.video.pending_ts_list);
-	INIT_LIST_HEAD(&inst.fb_list);
-	inst.video.pts_dts_delta = TIMESTAMP_NONE;
-	inst.video.cap_last_pts = TIMESTAMP_NONE;
-	inst.video.extradata_index = -1;
-	inst.video.extradata_size = 0;
-	inst.video.extradata_ion_fd = -1;
+	if (options.trace_path || options.trace_marker) {
+		if (trace_init(options.trace_marker))
+			return 1;
+		trace_thread("main");
+	}
 
-	ret = stream_open(&inst);
-	if (ret)
-		goto err;
+	for (int n = 0; n < count; n++) {
+		ret = instance_init(&inst[n], &options, options.urls[n]);
+		if (ret) {
+			count = n;
+			goto err;
+		}
+		inst[n].id = n;
 
-	ret = video_open(&inst, inst.video.name);
-	if (ret)
-		goto err;
+		/* a playlist is played by a single instance */
+		if (!options.playlist) {
+			inst[n].urls = &options.urls[n];
+			inst[n].url_count = 1;
+		}
+	}
 
-	ret = subscribe_events(&inst);
-	if (ret)
+	wake_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_evfd < 0) {
+		err("failed to create eventfd: %m");
 		goto err;
+	}
+
+	av_log_set_level(get_av_log_level());
+
+	av_register_all();
+	avformat_network_init();
+
+	/* probing the streams takes the longest, it runs while the
+	 * devices and the display are set up */
+	for (; probing < count; probing++) {
+		if (pthread_create(&probe_thread[probing], NULL,
+				   probe_thread_func, &inst[probing]))
+			goto err;
+	}
 
-	if (inst.secure) {
-		ret = video_set_secure(&inst);
+	for (int n = 0; n < count; n++) {
+		ret = instance_open(&inst[n]);
 		if (ret)
 			goto err;
 	}
 
-	ret = video_setup_output(&inst, inst.fourcc,
-				 STREAM_BUUFER_SIZE, 6);
-	if (ret)
-		goto err;
+	/* in benchmark and index modes decoded frames are recycled right
+	 * away */
+	if (!options.bench && !options.dump_path && !options.index_path)
+		display = display_create();
 
-	ret = setup_display(&inst);
-	if (ret)
+	if (display) {
+		for (int n = 0; n < count; n++) {
+			ret = setup_window(&inst[n], display);
+			if (ret)
+				goto err;
+		}
+	} else if (!options.bench && !options.dump_path &&
+		   !options.index_path) {
 		err("display server not available, continuing anyway...");
+	}
 
-	ret = video_set_control(&inst);
-	if (ret)
-		goto err;
+	for (; probing > 0; probing--)
+		pthread_join(probe_thread[probing - 1], NULL);
 
-	ret = video_stream(&inst, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
-			   VIDIOC_STREAMON);
-	if (ret)
-		goto err;
+	for (int n = 0; n < count; n++) {
+		if (inst[n].probe_ret)
+			goto err;
+
+		ret = instance_setup(&inst[n]);
+		if (ret)
+			goto err;
+	}
 
-	ret = restart_capture(&inst);
+	ret = open_outputs(inst, count, &options);
 	if (ret)
 		goto err;
 
+	for (int n = 0; n < count; n++) {
+		ret = instance_start(&inst[n]);
+		if (ret)
+			goto err;
+	}
+
 	dbg("Launching threads");
 
-	setup_signal(&inst);
+	setup_signal();
 
-	if (pthread_create(&parser_thread, NULL, parser_thread_func, &inst))
+	if (options.stats_socket && setup_stats_socket(options.stats_socket))
 		goto err;
 
-	main_loop(&inst);
+	cpu_time = time_us(CLOCK_PROCESS_CPUTIME_ID);
+
+	for (started = 0; started < count; started++) {
+		struct instance *i = &inst[started];
+
+		i->start_time = time_us(CLOCK_MONOTONIC);
+
+		/* an ingest source feeds the decoder on its own */
+		if (i->ingest.type) {
+			if (pthread_create(&parser_thread[started], NULL,
+					   ingest_thread_func, i))
+				goto err;
+			continue;
+		}
+
+		if (pthread_create(&demux_thread[started], NULL,
+				   demux_thread_func, i))
+			goto err;
+
+		if (pthread_create(&parser_thread[started], NULL,
+				   parser_thread_func, i)) {
+			finish(i);
+			pthread_join(demux_thread[started], 0);
+			goto err;
+		}
+	}
+
+	main_loop(inst, count);
 
-	pthread_join(parser_thread, 0);
+	for (int n = 0; n < count; n++) {
+		if (!inst[n].end_time)
+			inst[n].end_time = time_us(CLOCK_MONOTONIC);
+
+		finish(&inst[n]);
+		pthread_join(parser_thread[n], 0);
+		if (!inst[n].ingest.type)
+			pthread_join(demux_thread[n], 0);
+	}
 
 	dbg("Threads have finished");
 
-	video_stop_output(&inst);
-	video_stop_capture(&inst);
+	for (int n = 0; n < count; n++)
+		dump_close(&inst[n].dump);
 
-	cleanup(&inst);
+	if (options.trace_path)
+		trace_export(options.trace_path);
 
-	pthread_cond_destroy(&inst.cond);
-	pthread_mutex_destroy(&inst.lock);
+	cpu_time = time_us(CLOCK_PROCESS_CPUTIME_ID) - cpu_time;
 
-	info("Total frames captured %ld", inst.video.total_captured);
+	if (options.bench)
+		bench_report(inst, count, cpu_time);
+
+	if (options.report_path)
+		write_report(options.report_path, inst, count);
+
+	for (int n = 0; n < count; n++) {
+		video_stop_output(&inst[n]);
+		video_stop_capture(&inst[n]);
+
+		info("Total frames captured %ld, presented %lu, dropped %lu (%s)",
+		     inst[n].video.total_captured, inst[n].sched.presented,
+		     inst[n].sched.dropped, inst[n].url);
+
+		if (options.latency_report)
+			latency_dump(&inst[n].latency, inst[n].url);
+
+		instance_destroy(&inst[n]);
+	}
+
+	if (display)
+		display_destroy(display);
+	if (sigfd != -1)
+		close(sigfd);
+	if (stats_fd != -1) {
+		close(stats_fd);
+		unlink(options.stats_socket);
+	}
+	close(wake_evfd);
 
 	return 0;
 err:
-	cleanup(&inst);
+	for (; probing > 0; probing--) {
+		finish(&inst[probing - 1]);
+		pthread_join(probe_thread[probing - 1], NULL);
+	}
+
+	for (int n = 0; n < started; n++) {
+		finish(&inst[n]);
+		pthread_join(parser_thread[n], 0);
+		if (!inst[n].ingest.type)
+			pthread_join(demux_thread[n], 0);
+	}
+
+	for (int n = 0; n < count; n++)
+		instance_destroy(&inst[n]);
+
+	if (display)
+		display_destroy(display);
+	if (sigfd != -1)
+		close(sigfd);
+	if (stats_fd != -1) {
+		close(stats_fd);
+		unlink(options.stats_socket);
+	}
+	if (wake_evfd != -1)
+		close(wake_evfd);
+
 	return 1;
 }
-
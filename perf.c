@@ -0,0 +1,230 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder performance level governor
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string.h>
+#include <media/msm_vidc.h>
+
+#include "common.h"
+#include "perf.h"
+#include "video.h"
+
+#define DBG_TAG "  perf"
+
+#define PERF_LEVEL_MIN		V4L2_CID_MPEG_VIDC_PERF_LEVEL_NOMINAL
+#define PERF_LEVEL_MAX		V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO
+
+/* Highest pixel rate handled at each level, 1080p60 at nominal clocks
+ * and 2160p30 at performance clocks */
+static const uint64_t perf_pixel_rate[] = {
+	[V4L2_CID_MPEG_VIDC_PERF_LEVEL_NOMINAL] = 1920ull * 1088 * 60,
+	[V4L2_CID_MPEG_VIDC_PERF_LEVEL_PERFORMANCE] = 3840ull * 2160 * 30,
+};
+
+/* Frame rate assumed when neither the container nor the stream tell */
+#define PERF_DEFAULT_FPS	30.0
+
+const char *
+perf_level_to_string(int level)
+{
+	switch (level) {
+	case V4L2_CID_MPEG_VIDC_PERF_LEVEL_NOMINAL:
+		return "nominal";
+	case V4L2_CID_MPEG_VIDC_PERF_LEVEL_PERFORMANCE:
+		return "performance";
+	case V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO:
+		return "turbo";
+	default:
+		return "unknown";
+	}
+}
+
+int
+perf_level_from_string(const char *s)
+{
+	if (!strcmp(s, "auto"))
+		return PERF_AUTO;
+	if (!strcmp(s, "nominal"))
+		return V4L2_CID_MPEG_VIDC_PERF_LEVEL_NOMINAL;
+	if (!strcmp(s, "performance"))
+		return V4L2_CID_MPEG_VIDC_PERF_LEVEL_PERFORMANCE;
+	if (!strcmp(s, "turbo"))
+		return V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO;
+
+	return -2;
+}
+
+static double
+perf_stream_fps(struct instance *i)
+{
+	struct perf_governor *p = &i->perf;
+
+	if (p->frame_rate)
+		return p->frame_rate / 65536.0;
+
+	if (i->fps_n > 0 && i->fps_d > 0)
+		return (double)i->fps_n / i->fps_d;
+
+	return PERF_DEFAULT_FPS;
+}
+
+static int
+perf_base_level(struct instance *i)
+{
+	uint64_t rate = (uint64_t)i->width * i->height * perf_stream_fps(i);
+	int level;
+
+	for (level = PERF_LEVEL_MIN; level < PERF_LEVEL_MAX; level++) {
+		if (rate <= perf_pixel_rate[level])
+			break;
+	}
+
+	return level;
+}
+
+static int
+perf_set(struct instance *i, int level, const char *reason)
+{
+	struct perf_governor *p = &i->perf;
+
+	level = MAX(MIN(level, PERF_LEVEL_MAX), PERF_LEVEL_MIN);
+	if (level == p->level)
+		return 0;
+
+	if (video_set_perf_level(i, level) < 0)
+		return -1;
+
+	info("perf level %s (%s)", perf_level_to_string(level), reason);
+
+	p->level = level;
+	p->slack = 0;
+	p->changes++;
+
+	return 0;
+}
+
+int
+perf_init(struct instance *i)
+{
+	struct perf_governor *p = &i->perf;
+
+	p->level = -1;
+	p->base = perf_base_level(i);
+
+	if (p->mode != PERF_AUTO)
+		return perf_set(i, p->mode, "fixed");
+
+	/* a benchmark measures the decoder at its best */
+	if (i->bench)
+		return perf_set(i, PERF_LEVEL_MAX, "benchmark");
+
+	return perf_set(i, p->base, "stream");
+}
+
+void
+perf_reconfigure(struct instance *i)
+{
+	struct perf_governor *p = &i->perf;
+
+	if (p->mode != PERF_AUTO || i->bench)
+		return;
+
+	p->base = perf_base_level(i);
+
+	/* start over from the level for the new stream */
+	perf_set(i, p->base, "stream changed");
+}
+
+void
+perf_frame_rate(struct instance *i, unsigned int frame_rate)
+{
+	struct perf_governor *p = &i->perf;
+
+	if (!frame_rate || frame_rate == p->frame_rate)
+		return;
+
+	p->frame_rate = frame_rate;
+
+	if (p->mode != PERF_AUTO || i->bench)
+		return;
+
+	/* only step up here, the slack check steps down */
+	p->base = perf_base_level(i);
+	if (p->base > p->level)
+		perf_set(i, p->base, "frame rate");
+}
+
+void
+perf_overload(struct instance *i)
+{
+	struct perf_governor *p = &i->perf;
+
+	if (p->mode != PERF_AUTO)
+		return;
+
+	perf_set(i, p->level + 1, "overload");
+}
+
+void
+perf_update(struct instance *i, double fps)
+{
+	struct perf_governor *p = &i->perf;
+	struct video *vid = &i->video;
+	double target = perf_stream_fps(i);
+	double occupancy = 0;
+	unsigned long samples;
+
+	samples = vid->out_queued_samples - p->out_queued_samples;
+	if (samples)
+		occupancy = (double)(vid->out_queued_sum -
+				     p->out_queued_sum) / samples;
+
+	p->out_queued_sum = vid->out_queued_sum;
+	p->out_queued_samples = vid->out_queued_samples;
+
+	/* paused or trick play, the rate says nothing about the decoder */
+	if (p->mode != PERF_AUTO || i->bench || i->paused || i->trick)
+		return;
+
+	/*
+	 * The decoder is behind when it is slower than the stream while
+	 * most OUTPUT buffers wait in its queue, otherwise the input
+	 * is what is late.
+	 */
+	if (fps < target * PERF_BEHIND_RATIO &&
+	    occupancy >= vid->out_buf_cnt / 2.0) {
+		perf_set(i, p->level + 1, "behind");
+		return;
+	}
+
+	if (p->level <= p->base) {
+		p->slack = 0;
+		return;
+	}
+
+	/* the presentation clock caps the rate when displaying, so the
+	 * queue occupancy tells about the slack too */
+	if (fps >= target * PERF_SLACK_RATIO ||
+	    occupancy < vid->out_buf_cnt / 4.0)
+		p->slack++;
+	else
+		p->slack = 0;
+
+	if (p->slack >= PERF_SLACK_WINDOWS)
+		perf_set(i, p->level - 1, "slack");
+}
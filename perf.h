@@ -0,0 +1,79 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder performance level governor header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_PERF_H
+#define INCLUDE_PERF_H
+
+#include <stdint.h>
+
+struct instance;
+
+/* Let the governor pick the level, otherwise a fixed
+ * V4L2_CID_MPEG_VIDC_PERF_LEVEL_* value is used */
+#define PERF_AUTO		-1
+
+/* Windows with slack needed before stepping down a level */
+#define PERF_SLACK_WINDOWS	5
+
+/* Decoding rate below this share of the stream rate means the decoder
+ * falls behind, above the other one it has slack */
+#define PERF_BEHIND_RATIO	0.95
+#define PERF_SLACK_RATIO	1.5
+
+/*
+ * The level is first picked from the pixel rate of the stream, then
+ * raised when the decoder reports an overload or falls behind with a
+ * backlog of packets, and lowered back once it keeps up with room to
+ * spare.
+ */
+struct perf_governor {
+	int mode;		/* PERF_AUTO or a fixed level */
+	int level;		/* level set on the decoder, -1 if none */
+	int base;		/* level for the stream pixel rate */
+	int slack;		/* consecutive windows with slack */
+	unsigned int frame_rate;	/* from the extradata, 1/0x10000 fps */
+
+	/* OUTPUT occupancy at the last evaluation */
+	uint64_t out_queued_sum;
+	unsigned long out_queued_samples;
+
+	unsigned long changes;
+};
+
+/* Set the initial level, before the decoder is started */
+int perf_init(struct instance *i);
+
+/* The stream resolution or frame rate changed */
+void perf_reconfigure(struct instance *i);
+
+/* The stream reported its frame rate, in 1/0x10000 fps */
+void perf_frame_rate(struct instance *i, unsigned int frame_rate);
+
+/* The decoder reported it cannot keep up */
+void perf_overload(struct instance *i);
+
+/* Evaluate the decoding rate, called about once per second */
+void perf_update(struct instance *i, double fps);
+
+const char *perf_level_to_string(int level);
+
+/* Parse a level name or "auto", returns -2 if unknown */
+int perf_level_from_string(const char *s);
+
+#endif /* INCLUDE_PERF_H */
@@ -0,0 +1,358 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Demuxed packet queue
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "pktq.h"
+
+#define DBG_TAG "  pktq"
+
+int
+pktq_init(struct pktq *q, size_t max_bytes, int max_ms)
+{
+	memset(q, 0, sizeof (*q));
+
+	q->entries = calloc(PKTQ_MAX_PACKETS, sizeof (*q->entries));
+	if (!q->entries) {
+		err("failed to allocate packet queue");
+		return -1;
+	}
+
+	q->max_bytes = max_bytes;
+	q->max_duration = (uint64_t)max_ms * 1000;
+
+	pthread_mutex_init(&q->lock, 0);
+	pthread_cond_init(&q->cond, 0);
+
+	return 0;
+}
+
+void
+pktq_destroy(struct pktq *q)
+{
+	if (!q->entries)
+		return;
+
+	pktq_flush(q);
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+
+	free(q->entries);
+	q->entries = NULL;
+}
+
+static int
+pktq_full(struct pktq *q)
+{
+	if (!q->count)
+		return 0;
+
+	return q->count == PKTQ_MAX_PACKETS ||
+		q->bytes >= q->max_bytes ||
+		q->duration >= q->max_duration;
+}
+
+int
+pktq_put(struct pktq *q, AVPacket *pkt, uint64_t read_time,
+	 uint64_t duration)
+{
+	struct pktq_entry *e;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->aborted && !q->seek_pending && pktq_full(q))
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (q->aborted || q->seek_pending) {
+		int ret = q->aborted ? -1 : PKTQ_SEEK;
+
+		pthread_mutex_unlock(&q->lock);
+		av_packet_unref(pkt);
+		return ret;
+	}
+
+	e = &q->entries[(q->first + q->count) % PKTQ_MAX_PACKETS];
+	av_packet_move_ref(&e->pkt, pkt);
+	e->read_time = read_time;
+	e->duration = duration;
+	e->flush = 0;
+	e->next = 0;
+
+	q->count++;
+	q->bytes += e->pkt.size;
+	q->duration += duration;
+
+	q->peak_count = MAX(q->peak_count, q->count);
+	q->peak_bytes = MAX(q->peak_bytes, q->bytes);
+	q->peak_duration = MAX(q->peak_duration, q->duration);
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+int
+pktq_put_flush(struct pktq *q, int mode)
+{
+	struct pktq_entry *e;
+
+	pthread_mutex_lock(&q->lock);
+
+	/* the queue was flushed by the seek request, so there is room */
+	if (q->aborted || q->count == PKTQ_MAX_PACKETS) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	e = &q->entries[(q->first + q->count) % PKTQ_MAX_PACKETS];
+	av_init_packet(&e->pkt);
+	e->pkt.data = NULL;
+	e->pkt.size = 0;
+	e->read_time = 0;
+	e->duration = 0;
+	e->flush = 1;
+	e->mode = mode;
+	e->next = 0;
+
+	q->count++;
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+int
+pktq_put_next(struct pktq *q)
+{
+	struct pktq_entry *e;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->aborted && !q->seek_pending &&
+	       q->count == PKTQ_MAX_PACKETS)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (q->aborted || q->seek_pending) {
+		ret = q->aborted ? -1 : PKTQ_SEEK;
+		goto out;
+	}
+
+	e = &q->entries[(q->first + q->count) % PKTQ_MAX_PACKETS];
+	av_init_packet(&e->pkt);
+	e->pkt.data = NULL;
+	e->pkt.size = 0;
+	e->read_time = 0;
+	e->duration = 0;
+	e->flush = 0;
+	e->next = 1;
+
+	q->count++;
+	q->next_pending = 1;
+	q->next_taken = 0;
+
+	pthread_cond_broadcast(&q->cond);
+
+	while (!q->aborted && q->next_pending)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (q->aborted)
+		ret = -1;
+	else
+		ret = q->next_taken ? 0 : PKTQ_SEEK;
+
+out:
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+void
+pktq_put_end(struct pktq *q, int error)
+{
+	pthread_mutex_lock(&q->lock);
+	q->end = error;
+	q->ended = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int
+pktq_get(struct pktq *q, AVPacket *pkt, uint64_t *read_time, int *mode)
+{
+	struct pktq_entry *e;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (!q->count && !q->ended && !q->aborted) {
+		q->underruns++;
+		dbg("packet queue empty, waiting for the demuxer");
+	}
+
+	while (!q->aborted && !q->count && !q->ended)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (q->aborted) {
+		ret = AVERROR_EXIT;
+	} else if (!q->count) {
+		/* given once, the demuxer then waits for a seek */
+		ret = q->end;
+		q->ended = 0;
+	} else {
+		e = &q->entries[q->first];
+		q->first = (q->first + 1) % PKTQ_MAX_PACKETS;
+		q->count--;
+
+		if (e->flush) {
+			*mode = e->mode;
+			ret = PKTQ_FLUSH;
+		} else if (e->next) {
+			q->next_pending = 0;
+			q->next_taken = 1;
+			ret = PKTQ_NEXT;
+		} else {
+			av_packet_move_ref(pkt, &e->pkt);
+			*read_time = e->read_time;
+
+			q->bytes -= pkt->size;
+			q->duration -= e->duration;
+			ret = 0;
+		}
+
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+static void
+pktq_flush_locked(struct pktq *q)
+{
+	while (q->count) {
+		av_packet_unref(&q->entries[q->first].pkt);
+		q->first = (q->first + 1) % PKTQ_MAX_PACKETS;
+		q->count--;
+	}
+
+	q->first = 0;
+	q->bytes = 0;
+	q->duration = 0;
+
+	/* a next clip marker was dropped with the packets */
+	q->next_pending = 0;
+}
+
+void
+pktq_flush(struct pktq *q)
+{
+	pthread_mutex_lock(&q->lock);
+	pktq_flush_locked(q);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int
+pktq_seek(struct pktq *q, int64_t target, int mode)
+{
+	pthread_mutex_lock(&q->lock);
+
+	if (q->aborted) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	/* the demuxer reads again from the target */
+	q->ended = 0;
+
+	/* the packets past the flush marker of a previous seek are
+	 * dropped too, the marker is queued again after this seek */
+	pktq_flush_locked(q);
+
+	q->seek_pending = 1;
+	q->seek_target = target;
+	q->seek_mode = mode;
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+int
+pktq_wait_seek(struct pktq *q)
+{
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->aborted && !q->seek_pending)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	ret = q->aborted ? -1 : 0;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+int
+pktq_take_seek(struct pktq *q, int64_t *target, int *mode)
+{
+	int pending;
+
+	pthread_mutex_lock(&q->lock);
+
+	pending = q->seek_pending;
+	if (pending) {
+		*target = q->seek_target;
+		*mode = q->seek_mode;
+		q->seek_pending = 0;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return pending;
+}
+
+void
+pktq_abort(struct pktq *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->aborted = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void
+pktq_depth(struct pktq *q, int *count, size_t *bytes, uint64_t *duration)
+{
+	pthread_mutex_lock(&q->lock);
+	*count = q->count;
+	*bytes = q->bytes;
+	*duration = q->duration;
+	pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,141 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Demuxed packet queue header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_PKTQ_H
+#define INCLUDE_PKTQ_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+/* Maximum number of packets in a queue, whatever their size */
+#define PKTQ_MAX_PACKETS	1024
+
+/* Default queue limits */
+#define PKTQ_DEFAULT_BYTES	(8 * 1024 * 1024)
+#define PKTQ_DEFAULT_MS		2000
+
+/* Returned by pktq_get() for the flush marker queued after a seek */
+#define PKTQ_FLUSH		1
+
+/* Returned by pktq_get() for the marker of the start of the next clip */
+#define PKTQ_NEXT		2
+
+/* Returned by pktq_put() when a seek was requested */
+#define PKTQ_SEEK		1
+
+struct pktq_entry {
+	AVPacket pkt;
+	uint64_t read_time;	/* monotonic us */
+	uint64_t duration;	/* us */
+	int flush;		/* flush marker, with the new mode */
+	int mode;
+	int next;		/* next clip marker */
+};
+
+/*
+ * Bounded queue between the demuxer thread and the parser thread. The
+ * queue is full when it holds more than the configured amount of bytes
+ * or of content duration, but always accepts one packet so that a
+ * packet larger than the limit can not stall it.
+ */
+struct pktq {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct pktq_entry *entries;
+	int first;
+	int count;
+
+	size_t bytes;
+	uint64_t duration;
+	size_t max_bytes;
+	uint64_t max_duration;
+
+	int end;		/* error returned by the demuxer at the end */
+	int ended;
+	int aborted;
+
+	/* seek requested to the demuxer */
+	int seek_pending;
+	int64_t seek_target;
+	int seek_mode;
+
+	/* next clip marker queued, and whether the parser took it */
+	int next_pending;
+	int next_taken;
+
+	/* metrics */
+	int peak_count;
+	size_t peak_bytes;
+	uint64_t peak_duration;
+	unsigned long underruns;
+};
+
+int pktq_init(struct pktq *q, size_t max_bytes, int max_ms);
+void pktq_destroy(struct pktq *q);
+
+/* Queue a packet, taking its reference; waits while the queue is full.
+ * Returns -1 when the queue was aborted, or PKTQ_SEEK, dropping the
+ * packet, when a seek was requested meanwhile. */
+int pktq_put(struct pktq *q, AVPacket *pkt, uint64_t read_time,
+	     uint64_t duration);
+
+/* Queue the end of the stream, with the demuxer error */
+void pktq_put_end(struct pktq *q, int error);
+
+/* Queue the marker separating the packets read before and after a
+ * seek, with the playback mode to use from there */
+int pktq_put_flush(struct pktq *q, int mode);
+
+/* Queue the marker separating the packets of two clips, then wait for
+ * the parser to take it, done with the current clip. Returns -1 when
+ * the queue was aborted, or PKTQ_SEEK when a seek dropped the marker. */
+int pktq_put_next(struct pktq *q);
+
+/* Get a packet, waiting while the queue is empty. Returns the demuxer
+ * error once at the end of the stream, then waits for the packets of a
+ * seek, AVERROR_EXIT when aborted, PKTQ_FLUSH with the new playback
+ * mode for a flush marker, or PKTQ_NEXT for a next clip marker. */
+int pktq_get(struct pktq *q, AVPacket *pkt, uint64_t *read_time,
+	     int *mode);
+
+/* Ask the demuxer to seek to target, dropping the queued packets, the
+ * end of the stream included. Returns -1 when the queue was aborted. */
+int pktq_seek(struct pktq *q, int64_t target, int mode);
+
+/* Called by the demuxer at the end of the stream to wait for a seek.
+ * Returns -1 when the queue was aborted. */
+int pktq_wait_seek(struct pktq *q);
+
+/* Called by the demuxer to get the pending seek request, if any */
+int pktq_take_seek(struct pktq *q, int64_t *target, int *mode);
+
+/* Drop the queued packets */
+void pktq_flush(struct pktq *q);
+
+/* Wake up and stop both sides */
+void pktq_abort(struct pktq *q);
+
+/* Current depth of the queue */
+void pktq_depth(struct pktq *q, int *count, size_t *bytes,
+		uint64_t *duration);
+
+#endif /* INCLUDE_PKTQ_H */
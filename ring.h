@@ -0,0 +1,100 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Lock-free ring header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_RING_H
+#define INCLUDE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Single producer, single consumer ring of fixed size elements. The
+ * producer only writes the head and the consumer only writes the tail,
+ * so neither side takes a lock. The capacity must be a power of two.
+ */
+struct ring {
+	/* kept on different cache lines to avoid false sharing */
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	unsigned int size;
+	size_t elem_size;
+	void *data;
+};
+
+static inline void
+ring_init(struct ring *r, void *data, unsigned int size, size_t elem_size)
+{
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->size = size;
+	r->elem_size = elem_size;
+	r->data = data;
+}
+
+/* Called by the producer, returns false if the ring is full */
+static inline bool
+ring_push(struct ring *r, const void *elem)
+{
+	unsigned int head = atomic_load_explicit(&r->head,
+						 memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&r->tail,
+						 memory_order_acquire);
+
+	if (head - tail == r->size)
+		return false;
+
+	memcpy((char *)r->data + (head & (r->size - 1)) * r->elem_size,
+	       elem, r->elem_size);
+
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+/* Called by the consumer, returns false if the ring is empty */
+static inline bool
+ring_pop(struct ring *r, void *elem)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail,
+						 memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&r->head,
+						 memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	memcpy(elem, (char *)r->data + (tail & (r->size - 1)) * r->elem_size,
+	       r->elem_size);
+
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+/* Called by the consumer */
+static inline bool
+ring_empty(struct ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) ==
+		atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+#endif /* INCLUDE_RING_H */
@@ -0,0 +1,176 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Presentation scheduler
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "common.h"
+#include "sched.h"
+
+#define DBG_TAG " sched"
+
+void
+sched_init(struct sched *s)
+{
+	memset(s, 0, sizeof (*s));
+	s->period = SCHED_DEFAULT_PERIOD;
+}
+
+void
+sched_clear(struct sched *s)
+{
+	s->first = 0;
+	s->count = 0;
+	s->anchored = 0;
+}
+
+void
+sched_reset_clock(struct sched *s)
+{
+	s->anchored = 0;
+}
+
+int
+sched_push(struct sched *s, int index, struct fb *fb, uint64_t pts)
+{
+	struct sched_frame *f;
+
+	if (s->count == SCHED_MAX_FRAMES)
+		return -1;
+
+	f = &s->frames[(s->first + s->count) % SCHED_MAX_FRAMES];
+	f->pts = pts;
+	f->index = index;
+	f->fb = fb;
+	s->count++;
+
+	return 0;
+}
+
+void
+sched_presented(struct sched *s, uint64_t time, uint32_t refresh_ns)
+{
+	s->pending = 0;
+
+	if (time)
+		s->last_vblank = time;
+	/* a refresh below 1 us is bogus, keep the previous period */
+	if (refresh_ns >= 1000)
+		s->period = refresh_ns / 1000;
+}
+
+static void
+sched_pop(struct sched *s, struct sched_frame *frame)
+{
+	*frame = s->frames[s->first];
+	s->first = (s->first + 1) % SCHED_MAX_FRAMES;
+	s->count--;
+}
+
+int
+sched_take(struct sched *s, struct sched_frame *frame)
+{
+	if (!s->count)
+		return 0;
+
+	sched_pop(s, frame);
+
+	return 1;
+}
+
+static uint64_t
+sched_due(struct sched *s, const struct sched_frame *f)
+{
+	if (f->pts < s->anchor_pts)
+		return s->anchor_time;
+
+	return s->anchor_time + (f->pts - s->anchor_pts);
+}
+
+enum sched_action
+sched_next(struct sched *s, uint64_t now, int immediate,
+	   struct sched_frame *frame, int *timeout)
+{
+	uint64_t vblank, due;
+	uint32_t half = s->period / 2;
+
+	*timeout = -1;
+
+	if (!s->count || s->pending)
+		return SCHED_WAIT;
+
+	/* a newer frame makes the queued one stale */
+	if (s->latest && s->count > 1) {
+		sched_pop(s, frame);
+		s->dropped++;
+		dbg("drop stale frame pts %" PRIu64, frame->pts);
+		return SCHED_DROP;
+	}
+
+	immediate |= s->latest;
+
+	/* the first vblank a commit done now can make */
+	vblank = now;
+	if (s->last_vblank && s->last_vblank < now)
+		vblank = s->last_vblank +
+			((now - s->last_vblank) / s->period + 1) * s->period;
+
+	due = sched_due(s, &s->frames[s->first]);
+
+	if (immediate || !s->anchored ||
+	    due > vblank + SCHED_MAX_DRIFT || due + SCHED_MAX_DRIFT < vblank) {
+		if (s->anchored)
+			info("stream clock restarted at pts %" PRIu64,
+			     s->frames[s->first].pts);
+
+		s->anchor_pts = s->frames[s->first].pts;
+		s->anchor_time = vblank;
+		s->anchored = !immediate;
+		goto show;
+	}
+
+	/* a frame is late when the next one is already due */
+	if (s->count > 1) {
+		const struct sched_frame *next =
+			&s->frames[(s->first + 1) % SCHED_MAX_FRAMES];
+
+		if (sched_due(s, next) <= vblank + half) {
+			sched_pop(s, frame);
+			s->dropped++;
+			dbg("drop frame pts %" PRIu64 " late by %" PRIi64 " us",
+			    frame->pts, (int64_t)(vblank - due));
+			return SCHED_DROP;
+		}
+	}
+
+	if (due > vblank + half) {
+		/* wake up for the vblank before the due one */
+		int64_t delay = due - half - s->period - now;
+
+		*timeout = delay > 0 ? (delay + 999) / 1000 : 1;
+		return SCHED_WAIT;
+	}
+
+show:
+	sched_pop(s, frame);
+	s->pending = 1;
+	s->presented++;
+
+	return SCHED_SHOW;
+}
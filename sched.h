@@ -0,0 +1,100 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Presentation scheduler header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_SCHED_H
+#define INCLUDE_SCHED_H
+
+#include <stdint.h>
+
+struct fb;
+
+/* Maximum number of decoded frames waiting to be presented */
+#define SCHED_MAX_FRAMES	32
+
+/* Refresh period assumed until the compositor reports one, in us */
+#define SCHED_DEFAULT_PERIOD	16667
+
+/* Frames further than this from their due time, in us, restart the
+ * stream clock instead of being waited for or dropped */
+#define SCHED_MAX_DRIFT		2000000
+
+struct sched_frame {
+	uint64_t pts;		/* stream time in us */
+	int index;		/* capture buffer index */
+	struct fb *fb;
+};
+
+enum sched_action {
+	SCHED_WAIT,		/* nothing to do until the timeout */
+	SCHED_SHOW,		/* commit the frame now */
+	SCHED_DROP,		/* the frame missed its deadline */
+};
+
+/*
+ * Frames are presented one at a time: a frame is committed for the
+ * vblank closest to its due time, and the next one only once the
+ * compositor reported the previous as presented. The stream clock is
+ * anchored to the first frame presented.
+ */
+struct sched {
+	struct sched_frame frames[SCHED_MAX_FRAMES];
+	int first;
+	int count;
+	int pending;		/* a frame is committed but not presented */
+	int latest;		/* only show the newest frame, as soon as
+				 * possible, the older ones are dropped */
+
+	uint64_t last_vblank;	/* monotonic time of the last presentation */
+	uint32_t period;	/* output refresh period in us */
+
+	int anchored;
+	uint64_t anchor_pts;
+	uint64_t anchor_time;
+
+	unsigned long presented;
+	unsigned long dropped;
+};
+
+void sched_init(struct sched *s);
+
+/* Forget the queued frames and the stream clock, the caller owns the
+ * buffers of the queued frames */
+void sched_clear(struct sched *s);
+
+/* Take the oldest queued frame, without presenting it, e.g. to give
+ * its buffer back after a seek. Returns 0 when there is none. */
+int sched_take(struct sched *s, struct sched_frame *frame);
+
+/* Forget the stream clock only, e.g. after a pause */
+void sched_reset_clock(struct sched *s);
+
+int sched_push(struct sched *s, int index, struct fb *fb, uint64_t pts);
+
+/* Report the frame committed last as presented at time (monotonic us),
+ * or as done without presentation time when time is 0 */
+void sched_presented(struct sched *s, uint64_t time, uint32_t refresh_ns);
+
+/* Get what to do next with the oldest frame. When immediate is set, the
+ * frames are shown as soon as possible, ignoring their time. On
+ * SCHED_WAIT, timeout is the delay in ms to call again after, or -1 to
+ * wait for a new frame or presentation. */
+enum sched_action sched_next(struct sched *s, uint64_t now, int immediate,
+			     struct sched_frame *frame, int *timeout);
+
+#endif /* INCLUDE_SCHED_H */
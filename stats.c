@@ -0,0 +1,278 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoding statistics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "common.h"
+#include "stats.h"
+
+#define DBG_TAG " stats"
+
+static const char *latency_names[LATENCY_COUNT] = {
+	"read->queued",
+	"queued->decoded",
+	"decoded->shown",
+	"shown->presented",
+	"total",
+};
+
+static int
+histogram_bucket(uint64_t value)
+{
+	int e;
+
+	if (value < HISTOGRAM_LINEAR)
+		return value;
+
+	/* position of the most significant bit, at least 4 here */
+	e = 63 - __builtin_clzll(value);
+
+	return HISTOGRAM_LINEAR + (e - 4) * HISTOGRAM_SUB_BUCKETS +
+		((value >> (e - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Middle of the range of values falling in a bucket */
+static uint64_t
+histogram_bucket_value(int bucket)
+{
+	int e, sub;
+
+	if (bucket < HISTOGRAM_LINEAR)
+		return bucket;
+
+	e = (bucket - HISTOGRAM_LINEAR) / HISTOGRAM_SUB_BUCKETS + 4;
+	sub = (bucket - HISTOGRAM_LINEAR) % HISTOGRAM_SUB_BUCKETS;
+
+	return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (e - 3)) +
+		((1ull << (e - 3)) >> 1);
+}
+
+void
+histogram_add(struct histogram *h, uint64_t value)
+{
+	h->count[histogram_bucket(value)]++;
+	h->samples++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void
+histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof (*h));
+}
+
+uint64_t
+histogram_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank, seen = 0;
+
+	if (!h->samples)
+		return 0;
+
+	rank = h->samples * p / 100.0;
+	if (rank >= h->samples)
+		rank = h->samples - 1;
+
+	for (int n = 0; n < HISTOGRAM_BUCKETS; n++) {
+		seen += h->count[n];
+		if (seen > rank)
+			return MIN(histogram_bucket_value(n), h->max);
+	}
+
+	return h->max;
+}
+
+void
+latency_add_frame(struct latency_stats *stats, const struct frame_times *times)
+{
+	int first = -1, last = -1;
+
+	for (int n = 0; n < STAGE_COUNT; n++) {
+		if (!times->t[n])
+			continue;
+
+		/* only account intervals between adjacent stages */
+		if (n > 0 && times->t[n - 1] && times->t[n] >= times->t[n - 1])
+			histogram_add(&stats->hist[n - 1],
+				      times->t[n] - times->t[n - 1]);
+
+		if (first < 0)
+			first = n;
+		last = n;
+	}
+
+	if (first >= 0 && last > first && times->t[last] >= times->t[first])
+		histogram_add(&stats->hist[LATENCY_TOTAL],
+			      times->t[last] - times->t[first]);
+}
+
+static void
+histogram_print(const char *name, const struct histogram *h)
+{
+	if (!h->samples)
+		return;
+
+	info("  %-18s %9.3f %9.3f %9.3f %9.3f %9.3f %8" PRIu64,
+	     name, h->sum / 1e3 / h->samples,
+	     histogram_percentile(h, 50) / 1e3,
+	     histogram_percentile(h, 95) / 1e3,
+	     histogram_percentile(h, 99) / 1e3,
+	     h->max / 1e3, h->samples);
+}
+
+static void
+json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+
+	fputc('"', f);
+}
+
+static void
+json_queue(FILE *f, const char *name, int queued, int buffers, int peak,
+	   uint64_t sum, unsigned long samples)
+{
+	fprintf(f, "\"%s\":{\"queued\":%d,\"buffers\":%d,\"peak\":%d,"
+		"\"avg\":%.2f}", name, queued, buffers, peak,
+		samples ? (double)sum / samples : 0.0);
+}
+
+static void
+json_histogram(FILE *f, const char *name, const struct histogram *h)
+{
+	fprintf(f, "\"%s\":{\"avg\":%.3f,\"p50\":%.3f,\"p95\":%.3f,"
+		"\"p99\":%.3f,\"max\":%.3f,\"frames\":%" PRIu64 "}", name,
+		h->samples ? h->sum / 1e3 / h->samples : 0.0,
+		histogram_percentile(h, 50) / 1e3,
+		histogram_percentile(h, 95) / 1e3,
+		histogram_percentile(h, 99) / 1e3,
+		h->max / 1e3, h->samples);
+}
+
+void
+stats_write_json(FILE *f, struct instance *inst, int count)
+{
+	uint64_t now = time_us(CLOCK_MONOTONIC);
+
+	fprintf(f, "{\"instances\":[");
+
+	for (int n = 0; n < count; n++) {
+		struct instance *i = &inst[n];
+		struct video *vid = &i->video;
+		const struct histogram *reconf = &i->latency.reconfigure;
+		uint64_t end = i->end_time ? i->end_time : now;
+		double elapsed = 0;
+		uint64_t duration;
+		size_t bytes;
+		int packets;
+
+		if (i->start_time && end > i->start_time)
+			elapsed = (end - i->start_time) / 1e6;
+
+		pktq_depth(&i->pktq, &packets, &bytes, &duration);
+
+		fprintf(f, "%s{\"url\":", n ? "," : "");
+		json_string(f, i->url);
+		fprintf(f, ",\"clip\":%d", i->clip);
+
+		fprintf(f, ",\"running\":%s,\"elapsed\":%.3f,"
+			"\"frames\":{\"decoded\":%lu,\"presented\":%lu,"
+			"\"dropped\":%lu},\"fps\":%.2f,\"avg_fps\":%.2f,",
+			i->finish ? "false" : "true", elapsed,
+			vid->total_captured, i->sched.presented,
+			i->sched.dropped, vid->fps,
+			elapsed > 0 ? vid->total_captured / elapsed : 0.0);
+
+		json_queue(f, "output", vid->out_queued, vid->out_buf_cnt,
+			   vid->peak_out_queued, vid->out_queued_sum,
+			   vid->out_queued_samples);
+		fputc(',', f);
+		json_queue(f, "capture", vid->cap_queued, vid->cap_buf_cnt,
+			   vid->peak_cap_queued, vid->cap_queued_sum,
+			   vid->cap_queued_samples);
+
+		fprintf(f, ",\"packets\":{\"queued\":%d,\"bytes\":%zu,"
+			"\"ms\":%" PRIu64 ",\"underruns\":%lu},"
+			"\"bytes_fed\":%" PRIu64 ","
+			"\"parser_stalls\":%lu,\"parser_stall_ms\":%.3f,"
+			"\"reconfigures\":%lu,\"reconfigure_ms\":"
+			"{\"avg\":%.3f,\"max\":%.3f},",
+			packets, bytes, duration / 1000, i->pktq.underruns,
+			vid->bytes_queued, vid->parser_stalls,
+			vid->parser_stall_time / 1e3, vid->reconfigures,
+			reconf->samples ?
+			reconf->sum / 1e3 / reconf->samples : 0.0,
+			reconf->max / 1e3);
+
+		fprintf(f, "\"first_frame_ms\":%.1f,\"probe_ms\":%.1f,",
+			i->first_frame_time / 1e3, i->probe_time / 1e3);
+
+		fprintf(f, "\"perf_level\":\"%s\",\"perf_changes\":%lu,",
+			perf_level_to_string(i->perf.level), i->perf.changes);
+
+		fprintf(f, "\"ion\":{\"bytes\":%" PRIu64 ",\"peak\":%" PRIu64
+			",\"arena\":%zu,\"arena_used\":%zu},", vid->ion_bytes,
+			vid->peak_ion_bytes, vid->arena.size, vid->arena.used);
+
+		/* per stage frame latency, in ms */
+		fprintf(f, "\"latency\":{");
+		for (int s = 0; s < LATENCY_COUNT; s++) {
+			if (s)
+				fputc(',', f);
+			json_histogram(f, latency_names[s],
+				       &i->latency.hist[s]);
+		}
+		fprintf(f, "},");
+
+		fprintf(f, "\"events\":{\"sys_error\":%lu,"
+			"\"hw_overload\":%lu,\"hw_unsupported\":%lu,"
+			"\"release_unqueued\":%lu}}",
+			vid->sys_errors, vid->hw_overloads, vid->hw_unsupported,
+			vid->release_unqueued);
+	}
+
+	/* the CPU time is that of the whole process, in s */
+	fprintf(f, "],\"cpu_time\":%.3f}\n",
+		time_us(CLOCK_PROCESS_CPUTIME_ID) / 1e6);
+}
+
+void
+latency_dump(const struct latency_stats *stats, const char *name)
+{
+	info("latency for %s (ms):", name);
+	info("  %-18s %9s %9s %9s %9s %9s %8s", "stage",
+	     "avg", "p50", "p95", "p99", "max", "frames");
+
+	for (int n = 0; n < LATENCY_COUNT; n++)
+		histogram_print(latency_names[n], &stats->hist[n]);
+
+	histogram_print("reconfigure", &stats->reconfigure);
+}
@@ -0,0 +1,83 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoding statistics header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Stages a frame goes through, from the demuxer to the screen */
+enum frame_stage {
+	STAGE_READ,		/* packet returned by av_read_frame() */
+	STAGE_QUEUED,		/* packet queued on the OUTPUT queue */
+	STAGE_DECODED,		/* frame dequeued from the CAPTURE queue */
+	STAGE_SHOWN,		/* frame handed to the compositor */
+	STAGE_PRESENTED,	/* frame presented by the compositor */
+	STAGE_COUNT
+};
+
+/* Monotonic time in us at which a frame reached each stage, 0 if it
+ * did not (yet) */
+struct frame_times {
+	uint64_t t[STAGE_COUNT];
+};
+
+/* Histogram of values with logarithmic buckets: values below 16 have
+ * their own bucket, larger values get 8 buckets per power of two, which
+ * keeps the error on percentiles under 12.5% */
+#define HISTOGRAM_LINEAR	16
+#define HISTOGRAM_SUB_BUCKETS	8
+#define HISTOGRAM_BUCKETS	(HISTOGRAM_LINEAR + 60 * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint32_t count[HISTOGRAM_BUCKETS];
+	uint64_t samples;
+	uint64_t sum;
+	uint64_t max;
+};
+
+void histogram_add(struct histogram *h, uint64_t value);
+void histogram_reset(struct histogram *h);
+
+/* Get the value below which p percent of the samples fall */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+/* Latency between consecutive stages, plus the overall latency from the
+ * first to the last stage a frame reached */
+#define LATENCY_TOTAL		(STAGE_COUNT - 1)
+#define LATENCY_COUNT		STAGE_COUNT
+
+struct latency_stats {
+	struct histogram hist[LATENCY_COUNT];
+
+	/* from a resolution change event to the first new frame */
+	struct histogram reconfigure;
+};
+
+void latency_add_frame(struct latency_stats *stats,
+		       const struct frame_times *times);
+void latency_dump(const struct latency_stats *stats, const char *name);
+
+struct instance;
+
+/* Write the live counters of the decoding instances as a JSON object */
+void stats_write_json(FILE *f, struct instance *inst, int count);
+
+#endif /* INCLUDE_STATS_H */
@@ -0,0 +1,243 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Event tracing
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define DBG_TAG " trace"
+
+/* Threads traced at most */
+#define TRACE_MAX_THREADS	32
+
+/*
+ * Each thread only writes to its own ring, without any lock or atomic
+ * read-modify-write, so a record costs a clock read and a few stores.
+ * The rings are read when exporting, once the threads are done.
+ */
+struct trace_buffer {
+	struct trace_record records[TRACE_RECORDS];
+	atomic_uint head;
+	int tid;
+	char name[32];
+};
+
+int trace_enabled;
+
+static int trace_marker_fd = -1;
+static struct trace_buffer *trace_buffers[TRACE_MAX_THREADS];
+static atomic_int trace_buffer_count;
+static _Thread_local struct trace_buffer *trace_local;
+static _Thread_local char trace_local_name[32];
+
+static const char *trace_names[TRACE_TYPE_COUNT] = {
+	[TRACE_QBUF_OUTPUT] = "QBUF OUTPUT",
+	[TRACE_DQBUF_OUTPUT] = "DQBUF OUTPUT",
+	[TRACE_QBUF_CAPTURE] = "QBUF CAPTURE",
+	[TRACE_DQBUF_CAPTURE] = "DQBUF CAPTURE",
+	[TRACE_EVENT] = "event",
+	[TRACE_SHOW] = "show",
+	[TRACE_DROP] = "drop",
+	[TRACE_PRESENTED] = "presented",
+	[TRACE_RELEASED] = "released",
+	[TRACE_PARSER_WAIT] = "wait buffer",
+	[TRACE_PARSER_WAKE] = "wait buffer",
+};
+
+int
+trace_init(int marker)
+{
+	if (marker) {
+		trace_marker_fd = open("/sys/kernel/tracing/trace_marker",
+				       O_WRONLY | O_CLOEXEC);
+		if (trace_marker_fd < 0)
+			trace_marker_fd =
+				open("/sys/kernel/debug/tracing/trace_marker",
+				     O_WRONLY | O_CLOEXEC);
+		if (trace_marker_fd < 0) {
+			err("failed to open trace_marker: %m");
+			return -1;
+		}
+	}
+
+	trace_enabled = 1;
+
+	return 0;
+}
+
+void
+trace_thread(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(trace_local_name, sizeof (trace_local_name), fmt, ap);
+	va_end(ap);
+
+	if (trace_local)
+		strcpy(trace_local->name, trace_local_name);
+}
+
+static struct trace_buffer *
+trace_buffer_get(void)
+{
+	struct trace_buffer *b;
+	int n;
+
+	if (trace_local)
+		return trace_local;
+
+	n = atomic_fetch_add(&trace_buffer_count, 1);
+	if (n >= TRACE_MAX_THREADS) {
+		atomic_fetch_sub(&trace_buffer_count, 1);
+		return NULL;
+	}
+
+	b = calloc(1, sizeof (*b));
+	if (!b) {
+		trace_buffers[n] = NULL;
+		return NULL;
+	}
+
+	b->tid = syscall(SYS_gettid);
+	strcpy(b->name, trace_local_name[0] ? trace_local_name : "thread");
+	atomic_init(&b->head, 0);
+
+	trace_buffers[n] = b;
+	trace_local = b;
+
+	return b;
+}
+
+static void
+trace_marker(const struct trace_record *r)
+{
+	char buf[128];
+	int len;
+
+	len = snprintf(buf, sizeof (buf), "v4l2_decode: %s instance=%d "
+		       "arg=%" PRIi32 " value=%" PRIi64 "\n",
+		       trace_names[r->type], r->instance, r->arg, r->value);
+
+	if (write(trace_marker_fd, buf, len) < 0)
+		return;
+}
+
+void
+trace_record(int instance, enum trace_type type, int32_t arg, int64_t value)
+{
+	struct trace_buffer *b = trace_buffer_get();
+	struct trace_record *r;
+	struct timespec ts;
+	unsigned int head;
+
+	if (!b)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	head = atomic_load_explicit(&b->head, memory_order_relaxed);
+	r = &b->records[head & (TRACE_RECORDS - 1)];
+	r->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->type = type;
+	r->instance = instance;
+	r->arg = arg;
+	r->value = value;
+	atomic_store_explicit(&b->head, head + 1, memory_order_release);
+
+	if (trace_marker_fd >= 0)
+		trace_marker(r);
+}
+
+static void
+trace_export_record(FILE *f, const struct trace_buffer *b,
+		    const struct trace_record *r, int *first)
+{
+	const char *ph = "i";
+
+	if (r->type == TRACE_PARSER_WAIT)
+		ph = "B";
+	else if (r->type == TRACE_PARSER_WAKE)
+		ph = "E";
+
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%d,%s\"args\":{\"instance\":%d,"
+		"\"arg\":%" PRIi32 ",\"value\":%" PRIi64 "}}",
+		*first ? "" : ",", trace_names[r->type], ph, r->time / 1e3,
+		getpid(), b->tid, *ph == 'i' ? "\"s\":\"t\"," : "",
+		r->instance, r->arg, r->value);
+
+	*first = 0;
+}
+
+int
+trace_export(const char *path)
+{
+	int count = MIN(atomic_load(&trace_buffer_count), TRACE_MAX_THREADS);
+	int first = 1;
+	FILE *f;
+
+	f = fopen(path, "we");
+	if (!f) {
+		err("failed to open %s: %m", path);
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (int n = 0; n < count; n++) {
+		const struct trace_buffer *b = trace_buffers[n];
+		unsigned int head, tail;
+
+		if (!b)
+			continue;
+
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", getpid(), b->tid, b->name);
+		first = 0;
+
+		head = atomic_load(&b->head);
+		tail = head > TRACE_RECORDS ? head - TRACE_RECORDS : 0;
+
+		for (; tail != head; tail++)
+			trace_export_record(f, b,
+					    &b->records[tail & (TRACE_RECORDS - 1)],
+					    &first);
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f)) {
+		err("failed to write %s: %m", path);
+		return -1;
+	}
+
+	info("trace written to %s", path);
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Event tracing header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_TRACE_H
+#define INCLUDE_TRACE_H
+
+#include <stdint.h>
+
+enum trace_type {
+	TRACE_QBUF_OUTPUT,	/* index, pts */
+	TRACE_DQBUF_OUTPUT,	/* index */
+	TRACE_QBUF_CAPTURE,	/* index */
+	TRACE_DQBUF_CAPTURE,	/* index, pts */
+	TRACE_EVENT,		/* event type */
+	TRACE_SHOW,		/* index, pts */
+	TRACE_DROP,		/* index, pts */
+	TRACE_PRESENTED,	/* index, presentation time */
+	TRACE_RELEASED,		/* index */
+	TRACE_PARSER_WAIT,	/* begins a wait for an OUTPUT buffer */
+	TRACE_PARSER_WAKE,	/* ends it */
+	TRACE_TYPE_COUNT
+};
+
+/* Fixed size record, kept in a ring per thread */
+struct trace_record {
+	uint64_t time;		/* monotonic ns */
+	uint16_t type;
+	int16_t instance;
+	int32_t arg;
+	int64_t value;
+};
+
+/* Records kept per thread, the oldest are overwritten */
+#define TRACE_RECORDS		(1 << 15)
+
+extern int trace_enabled;
+
+/* Enable tracing, also mirroring each record to the ftrace marker when
+ * marker is set */
+int trace_init(int marker);
+
+/* Name the calling thread in the exported trace */
+void trace_thread(const char *fmt, ...);
+
+void trace_record(int instance, enum trace_type type, int32_t arg,
+		  int64_t value);
+
+static inline void
+trace(int instance, enum trace_type type, int32_t arg, int64_t value)
+{
+	if (trace_enabled)
+		trace_record(instance, type, arg, value);
+}
+
+/* Write the records of all the threads in the Chrome JSON trace format,
+ * which Perfetto and chrome://tracing load */
+int trace_export(const char *path);
+
+#endif /* INCLUDE_TRACE_H */
@@ -0,0 +1,586 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder library
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include <media/msm_vidc.h>
+
+#include "common.h"
+#include "video.h"
+#include "v4l2dec.h"
+
+#define DBG_TAG "v4ldec"
+
+#define V4L2DEC_DEFAULT_DEVICE	"/dev/video32"
+
+/* Capture buffers when the decoder does not tell its minimum */
+#define V4L2DEC_MIN_CAPTURE	4
+
+/* Frames the application holds at most, when not told */
+#define V4L2DEC_HELD_FRAMES	4
+
+/* Size assumed for the stream buffers when the frame size is unknown */
+#define V4L2DEC_DEFAULT_WIDTH	1920
+#define V4L2DEC_DEFAULT_HEIGHT	1080
+
+/* Bounds of the stream buffer size, as for the application */
+#define V4L2DEC_INPUT_MIN	(64 * 1024)
+#define V4L2DEC_INPUT_MAX	(16 * 1024 * 1024)
+
+/* The frame ids tell the capture setup, which changes on a resolution
+ * change, and the buffer index */
+#define FRAME_ID(group, index)	((uint32_t)(group) << 8 | (index))
+#define FRAME_GROUP(id)		((int)((id) >> 8))
+#define FRAME_INDEX(id)		((int)((id) & 0xff))
+
+/* A frame still held by the application after its capture setup was
+ * replaced, its dmabuf is closed once released */
+struct orphan {
+	uint32_t id;
+	int fd;
+	struct list_head link;
+};
+
+struct v4l2dec {
+	struct instance inst;
+	struct v4l2dec_config config;
+
+	int held[MAX_CAP_BUF];		/* frames of the current setup */
+	struct list_head orphans;
+
+	int draining;
+	int eos;
+};
+
+static int
+dec_capture_count(struct v4l2dec *dec)
+{
+	int count = video_min_capture_buffers(&dec->inst);
+
+	if (count <= 0)
+		count = V4L2DEC_MIN_CAPTURE;
+
+	return MIN(count + dec->config.held_frames, MAX_CAP_BUF);
+}
+
+/* Set up the capture queue for the current size, the frames held by the
+ * application keep their dmabuf until released */
+static int
+dec_restart_capture(struct v4l2dec *dec)
+{
+	struct instance *i = &dec->inst;
+	struct video *vid = &i->video;
+	struct orphan *o;
+
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		if (!dec->held[n])
+			continue;
+
+		dec->held[n] = 0;
+
+		o = malloc(sizeof (*o));
+		if (!o) {
+			video_detach_capture_buffer(i, n);
+			continue;
+		}
+
+		o->id = FRAME_ID(i->group, n);
+		o->fd = video_take_capture_buffer(i, n);
+		list_add_tail(&o->link, &dec->orphans);
+	}
+
+	i->group++;
+
+	if (vid->cap_buf_cnt > 0 && video_release_capture(i))
+		return -1;
+
+	if (video_setup_capture(i, dec_capture_count(dec), i->width,
+				i->height))
+		return -1;
+
+	if (video_stream(i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			 VIDIOC_STREAMON))
+		return -1;
+
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		if (video_queue_buf_cap(i, n))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+dec_handle_event(struct v4l2dec *dec)
+{
+	struct instance *i = &dec->inst;
+	struct v4l2_event event;
+	unsigned int *ptr;
+	int ret;
+
+	ret = video_dequeue_event(i, &event);
+	if (ret < 0)
+		return ret;
+
+	ptr = (unsigned int *)event.u.data;
+
+	switch (event.type) {
+	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT:
+		i->height = ptr[0];
+		i->width = ptr[1];
+
+		if (ptr[2] & V4L2_EVENT_BITDEPTH_FLAG)
+			i->depth = ptr[3] == MSM_VIDC_BIT_DEPTH_10 ? 10 : 8;
+
+		info("resolution changed to %dx%d, %d-bit", i->width,
+		     i->height, i->depth);
+
+		i->reconfigure_pending = 1;
+		i->video.reconfigures++;
+		perf_reconfigure(i);
+
+		/* the capture queue is set up again once flushed */
+		video_flush(i, V4L2_QCOM_CMD_FLUSH_CAPTURE);
+		break;
+
+	case V4L2_EVENT_MSM_VIDC_FLUSH_DONE:
+		if (!i->reconfigure_pending)
+			break;
+
+		i->reconfigure_pending = 0;
+		if (dec_restart_capture(dec))
+			return -EIO;
+		break;
+
+	case V4L2_EVENT_MSM_VIDC_SYS_ERROR:
+		err("decoder system error");
+		i->video.sys_errors++;
+		return -EIO;
+
+	case V4L2_EVENT_MSM_VIDC_HW_OVERLOAD:
+		i->video.hw_overloads++;
+		perf_overload(i);
+		break;
+
+	case V4L2_EVENT_MSM_VIDC_HW_UNSUPPORTED:
+		err("stream not supported by the decoder");
+		i->video.hw_unsupported++;
+		return -ENOTSUP;
+
+	default:
+		dbg("event %x", event.type);
+		break;
+	}
+
+	return 0;
+}
+
+static void
+dec_describe_frame(struct v4l2dec *dec, int n, uint32_t flags,
+		   struct timeval tv, const struct extradata_info *extradata,
+		   struct v4l2dec_frame *f)
+{
+	struct instance *i = &dec->inst;
+	struct video *vid = &i->video;
+
+	memset(f, 0, sizeof (*f));
+
+	f->id = FRAME_ID(i->group, n);
+	f->fd = vid->cap_buf_fd[n];
+	video_drm_format(vid->cap_buf_format, &f->format, &f->modifier);
+	f->width = vid->cap_w;
+	f->height = vid->cap_h;
+
+	f->n_planes = vid->cap_planes_count;
+	for (int p = 0; p < vid->cap_planes_count; p++) {
+		f->offsets[p] = vid->cap_plane_off[p];
+		f->strides[p] = vid->cap_plane_stride[p];
+	}
+
+	f->crop_w = MIN(i->width, vid->cap_w);
+	f->crop_h = MIN(i->height, vid->cap_h);
+	f->ar_x = 1;
+	f->ar_y = 1;
+
+	if (extradata->flags & EXTRADATA_CROP) {
+		f->crop_x = extradata->crop_x;
+		f->crop_y = extradata->crop_y;
+		f->crop_w = extradata->crop_w;
+		f->crop_h = extradata->crop_h;
+	}
+
+	if (extradata->flags & EXTRADATA_ASPECT_RATIO) {
+		f->ar_x = extradata->ar_x;
+		f->ar_y = extradata->ar_y;
+	}
+
+	if ((extradata->flags & EXTRADATA_INTERLACE) &&
+	    extradata->interlace != MSM_VIDC_INTERLACE_FRAME_PROGRESSIVE)
+		f->flags |= V4L2DEC_FRAME_INTERLACED;
+	if (flags & V4L2_BUF_FLAG_KEYFRAME)
+		f->flags |= V4L2DEC_FRAME_KEY;
+	if (flags & V4L2_QCOM_BUF_DATA_CORRUPT)
+		f->flags |= V4L2DEC_FRAME_CORRUPT;
+
+	if (flags & V4L2_QCOM_BUF_TIMESTAMP_INVALID)
+		f->pts = V4L2DEC_PTS_NONE;
+	else
+		f->pts = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	f->depth = i->depth ? i->depth : 8;
+}
+
+static int
+dec_handle_capture(struct v4l2dec *dec)
+{
+	struct instance *i = &dec->inst;
+	const struct extradata_info *extradata;
+	struct v4l2dec_frame frame;
+	unsigned int bytesused;
+	struct timeval tv;
+	uint32_t flags;
+	int n, ret;
+
+	ret = video_dequeue_capture(i, &n, &bytesused, &flags, &tv,
+				    &extradata);
+	if (ret < 0)
+		return ret;
+
+	/* the frames decoded before a resolution change are dropped */
+	if (bytesused > 0 && !i->reconfigure_pending) {
+		i->video.total_captured++;
+		dec_describe_frame(dec, n, flags, tv, extradata, &frame);
+		dec->held[n] = 1;
+		dec->config.frame(dec, &frame, dec->config.opaque);
+	} else if (!i->reconfigure_pending) {
+		video_queue_buf_cap(i, n);
+	}
+
+	if (flags & V4L2_QCOM_BUF_FLAG_EOS) {
+		dbg("end of stream");
+		dec->eos = 1;
+	}
+
+	return 0;
+}
+
+static int
+dec_handle_output(struct v4l2dec *dec)
+{
+	int n, ret;
+
+	ret = video_dequeue_output(&dec->inst, &n);
+	if (ret < 0)
+		return ret;
+
+	/* the session is single threaded, the buffer is free right away */
+	dec->inst.video.out_buf_flag[n] = 0;
+
+	return 0;
+}
+
+int
+v4l2dec_process(struct v4l2dec *dec)
+{
+	struct pollfd pfd = {
+		.fd = dec->inst.video.fd,
+		.events = POLLIN | POLLOUT | POLLPRI,
+	};
+	int ret;
+
+	while (!dec->eos) {
+		ret = poll(&pfd, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* POLLERR alone is only an empty queue */
+		if (!(pfd.revents & (POLLIN | POLLOUT | POLLPRI)))
+			break;
+
+		/* each ready queue is drained, the device is non blocking */
+		if (pfd.revents & POLLPRI) {
+			while (!(ret = dec_handle_event(dec)))
+				;
+			if (ret != -ENOENT)
+				return ret;
+		}
+
+		if (pfd.revents & POLLOUT) {
+			while (!(ret = dec_handle_output(dec)))
+				;
+			if (ret != -EAGAIN)
+				return ret;
+		}
+
+		if (pfd.revents & POLLIN) {
+			while (!dec->eos && !(ret = dec_handle_capture(dec)))
+				;
+			if (ret < 0 && ret != -EAGAIN)
+				return ret;
+		}
+	}
+
+	return dec->eos;
+}
+
+void
+v4l2dec_release(struct v4l2dec *dec, uint32_t id)
+{
+	struct instance *i = &dec->inst;
+	struct orphan *o;
+	int n = FRAME_INDEX(id);
+
+	if (FRAME_GROUP(id) == i->group && n < MAX_CAP_BUF &&
+	    dec->held[n]) {
+		dec->held[n] = 0;
+
+		/* the buffer is queued again with the new setup */
+		if (!i->reconfigure_pending && !dec->eos)
+			video_queue_buf_cap(i, n);
+		return;
+	}
+
+	list_for_each_entry(o, &dec->orphans, link) {
+		if (o->id == id) {
+			close(o->fd);
+			list_del(&o->link);
+			free(o);
+			return;
+		}
+	}
+
+	err("released unknown frame %08x", id);
+}
+
+int
+v4l2dec_get_input(struct v4l2dec *dec, void **data, size_t *size)
+{
+	struct video *vid = &dec->inst.video;
+	int n;
+
+	if (dec->draining)
+		return -EPIPE;
+
+	n = video_get_buf_out(&dec->inst);
+	if (n < 0)
+		return -EAGAIN;
+
+	*data = vid->out_buf_addr[n];
+	*size = vid->out_buf_size;
+
+	return n;
+}
+
+int
+v4l2dec_queue_input(struct v4l2dec *dec, int index, size_t size,
+		    uint64_t pts)
+{
+	struct video *vid = &dec->inst.video;
+	struct timeval tv = { 0 };
+	uint32_t flags = 0;
+
+	if (index < 0 || index >= vid->out_buf_cnt ||
+	    vid->out_buf_flag[index] || size > (size_t)vid->out_buf_size)
+		return -EINVAL;
+
+	if (pts == V4L2DEC_PTS_NONE) {
+		flags |= V4L2_QCOM_BUF_TIMESTAMP_INVALID;
+	} else {
+		tv.tv_sec = pts / 1000000;
+		tv.tv_usec = pts % 1000000;
+	}
+
+	if (video_queue_buf_out(&dec->inst, index, size, flags, tv) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+int
+v4l2dec_feed(struct v4l2dec *dec, const void *data, size_t size,
+	     uint64_t pts)
+{
+	size_t room;
+	void *dst;
+	int n;
+
+	n = v4l2dec_get_input(dec, &dst, &room);
+	if (n < 0)
+		return n;
+
+	if (size > room) {
+		err("access unit too big (size=%zu) for stream buffer", size);
+		return -E2BIG;
+	}
+
+	memcpy(dst, data, size);
+
+	return v4l2dec_queue_input(dec, n, size, pts);
+}
+
+int
+v4l2dec_drain(struct v4l2dec *dec)
+{
+	struct timeval tv = { 0 };
+	int n;
+
+	if (dec->draining)
+		return 0;
+
+	n = video_get_buf_out(&dec->inst);
+	if (n < 0)
+		return -EAGAIN;
+
+	if (video_queue_buf_out(&dec->inst, n, 0,
+				V4L2_QCOM_BUF_FLAG_EOS |
+				V4L2_QCOM_BUF_TIMESTAMP_INVALID, tv) < 0)
+		return -EIO;
+
+	dec->draining = 1;
+
+	return 0;
+}
+
+int
+v4l2dec_get_fd(struct v4l2dec *dec)
+{
+	return dec->inst.video.fd;
+}
+
+/* Size the stream buffers, a compressed frame is at most half the raw
+ * frame */
+static void
+dec_input_size(struct v4l2dec *dec, unsigned int *size,
+	       unsigned int *slab_size)
+{
+	struct instance *i = &dec->inst;
+	size_t max = dec->config.max_input_size;
+
+	if (!max)
+		max = (size_t)i->width * i->height * 3 / 4;
+
+	*size = MIN(MAX(max, V4L2DEC_INPUT_MIN), V4L2DEC_INPUT_MAX);
+	*slab_size = 3 * *size;
+}
+
+struct v4l2dec *
+v4l2dec_open(const struct v4l2dec_config *config)
+{
+	unsigned int size, slab_size;
+	struct v4l2dec *dec;
+	struct instance *i;
+
+	if (!config->frame) {
+		err("no frame callback");
+		return NULL;
+	}
+
+	debug_level = config->log_level;
+
+	/* the rings of the instance are cache line aligned, more than
+	 * malloc() guarantees */
+	if (posix_memalign((void **)&dec, _Alignof(struct v4l2dec),
+			   sizeof (*dec)))
+		return NULL;
+	memset(dec, 0, sizeof (*dec));
+
+	dec->config = *config;
+	if (!dec->config.held_frames)
+		dec->config.held_frames = V4L2DEC_HELD_FRAMES;
+	INIT_LIST_HEAD(&dec->orphans);
+
+	i = &dec->inst;
+	i->video.name = (char *)(config->device ? config->device :
+				 V4L2DEC_DEFAULT_DEVICE);
+	i->video.extradata_index = -1;
+	i->video.extradata_ion_fd = -1;
+	i->fourcc = config->codec;
+	i->width = config->width ? config->width : V4L2DEC_DEFAULT_WIDTH;
+	i->height = config->height ? config->height : V4L2DEC_DEFAULT_HEIGHT;
+	i->fps_n = config->fps_n;
+	i->fps_d = config->fps_d;
+	i->decode_order = config->decode_order;
+	i->ubwc = config->compressed;
+	i->ubwc_10bit = config->compressed;
+	i->secure = config->secure;
+	i->perf.mode = PERF_AUTO;
+	INIT_LIST_HEAD(&i->fb_list);
+
+	for (int n = 0; n < MAX_CAP_BUF; n++)
+		i->video.cap_buf_fd[n] = -1;
+
+	if (video_open(i, i->video.name))
+		goto fail;
+
+	if (video_subscribe_events(i))
+		goto fail;
+
+	if (i->secure && video_set_secure(i))
+		goto fail;
+
+	dec_input_size(dec, &size, &slab_size);
+
+	if (video_setup_output(i, i->fourcc, size, slab_size, MAX_OUT_BUF))
+		goto fail;
+
+	if (video_set_control(i))
+		goto fail;
+
+	if (video_stream(i, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			 VIDIOC_STREAMON))
+		goto fail;
+
+	if (dec_restart_capture(dec))
+		goto fail;
+
+	return dec;
+
+fail:
+	v4l2dec_close(dec);
+	return NULL;
+}
+
+void
+v4l2dec_close(struct v4l2dec *dec)
+{
+	struct instance *i = &dec->inst;
+	struct orphan *o, *next;
+
+	if (i->video.fd > 0) {
+		if (i->video.out_buf_cnt > 0)
+			video_stop_output(i);
+		if (i->video.cap_buf_cnt > 0)
+			video_stop_capture(i);
+		video_close(i);
+	}
+
+	list_for_each_entry_safe(o, next, &dec->orphans, link) {
+		close(o->fd);
+		free(o);
+	}
+
+	free(dec);
+}
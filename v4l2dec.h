@@ -0,0 +1,139 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder library header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef INCLUDE_V4L2DEC_H
+#define INCLUDE_V4L2DEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hardware decoding session, driven from a single thread of the
+ * application:
+ *
+ *  - compressed access units are fed with v4l2dec_feed(), or written in
+ *    place in a stream buffer from v4l2dec_get_input()
+ *  - the session fd is polled, v4l2dec_process() then handles what the
+ *    decoder has done without blocking, and hands out the decoded
+ *    frames to the frame callback
+ *  - the frames stay owned by the application, which reads them from
+ *    their dmabuf, until v4l2dec_release()
+ *
+ * All the functions returning an int return a negative errno on error.
+ */
+struct v4l2dec;
+
+#define V4L2DEC_PTS_NONE	((uint64_t)-1)
+
+/* Frame flags */
+#define V4L2DEC_FRAME_KEY	(1 << 0)
+#define V4L2DEC_FRAME_INTERLACED	(1 << 1)
+#define V4L2DEC_FRAME_CORRUPT	(1 << 2)
+
+struct v4l2dec_frame {
+	uint32_t id;		/* to give to v4l2dec_release() */
+
+	/* the dmabuf holding the frame, valid until the frame is
+	 * released, to be duplicated to keep it longer */
+	int fd;
+	uint32_t format;	/* DRM_FORMAT_NV12 or DRM_FORMAT_P010 */
+	uint64_t modifier;	/* DRM format modifier */
+	int width, height;	/* of the buffer */
+	int n_planes;
+	uint32_t offsets[2];
+	uint32_t strides[2];
+
+	/* visible rectangle and sample aspect ratio */
+	int crop_x, crop_y, crop_w, crop_h;
+	int ar_x, ar_y;
+
+	uint64_t pts;		/* us, as fed, or V4L2DEC_PTS_NONE */
+	uint32_t flags;		/* V4L2DEC_FRAME_* */
+	int depth;		/* bits per sample */
+};
+
+typedef void (*v4l2dec_frame_cb)(struct v4l2dec *dec,
+				 const struct v4l2dec_frame *frame,
+				 void *opaque);
+
+struct v4l2dec_config {
+	const char *device;	/* NULL for /dev/video32 */
+	uint32_t codec;		/* V4L2 pixel format of the stream */
+	int width, height;	/* expected size, 0 if unknown */
+	int fps_n, fps_d;	/* 0 if unknown */
+
+	/* largest access unit fed, 0 to size it from the frame size */
+	size_t max_input_size;
+
+	/* frames the application holds at most at the same time, on top
+	 * of those the decoder needs, 0 for a default */
+	int held_frames;
+
+	int decode_order;	/* frames out in decode order */
+	int compressed;		/* UBWC frames allowed */
+	int secure;
+	int log_level;		/* 0 for errors only, up to 5 */
+
+	v4l2dec_frame_cb frame;
+	void *opaque;
+};
+
+/* Open a session, returns NULL on error */
+struct v4l2dec *v4l2dec_open(const struct v4l2dec_config *config);
+
+/* Close a session, the frames not released are closed too */
+void v4l2dec_close(struct v4l2dec *dec);
+
+/* Get the fd to poll for POLLIN, POLLOUT and POLLPRI, before calling
+ * v4l2dec_process() */
+int v4l2dec_get_fd(struct v4l2dec *dec);
+
+/* Queue an access unit, copied into a stream buffer. Returns -EAGAIN
+ * when none is free, v4l2dec_process() frees them once decoded. */
+int v4l2dec_feed(struct v4l2dec *dec, const void *data, size_t size,
+		 uint64_t pts);
+
+/* Get a stream buffer to write an access unit into, returns its index
+ * or -EAGAIN when none is free */
+int v4l2dec_get_input(struct v4l2dec *dec, void **data, size_t *size);
+
+/* Queue a stream buffer from v4l2dec_get_input() holding size bytes */
+int v4l2dec_queue_input(struct v4l2dec *dec, int index, size_t size,
+			uint64_t pts);
+
+/* Signal the end of the stream, the frames still in the decoder are
+ * handed out before v4l2dec_process() reports the end */
+int v4l2dec_drain(struct v4l2dec *dec);
+
+/* Handle the events, stream buffers and frames the decoder is done
+ * with, without blocking. Returns 1 once the stream end was drained. */
+int v4l2dec_process(struct v4l2dec *dec);
+
+/* Give a frame back to the decoder */
+void v4l2dec_release(struct v4l2dec *dec, uint32_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDE_V4L2DEC_H */
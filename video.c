@@ -37,13 +37,21 @@
 #include <media/msm_vidc.h>
 
 #include "common.h"
+#include "video.h"
 
 #define DBG_TAG "   vid"
 
+/* Owned by the decoder, which is also built as a library */
+int debug_level;
+
 #define CASE(ENUM) case ENUM: return #ENUM;
 
 #define EXTRADATA_IDX(__num_planes) ((__num_planes) ? (__num_planes) - 1 : 0)
 
+/* Alignment of the stream buffers packed in the OUTPUT slab */
+#define OUT_BUF_ALIGN	4096
+#define OUT_ALIGN(x)	(((x) + OUT_BUF_ALIGN - 1) & ~(OUT_BUF_ALIGN - 1))
+
 static const struct {
 	uint32_t mask;
 	const char *str;
@@ -267,7 +275,8 @@ int video_open(struct instance *i, char *name)
 {
 	struct v4l2_capability cap;
 
-	i->video.fd = open(name, O_RDWR, 0);
+	/* the queues are drained until empty on each wakeup */
+	i->video.fd = open(name, O_RDWR | O_NONBLOCK, 0);
 	if (i->video.fd < 0) {
 		err("Failed to open video decoder: %s", name);
 		return -1;
@@ -348,9 +357,12 @@ int video_open(struct instance *i, char *name)
         return 0;
 }
 
+static void arena_destroy(struct video *vid);
+
 void video_close(struct instance *i)
 {
 	close(i->video.fd);
+	arena_destroy(&i->video);
 }
 
 int video_set_secure(struct instance *i)
@@ -368,6 +380,37 @@ int video_set_secure(struct instance *i)
 	return 0;
 }
 
+int video_set_pictype_decode(struct instance *i, int on)
+{
+	struct v4l2_control control = {0};
+
+	control.id = V4L2_CID_MPEG_VIDC_VIDEO_PICTYPE_DEC_MODE;
+	control.value = on ? V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_ON :
+		V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_OFF;
+
+	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
+		err("failed to set skip mode: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+int video_set_perf_level(struct instance *i, int level)
+{
+	struct v4l2_control control = {0};
+
+	control.id = V4L2_CID_MPEG_VIDC_SET_PERF_LEVEL;
+	control.value = level;
+
+	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
+		err("failed to set perf level: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
 int video_set_control(struct instance *i)
 {
 	struct v4l2_control control = {0};
@@ -382,15 +425,8 @@ int video_set_control(struct instance *i)
 		}
 	}
 
-	if (i->skip_frames) {
-		control.id = V4L2_CID_MPEG_VIDC_VIDEO_PICTYPE_DEC_MODE;
-		control.value = V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_ON;
-
-		if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
-			err("failed to set skip mode: %m");
-			return -1;
-		}
-	}
+	if (i->skip_frames && video_set_pictype_decode(i, 1) < 0)
+		return -1;
 
 	control.id = V4L2_CID_MPEG_VIDC_VIDEO_CONTINUE_DATA_TRANSFER;
 	control.value = i->continue_data_transfer;
@@ -400,13 +436,8 @@ int video_set_control(struct instance *i)
 		return -1;
 	}
 
-	control.id = V4L2_CID_MPEG_VIDC_SET_PERF_LEVEL;
-	control.value = V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO;
-
-	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
-		err("failed to set perf level: %m");
+	if (perf_init(i) < 0)
 		return -1;
-	}
 
 	control.id = V4L2_CID_MPEG_VIDC_VIDEO_CONCEAL_COLOR;
 	control.value = 0x00ff;
@@ -462,14 +493,28 @@ int video_set_control(struct instance *i)
 	return 0;
 }
 
-int video_set_dpb(struct instance *i,
+int video_min_capture_buffers(struct instance *i)
+{
+	struct v4l2_control control = {0};
+
+	control.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+
+	if (ioctl(i->video.fd, VIDIOC_G_CTRL, &control) < 0) {
+		err("failed to get minimum capture buffers: %m");
+		return -1;
+	}
+
+	return control.value;
+}
+
+int video_set_dpb(struct instance *i, int mode,
 		  enum v4l2_mpeg_vidc_video_dpb_color_format format)
 {
 	struct v4l2_ext_control control[2] = {0};
 	struct v4l2_ext_controls controls = {0};
 
 	control[0].id = V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_MODE;
-	control[0].value = V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_PRIMARY;
+	control[0].value = mode;
 
 	control[1].id = V4L2_CID_MPEG_VIDC_VIDEO_DPB_COLOR_FORMAT;
 	control[1].value = format;
@@ -506,7 +551,8 @@ int video_set_framerate(struct instance *i, int num, int den)
 }
 
 static int
-check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
+parse_extradata_payload(enum msm_vidc_extradata_type type, void *data,
+			int size, struct extradata_info *info)
 {
 	switch (type) {
 	case MSM_VIDC_EXTRADATA_OUTPUT_CROP: {
@@ -524,6 +570,12 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 		    payload->top, payload->left,
 		    payload->display_width, payload->display_height,
 		    payload->width, payload->height);
+
+		info->crop_x = payload->left;
+		info->crop_y = payload->top;
+		info->crop_w = payload->display_width;
+		info->crop_h = payload->display_height;
+		info->flags |= EXTRADATA_CROP;
 		break;
 	}
 
@@ -539,6 +591,10 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 		dbg("extradata: %s aspect_width=%u aspect_height=%u",
 		    extradata_type_to_string(type),
 		    payload->aspect_width, payload->aspect_height);
+
+		info->ar_x = payload->aspect_width;
+		info->ar_y = payload->aspect_height;
+		info->flags |= EXTRADATA_ASPECT_RATIO;
 		break;
 	}
 
@@ -555,6 +611,9 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 		    extradata_type_to_string(type),
 		    extradata_interlace_format_to_string(payload->format),
 		    extradata_interlace_color_format_to_string(payload->color_format));
+
+		info->interlace = payload->format;
+		info->flags |= EXTRADATA_INTERLACE;
 		break;
 	}
 
@@ -582,6 +641,27 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 		    payload->nWhitePointY,
 		    payload->nMaxDisplayMasteringLuminance,
 		    payload->nMinDisplayMasteringLuminance);
+
+		info->mastering = *payload;
+		info->flags |= EXTRADATA_MASTERING_DISPLAY;
+		break;
+	}
+
+	case MSM_VIDC_EXTRADATA_CONTENT_LIGHT_LEVEL_SEI: {
+		struct msm_vidc_content_light_level_sei_payload *payload = data;
+
+		if (size != sizeof (*payload)) {
+			dbg("extradata: Invalid data size for %s",
+			    extradata_type_to_string(type));
+			return -1;
+		}
+
+		dbg("extradata: %s nMaxContentLight=%u nMaxPicAverageLight=%u",
+		    extradata_type_to_string(type),
+		    payload->nMaxContentLight, payload->nMaxPicAverageLight);
+
+		info->light_level = *payload;
+		info->flags |= EXTRADATA_LIGHT_LEVEL;
 		break;
 	}
 
@@ -600,6 +680,9 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 		dbg("extradata: %s frame_rate=%.3f",
 		    extradata_type_to_string(type),
 		    (float)framerate_num / (float)framerate_den);
+
+		info->frame_rate = payload->frame_rate;
+		info->flags |= EXTRADATA_FRAME_RATE;
 		break;
 	}
 
@@ -612,14 +695,17 @@ check_extradata_payload(enum msm_vidc_extradata_type type, void *data, int size)
 	return 0;
 }
 
-bool
-extradata_header_is_valid(const struct msm_vidc_extradata_header *hdr, int size)
+int
+extradata_parse(const struct msm_vidc_extradata_header *hdr, int size,
+		struct extradata_info *info)
 {
 	unsigned int left;
 	int ret;
 
+	memset(info, 0, sizeof (*info));
+
 	if (!hdr || size < 0)
-		return false;
+		return -1;
 
 	left = size;
 
@@ -627,43 +713,27 @@ extradata_header_is_valid(const struct msm_vidc_extradata_header *hdr, int size)
 	       hdr->type != MSM_VIDC_EXTRADATA_NONE) {
 		if (hdr->type == MSM_VIDC_EXTRADATA_INDEX) {
 			struct msm_vidc_extradata_index *payload = (void *)hdr->data;
-			ret = check_extradata_payload(payload->type,
+			ret = parse_extradata_payload(payload->type,
 						      (void *)hdr->data + sizeof (hdr->type),
-						      hdr->data_size - sizeof (hdr->type));
+						      hdr->data_size - sizeof (hdr->type),
+						      info);
 		} else {
-			ret = check_extradata_payload(hdr->type,
+			ret = parse_extradata_payload(hdr->type,
 						      (void *)hdr->data,
-						      hdr->data_size);
+						      hdr->data_size, info);
 		}
 
-		if (ret)
-			return false;
-
-		left -= hdr->size;
-		hdr = (void *)hdr + hdr->size;
-	}
-
-	return true;
-}
-
-void *
-extradata_header_find(const struct msm_vidc_extradata_header *hdr, int type)
-{
-	while (hdr && hdr->type != MSM_VIDC_EXTRADATA_NONE) {
-		if (hdr->type == (unsigned)type)
-			return (void *)hdr->data;
-
-		if (hdr->type == MSM_VIDC_EXTRADATA_INDEX) {
-			struct msm_vidc_extradata_index *payload =
-				(void *)hdr->data;
-			if (type == (int)payload->type)
-				return (void *)hdr->data + sizeof (hdr->type);
+		/* a header with a zero size would never end the walk */
+		if (ret || !hdr->size) {
+			memset(info, 0, sizeof (*info));
+			return -1;
 		}
 
+		left -= hdr->size;
 		hdr = (void *)hdr + hdr->size;
 	}
 
-	return NULL;
+	return 0;
 }
 
 static int video_count_capture_queued_bufs(struct video *vid)
@@ -690,6 +760,58 @@ static int video_count_output_queued_bufs(struct video *vid)
 	return out_queued;
 }
 
+int video_get_buf_out(struct instance *i)
+{
+	struct video *vid = &i->video;
+	int size = OUT_ALIGN(vid->out_buf_size);
+	int head = vid->out_head;
+	int idx = -1, oldest = -1, queued = 0;
+
+	for (int n = 0; n < vid->out_buf_cnt; n++) {
+		if (!vid->out_buf_flag[n]) {
+			if (idx < 0)
+				idx = n;
+			continue;
+		}
+
+		queued++;
+		if (oldest < 0 ||
+		    (int32_t)(vid->out_buf_seq[n] - vid->out_buf_seq[oldest]) < 0)
+			oldest = n;
+	}
+
+	if (idx < 0 || (vid->out_max_queued && queued >= vid->out_max_queued))
+		return -1;
+
+	/*
+	 * The buffers in use are between the start of the oldest one and
+	 * the head, wrapping at the end of the slab. A new buffer must have
+	 * room for the largest frame; the head never catches up with the
+	 * oldest buffer so that both ends are never equal on a full slab.
+	 */
+	if (oldest < 0) {
+		head = 0;
+	} else {
+		int tail = vid->out_buf_off[oldest];
+
+		if (head > tail) {
+			if (vid->out_ion_size - head < size) {
+				if (tail <= size)
+					return -1;
+				head = 0;
+			}
+		} else if (tail - head <= size) {
+			return -1;
+		}
+	}
+
+	vid->out_head = head;
+	vid->out_buf_off[idx] = head;
+	vid->out_buf_addr[idx] = (char *)vid->out_ion_addr + head;
+
+	return idx;
+}
+
 int video_queue_buf_out(struct instance *i, int n, int length,
 			uint32_t flags, struct timeval timestamp)
 {
@@ -697,6 +819,7 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	enum v4l2_buf_type type;
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[1];
+	int queued;
 
 	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 
@@ -714,9 +837,11 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	buf.length = 1;
 	buf.m.planes = planes;
 
-	buf.m.planes[0].m.userptr = (unsigned long)vid->out_ion_addr;
+	/* the address and fd are those of the arena region */
+	buf.m.planes[0].m.userptr = (unsigned long)
+		((char *)vid->out_ion_addr - vid->out_ion_off);
 	buf.m.planes[0].reserved[0] = vid->out_ion_fd;
-	buf.m.planes[0].reserved[1] = vid->out_buf_off[n];
+	buf.m.planes[0].reserved[1] = vid->out_ion_off + vid->out_buf_off[n];
 	buf.m.planes[0].length = vid->out_buf_size;
 	buf.m.planes[0].bytesused = length;
 	buf.m.planes[0].data_offset = 0;
@@ -724,18 +849,39 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	buf.flags = flags;
 	buf.timestamp = timestamp;
 
+	/* mark the buffer before queuing it, the decoder may be done with
+	 * it before the ioctl returns */
+	vid->out_buf_flag[n] = 1;
+	vid->out_buf_seq[n] = vid->out_seq++;
+
+	trace(i->id, TRACE_QBUF_OUTPUT, n,
+	      (int64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec);
+
 	if (ioctl(vid->fd, VIDIOC_QBUF, &buf) < 0) {
 		err("failed to queue %s buffer (index=%d): %m",
 		    buf_type_to_string(buf.type), buf.index);
+		vid->out_buf_flag[n] = 0;
 		return -1;
 	}
 
+	/* the next buffer is packed right after this one */
+	vid->out_head = vid->out_buf_off[n] + OUT_ALIGN(MAX(length, 1));
+
+	queued = video_count_output_queued_bufs(vid);
+	if (queued > vid->peak_out_queued)
+		vid->peak_out_queued = queued;
+
+	vid->out_queued = queued;
+	vid->out_queued_sum += queued;
+	vid->out_queued_samples++;
+	vid->bytes_queued += length;
+
 	dbg("%s: queued buffer %d (flags:%08x:%s, bytesused:%d, "
 	    "ts: %ld.%06lu), %d/%d queued", buf_type_to_string(buf.type),
 	    buf.index, buf.flags, buf_flags_to_string(buf.flags),
 	    buf.m.planes[0].bytesused,
 	    buf.timestamp.tv_sec, buf.timestamp.tv_usec,
-	    video_count_output_queued_bufs(vid), vid->out_buf_cnt);
+	    queued, vid->out_buf_cnt);
 
 	return 0;
 }
@@ -746,6 +892,7 @@ int video_queue_buf_cap(struct instance *i, int n)
 	enum v4l2_buf_type type;
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[2];
+	int queued;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
@@ -773,7 +920,8 @@ int video_queue_buf_cap(struct instance *i, int n)
 	buf.m.planes[0].data_offset = 0;
 
 	if (vid->extradata_index) { // Should be 1
-		buf.m.planes[vid->extradata_index].m.userptr = (unsigned long)vid->extradata_ion_addr;
+		buf.m.planes[vid->extradata_index].m.userptr = (unsigned long)
+			((char *)vid->extradata_ion_addr - vid->extradata_ion_off);
 		buf.m.planes[vid->extradata_index].reserved[0] = vid->extradata_ion_fd;
 		buf.m.planes[vid->extradata_index].reserved[1] = vid->extradata_off[n];
 		buf.m.planes[vid->extradata_index].length = vid->extradata_size;
@@ -781,6 +929,8 @@ int video_queue_buf_cap(struct instance *i, int n)
 		buf.m.planes[vid->extradata_index].data_offset = 0;
 	}
 
+	trace(i->id, TRACE_QBUF_CAPTURE, n, 0);
+
 	if (ioctl(vid->fd, VIDIOC_QBUF, &buf) < 0) {
 		err("failed to queue %s buffer (index=%d): %m",
 		    buf_type_to_string(buf.type), buf.index);
@@ -789,8 +939,16 @@ int video_queue_buf_cap(struct instance *i, int n)
 
 	vid->cap_buf_flag[n] = 1;
 
+	queued = video_count_capture_queued_bufs(vid);
+	if (queued > vid->peak_cap_queued)
+		vid->peak_cap_queued = queued;
+
+	vid->cap_queued = queued;
+	vid->cap_queued_sum += queued;
+	vid->cap_queued_samples++;
+
 	dbg("%s: queued buffer %d, %d/%d queued", buf_type_to_string(buf.type),
-	    buf.index, video_count_capture_queued_bufs(vid), vid->cap_buf_cnt);
+	    buf.index, queued, vid->cap_buf_cnt);
 
 	return 0;
 }
@@ -802,19 +960,26 @@ static int video_dequeue_buf(struct instance *i, struct v4l2_buffer *buf)
 
 	ret = ioctl(vid->fd, VIDIOC_DQBUF, buf);
 	if (ret < 0) {
-		err("failed to dequeue buffer on %s queue: %m",
-		    buf_type_to_string(buf->type));
-		return -errno;
+		ret = -errno;
+		if (ret != -EAGAIN)
+			err("failed to dequeue buffer on %s queue: %m",
+			    buf_type_to_string(buf->type));
+		return ret;
 	}
 
 	switch (buf->type) {
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+		trace(i->id, TRACE_DQBUF_OUTPUT, buf->index, 0);
 		dbg("%s: dequeued buffer %d, %d/%d queued",
 		    buf_type_to_string(buf->type), buf->index,
 		    video_count_output_queued_bufs(vid), vid->out_buf_cnt);
 		break;
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
 		vid->cap_buf_flag[buf->index] = 0;
+		vid->cap_queued = video_count_capture_queued_bufs(vid);
+		trace(i->id, TRACE_DQBUF_CAPTURE, buf->index,
+		      (int64_t)buf->timestamp.tv_sec * 1000000 +
+		      buf->timestamp.tv_usec);
 		dbg("%s: dequeued buffer %d (flags:%08x:%s, bytesused:%d, "
 		    "ts: %ld.%06lu), %d/%d queued",
 		    buf_type_to_string(buf->type),
@@ -851,13 +1016,13 @@ int video_dequeue_output(struct instance *i, int *n)
 
 int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 			  uint32_t *flags, struct timeval *ts,
-			  struct msm_vidc_extradata_header **extradata)
+			  const struct extradata_info **extradata)
 {
 	struct video *vid = &i->video;
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[CAP_PLANES];
-	void *extradata_addr;
-	bool extradata_valid;
+	struct extradata_info *info;
+	int ret;
 
 	memzero(buf);
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -865,8 +1030,9 @@ int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 	buf.m.planes = planes;
 	buf.length = CAP_PLANES;
 
-	if (video_dequeue_buf(i, &buf))
-		return -1;
+	ret = video_dequeue_buf(i, &buf);
+	if (ret < 0)
+		return ret;
 
 	*bytesused = buf.m.planes[0].bytesused;
 	*n = buf.index;
@@ -876,17 +1042,15 @@ int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 	if (ts)
 		*ts = buf.timestamp;
 
-	extradata_addr = NULL;
-	if (vid->extradata_index >= 0)
-		extradata_addr = vid->extradata_addr[buf.index];
-
-	extradata_valid = false;
-	if (extradata_addr)
-		extradata_valid = extradata_header_is_valid(extradata_addr,
-							    vid->extradata_size);
+	/* the metadata is parsed once here, the rest only reads it */
+	info = &vid->extradata_info[buf.index];
+	if (vid->extradata_index < 0 ||
+	    extradata_parse(vid->extradata_addr[buf.index],
+			    vid->extradata_size, info) < 0)
+		memset(info, 0, sizeof (*info));
 
 	if (extradata)
-		*extradata = extradata_valid ? extradata_addr : NULL;
+		*extradata = info;
 
 	return 0;
 }
@@ -932,22 +1096,35 @@ int video_flush(struct instance *i, uint32_t flags)
 	return 0;
 }
 
+/* The ion device is shared by all the decoding instances */
+static int ion_fd = -1;
+static pthread_once_t ion_once = PTHREAD_ONCE_INIT;
+
+static void ion_open(void)
+{
+	ion_fd = open("/dev/ion", O_RDONLY | O_CLOEXEC);
+	if (ion_fd < 0)
+		err("Cannot open ion device: %m");
+}
+
+static void ion_account(struct video *vid, size_t size)
+{
+	vid->ion_bytes += size;
+	if (vid->ion_bytes > vid->peak_ion_bytes)
+		vid->peak_ion_bytes = vid->ion_bytes;
+}
+
 static int
 alloc_ion_buffer(struct instance *i, size_t size, uint32_t flags)
 {
 	struct ion_allocation_data ion_alloc = { 0 };
 	struct ion_fd_data ion_fd_data = { 0 };
 	struct ion_handle_data ion_handle_data = { 0 };
-	static int ion_fd = -1;
 	int ret;
 
-	if (ion_fd < 0) {
-		ion_fd = open("/dev/ion", O_RDONLY);
-		if (ion_fd < 0) {
-			err("Cannot open ion device: %m");
-			return -1;
-		}
-	}
+	pthread_once(&ion_once, ion_open);
+	if (ion_fd < 0)
+		return -1;
 
 	ion_alloc.handle = -1;
 	ion_alloc.len = size;
@@ -978,6 +1155,7 @@ alloc_ion_buffer(struct instance *i, size_t size, uint32_t flags)
 		ret = -1;
 	} else {
 		ret = ion_fd_data.fd;
+		ion_account(&i->video, size);
 	}
 
 	ion_handle_data.handle = ion_alloc.handle;
@@ -987,33 +1165,453 @@ alloc_ion_buffer(struct instance *i, size_t size, uint32_t flags)
 	return ret;
 }
 
+/*
+ * ION arena: the buffers the CPU reads or writes, the OUTPUT slab and
+ * the capture extradata, are chunks of a few large regions, allocated
+ * and mapped once and reused across the decoder restarts, rather than
+ * allocations of their own. The capture buffers are not part of it, each
+ * is exported on its own to the compositor or the library user.
+ */
+#define ION_ARENA_GRANULE	(1024 * 1024)
+#define ION_CHUNK_ALIGN		4096
+#define ION_ALIGN(x, a)		(((x) + (a) - 1) / (a) * (a))
+
+static int region_alloc(struct instance *i, struct ion_region *r, size_t size)
+{
+	struct video *vid = &i->video;
+	void *addr;
+	int fd;
+
+	fd = alloc_ion_buffer(i, size, 0);
+	if (fd < 0)
+		return -1;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		err("failed to map ion arena region: %m");
+		close(fd);
+		vid->ion_bytes -= size;
+		return -1;
+	}
+
+	r->fd = fd;
+	r->addr = addr;
+	r->size = size;
+	r->chunk_count = 0;
+	vid->arena.size += size;
+
+	dbg("ion arena region of %zu bytes, %zu bytes in total", size,
+	    vid->arena.size);
+
+	return 0;
+}
+
+static void region_release(struct video *vid, struct ion_region *r)
+{
+	if (munmap(r->addr, r->size))
+		err("failed to unmap ion arena region: %m");
+	if (close(r->fd) < 0)
+		err("failed to close ion arena region: %m");
+
+	vid->ion_bytes -= r->size;
+	vid->arena.size -= r->size;
+	memset(r, 0, sizeof (*r));
+}
+
+/* First fit in the gaps between the chunks, -1 if none is large enough */
+static ssize_t region_fit(const struct ion_region *r, size_t size)
+{
+	size_t end = 0;
+
+	if (r->chunk_count == ION_REGION_CHUNKS)
+		return -1;
+
+	for (int n = 0; n < r->chunk_count; n++) {
+		if (r->chunks[n].offset - end >= size)
+			return end;
+		end = r->chunks[n].offset + r->chunks[n].size;
+	}
+
+	return r->size - end >= size ? (ssize_t)end : -1;
+}
+
+/* Get a chunk of size bytes, returns its address, the fd of its region
+ * and its offset in the region */
+static void *arena_alloc(struct instance *i, size_t size, int *fd,
+			 size_t *offset)
+{
+	struct ion_arena *arena = &i->video.arena;
+	struct ion_region *r = NULL;
+	ssize_t off = -1;
+	int n;
+
+	size = ION_ALIGN(size, ION_CHUNK_ALIGN);
+
+	for (n = 0; n < ION_ARENA_REGIONS && off < 0; n++) {
+		r = &arena->regions[n];
+		if (r->size)
+			off = region_fit(r, size);
+	}
+
+	if (off < 0) {
+		/* the regions left empty are too small, they make room for
+		 * a larger one */
+		r = NULL;
+		for (n = 0; n < ION_ARENA_REGIONS; n++) {
+			struct ion_region *e = &arena->regions[n];
+
+			if (e->size && !e->chunk_count)
+				region_release(&i->video, e);
+			if (!e->size && !r)
+				r = e;
+		}
+
+		if (!r) {
+			err("no room left in the ion arena for %zu bytes", size);
+			return NULL;
+		}
+
+		if (region_alloc(i, r, ION_ALIGN(size, ION_ARENA_GRANULE)))
+			return NULL;
+		off = 0;
+	}
+
+	/* the chunks are kept sorted by offset */
+	for (n = r->chunk_count; n > 0 && r->chunks[n - 1].offset > (size_t)off;
+	     n--)
+		r->chunks[n] = r->chunks[n - 1];
+
+	r->chunks[n].offset = off;
+	r->chunks[n].size = size;
+	r->chunk_count++;
+	arena->used += size;
+
+	*fd = r->fd;
+	*offset = off;
+
+	return (char *)r->addr + off;
+}
+
+/* Give a chunk back, its region stays allocated for the next ones */
+static void arena_free(struct video *vid, void *addr)
+{
+	struct ion_arena *arena = &vid->arena;
+
+	for (int n = 0; n < ION_ARENA_REGIONS; n++) {
+		struct ion_region *r = &arena->regions[n];
+		size_t off = (char *)addr - (char *)r->addr;
+
+		if (!r->size || (char *)addr < (char *)r->addr ||
+		    off >= r->size)
+			continue;
+
+		for (int c = 0; c < r->chunk_count; c++) {
+			if (r->chunks[c].offset != off)
+				continue;
+
+			arena->used -= r->chunks[c].size;
+			r->chunk_count--;
+			memmove(&r->chunks[c], &r->chunks[c + 1],
+				(r->chunk_count - c) * sizeof (r->chunks[c]));
+			return;
+		}
+	}
+
+	err("freeing unknown ion arena chunk %p", addr);
+}
+
+static void arena_destroy(struct video *vid)
+{
+	for (int n = 0; n < ION_ARENA_REGIONS; n++) {
+		if (vid->arena.regions[n].size)
+			region_release(vid, &vid->arena.regions[n]);
+	}
+
+	vid->arena.used = 0;
+}
+
 static int setup_extradata(struct instance *i, int index, int size)
 {
 	struct video *vid = &i->video;
-	int off = 0;
+	size_t total = (size_t)size * vid->cap_buf_cnt;
+	char *addr;
 
 	vid->extradata_index = index;
 	vid->extradata_size = size;
 
-	if (vid->extradata_ion_fd < 0) {
-		vid->extradata_ion_fd = alloc_ion_buffer(i, size * MAX_CAP_BUF, 0);
-		vid->extradata_ion_addr = mmap(NULL,
-					       size * MAX_CAP_BUF,
-					       PROT_READ|PROT_WRITE,
-					       MAP_SHARED,
-					       vid->extradata_ion_fd,
-					       0);
-
-		for (int i = 0; i < MAX_CAP_BUF; i++) {
-			vid->extradata_off[i] = off;
-			vid->extradata_addr[i] = vid->extradata_ion_addr + off;
-			off += size;
+	/* a slot per capture buffer, the chunk is kept while large
+	 * enough */
+	if (vid->extradata_ion_addr && vid->extradata_ion_size < total) {
+		arena_free(vid, vid->extradata_ion_addr);
+		vid->extradata_ion_addr = NULL;
+	}
+
+	if (!vid->extradata_ion_addr) {
+		vid->extradata_ion_addr = arena_alloc(i, total,
+						      &vid->extradata_ion_fd,
+						      &vid->extradata_ion_off);
+		if (!vid->extradata_ion_addr) {
+			vid->extradata_index = -1;
+			return -1;
+		}
+		vid->extradata_ion_size = total;
+	}
+
+	addr = vid->extradata_ion_addr;
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		vid->extradata_off[n] = vid->extradata_ion_off + n * size;
+		vid->extradata_addr[n] = addr + n * size;
+	}
+
+	return 0;
+}
+
+static void free_capture_buffer(struct video *vid, int n)
+{
+	if (!vid->cap_buf_alloc[n])
+		return;
+
+	if (vid->cap_buf_addr[n] &&
+	    munmap(vid->cap_buf_addr[n], vid->cap_buf_alloc[n]))
+		err("failed to unmap capture buffer %d: %m", n);
+
+	if (close(vid->cap_buf_fd[n]) < 0)
+		err("failed to close capture ion buffer %d: %m", n);
+
+	vid->ion_bytes -= vid->cap_buf_alloc[n];
+	vid->cap_buf_fd[n] = -1;
+	vid->cap_buf_addr[n] = NULL;
+	vid->cap_buf_alloc[n] = 0;
+}
+
+static int alloc_capture_buffer(struct instance *i, int n, size_t size)
+{
+	struct video *vid = &i->video;
+	uint32_t ion_flags;
+	void *buf_addr;
+	int ion_fd;
+
+	if (i->secure)
+		ion_flags = ION_FLAG_SECURE | ION_FLAG_CP_PIXEL;
+	else
+		ion_flags = 0;
+
+	ion_fd = alloc_ion_buffer(i, size, ion_flags);
+	if (ion_fd < 0)
+		return -1;
+
+	if (!i->secure) {
+		buf_addr = mmap(NULL, size, PROT_READ, MAP_SHARED, ion_fd, 0);
+		if (buf_addr == MAP_FAILED) {
+			err("failed to map capture buffer %d: %m", n);
+			close(ion_fd);
+			vid->ion_bytes -= size;
+			return -1;
+		}
+	} else {
+		buf_addr = NULL;
+	}
+
+	vid->cap_buf_fd[n] = ion_fd;
+	vid->cap_buf_addr[n] = buf_addr;
+	vid->cap_buf_alloc[n] = size;
+
+	return 0;
+}
+
+/* Make sure the first count capture buffers have at least size bytes,
+ * reusing the existing buffers that are large enough */
+static int fit_capture_buffers(struct instance *i, int count, size_t size)
+{
+	struct video *vid = &i->video;
+	int reused = 0, allocated = 0;
+
+	for (int n = 0; n < MAX_CAP_BUF; n++) {
+		if (n >= count) {
+			free_capture_buffer(vid, n);
+			continue;
 		}
+
+		if (vid->cap_buf_alloc[n] >= size) {
+			reused++;
+			continue;
+		}
+
+		free_capture_buffer(vid, n);
+
+		if (alloc_capture_buffer(i, n, size))
+			return -1;
+
+		allocated++;
 	}
 
+	dbg("capture buffers of %zu bytes: %d reused, %d allocated",
+	    size, reused, allocated);
+
 	return 0;
 }
 
+static uint32_t capture_pixelformat(struct instance *i)
+{
+	/* the frames are written out or checked linear */
+	int linear = i->dump_path || i->checksum_path;
+
+	if (i->depth == 10)
+		return linear || !i->ubwc_10bit ? V4L2_PIX_FMT_P010 :
+			V4L2_PIX_FMT_NV12_TP10_UBWC;
+
+	/* interlaced frames cannot be compressed */
+	if (linear || !i->ubwc || i->interlaced)
+		return V4L2_PIX_FMT_NV12;
+
+	return V4L2_PIX_FMT_NV12_UBWC;
+}
+
+/* Keep the reference frames compressed, saving memory bandwidth, even
+ * when the frames are output linear */
+static void setup_dpb(struct instance *i, uint32_t pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_NV12_UBWC:
+		video_set_dpb(i, V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_PRIMARY,
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_NONE);
+		break;
+	case V4L2_PIX_FMT_NV12_TP10_UBWC:
+		video_set_dpb(i, V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_PRIMARY,
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_TP10_UBWC);
+		break;
+	case V4L2_PIX_FMT_P010:
+		video_set_dpb(i, V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_SECONDARY,
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_TP10_UBWC);
+		break;
+	default:
+		if (!i->interlaced &&
+		    !video_set_dpb(i,
+				   V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_SECONDARY,
+				   V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_UBWC))
+			break;
+
+		video_set_dpb(i, V4L2_CID_MPEG_VIDC_VIDEO_STREAM_OUTPUT_PRIMARY,
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_NONE);
+		break;
+	}
+}
+
+/*
+ * UBWC planes are made of the compression metadata followed by the
+ * compressed pixels, each part 4096 bytes aligned, as in the
+ * msm_media_info.h layout of the Venus firmware. The planes are
+ * exported from the start of their metadata, with the pixel stride.
+ */
+#define UBWC_ALIGN(x, a)	(((x) + (a) - 1) / (a) * (a))
+#define UBWC_DIV(x, d)		(((x) + (d) - 1) / (d))
+
+static int setup_ubwc_planes(struct video *vid,
+			     const struct v4l2_pix_format_mplane *pix,
+			     int tp10)
+{
+	unsigned int w = pix->width, h = pix->height;
+	unsigned int y_stride, y_lines, uv_lines, uv_off, size;
+	unsigned int y_meta_stride, y_meta_lines;
+	unsigned int uv_meta_stride, uv_meta_lines;
+
+	if (tp10) {
+		/* three 10-bit samples packed in 32 bits */
+		y_stride = UBWC_ALIGN(UBWC_ALIGN(w, 192) * 4 / 3, 256);
+		y_lines = UBWC_ALIGN(h, 16);
+		uv_lines = UBWC_ALIGN((h + 1) / 2, 16);
+		y_meta_stride = UBWC_ALIGN(UBWC_DIV(w, 48), 64);
+		y_meta_lines = UBWC_ALIGN(UBWC_DIV(h, 4), 16);
+		uv_meta_stride = UBWC_ALIGN(UBWC_DIV((w + 1) / 2, 24), 64);
+		uv_meta_lines = UBWC_ALIGN(UBWC_DIV((h + 1) / 2, 4), 16);
+	} else {
+		y_stride = UBWC_ALIGN(w, 128);
+		y_lines = UBWC_ALIGN(h, 32);
+		uv_lines = UBWC_ALIGN((h + 1) / 2, 32);
+		y_meta_stride = UBWC_ALIGN(UBWC_DIV(w, 32), 64);
+		y_meta_lines = UBWC_ALIGN(UBWC_DIV(h, 8), 16);
+		uv_meta_stride = UBWC_ALIGN(UBWC_DIV((w + 1) / 2, 16), 64);
+		uv_meta_lines = UBWC_ALIGN(UBWC_DIV((h + 1) / 2, 8), 16);
+	}
+
+	/* the driver knows better, when it tells */
+	if (pix->plane_fmt[0].bytesperline)
+		y_stride = pix->plane_fmt[0].bytesperline;
+	if (pix->plane_fmt[0].reserved[0])
+		y_lines = pix->plane_fmt[0].reserved[0];
+
+	uv_off = UBWC_ALIGN(y_meta_stride * y_meta_lines, 4096) +
+		UBWC_ALIGN(y_stride * y_lines, 4096);
+	size = uv_off + UBWC_ALIGN(uv_meta_stride * uv_meta_lines, 4096) +
+		UBWC_ALIGN(y_stride * uv_lines, 4096);
+
+	dbg("  ubwc: meta %dx%d and %dx%d, uv plane at %d, %d lines",
+	    y_meta_stride, y_meta_lines, uv_meta_stride, uv_meta_lines,
+	    uv_off, uv_lines);
+
+	if (size > pix->plane_fmt[0].sizeimage) {
+		err("ubwc layout of %d bytes does not fit in %d bytes", size,
+		    pix->plane_fmt[0].sizeimage);
+		return -1;
+	}
+
+	vid->cap_planes_count = 2;
+	vid->cap_plane_off[0] = 0;
+	vid->cap_plane_stride[0] = y_stride;
+	vid->cap_plane_off[1] = uv_off;
+	vid->cap_plane_stride[1] = y_stride;
+
+	return 0;
+}
+
+int video_prepare_capture(struct instance *i, int num_buffers, int w, int h)
+{
+	struct video *vid = &i->video;
+	struct v4l2_format fmt;
+	struct v4l2_pix_format_mplane *pix;
+
+	memzero(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	pix = &fmt.fmt.pix_mp;
+	pix->height = h;
+	pix->width = w;
+	pix->pixelformat = capture_pixelformat(i);
+
+	if (ioctl(vid->fd, VIDIOC_TRY_FMT, &fmt) < 0) {
+		err("failed to try %s format (%dx%d)",
+		    buf_type_to_string(fmt.type), w, h);
+		return -1;
+	}
+
+	return fit_capture_buffers(i, num_buffers,
+				   pix->plane_fmt[0].sizeimage);
+}
+
+void video_detach_capture_buffer(struct instance *i, int n)
+{
+	free_capture_buffer(&i->video, n);
+}
+
+int video_take_capture_buffer(struct instance *i, int n)
+{
+	struct video *vid = &i->video;
+	int fd = vid->cap_buf_fd[n];
+
+	if (!vid->cap_buf_alloc[n])
+		return -1;
+
+	if (vid->cap_buf_addr[n] &&
+	    munmap(vid->cap_buf_addr[n], vid->cap_buf_alloc[n]))
+		err("failed to unmap capture buffer %d: %m", n);
+
+	vid->ion_bytes -= vid->cap_buf_alloc[n];
+	vid->cap_buf_fd[n] = -1;
+	vid->cap_buf_addr[n] = NULL;
+	vid->cap_buf_alloc[n] = 0;
+
+	return fd;
+}
+
 int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 {
 	struct video *vid = &i->video;
@@ -1021,29 +1619,18 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	struct v4l2_format fmt;
 	struct v4l2_pix_format_mplane *pix;
 	struct v4l2_requestbuffers reqbuf;
-	int ion_fd;
-	uint32_t ion_flags;
-	void *buf_addr;
 	int n, extra_idx;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
-	video_set_dpb(i, i->depth == 10 ?
-		      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_TP10_UBWC :
-		      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_NONE);
+	setup_dpb(i, capture_pixelformat(i));
 
 	memzero(fmt);
 	fmt.type = type;
 	pix = &fmt.fmt.pix_mp;
 	pix->height = h;
 	pix->width = w;
-
-	if (i->depth == 10)
-		pix->pixelformat = V4L2_PIX_FMT_NV12_TP10_UBWC;
-	else if (!i->interlaced)
-		pix->pixelformat = V4L2_PIX_FMT_NV12_UBWC;
-	else
-		pix->pixelformat = V4L2_PIX_FMT_NV12;
+	pix->pixelformat = capture_pixelformat(i);
 
 	if (ioctl(vid->fd, VIDIOC_S_FMT, &fmt) < 0) {
 		err("failed to set %s format (%dx%d)",
@@ -1093,6 +1680,7 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 
 	switch (vid->cap_buf_format) {
 	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_P010:
 		vid->cap_planes_count = 2;
 		/* Y plane */
 		vid->cap_plane_off[0] = 0;
@@ -1102,42 +1690,22 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 			pix->plane_fmt[0].bytesperline;
 		vid->cap_plane_stride[1] = pix->plane_fmt[0].bytesperline;
 		break;
+	case V4L2_PIX_FMT_NV12_UBWC:
+	case V4L2_PIX_FMT_NV12_TP10_UBWC:
+		if (!setup_ubwc_planes(vid, pix, vid->cap_buf_format ==
+				       V4L2_PIX_FMT_NV12_TP10_UBWC))
+			break;
+		/* fall through */
 	default:
-		/* the driver does not provide enough information to compute
-		 * the plane offsets for some formats like UBWC, so just use
-		 * a single plane. */
+		/* unknown layout, so just use a single plane */
 		vid->cap_planes_count = 1;
 		vid->cap_plane_off[0] = 0;
 		vid->cap_plane_stride[0] = pix->plane_fmt[0].bytesperline;
 		break;
 	}
 
-	if (i->secure)
-		ion_flags = ION_FLAG_SECURE | ION_FLAG_CP_PIXEL;
-	else
-		ion_flags = 0;
-
-	for (n = 0; n < vid->cap_buf_cnt; n++) {
-		ion_fd = alloc_ion_buffer(i, vid->cap_buf_size, ion_flags);
-		if (ion_fd < 0)
-			return -1;
-
-		if (!i->secure) {
-			buf_addr = mmap(NULL, vid->cap_buf_size, PROT_READ,
-					MAP_SHARED, ion_fd, 0);
-			if (buf_addr == MAP_FAILED) {
-				err("failed to map %s buffer: %m",
-				    buf_type_to_string(type));
-				close(ion_fd);
-				return -1;
-			}
-		} else {
-			buf_addr = NULL;
-		}
-
-		vid->cap_buf_fd[n] = ion_fd;
-		vid->cap_buf_addr[n] = buf_addr;
-	}
+	if (fit_capture_buffers(i, vid->cap_buf_cnt, vid->cap_buf_size))
+		return -1;
 
 	dbg("%s: succesfully mmapped %d buffers", buf_type_to_string(type),
 	    vid->cap_buf_cnt);
@@ -1147,14 +1715,15 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 		dbg("%s: extradata plane is %d (size=%d)",
 		    buf_type_to_string(type), extra_idx,
 		    pix->plane_fmt[extra_idx].sizeimage);
-		setup_extradata(i, extra_idx,
-				pix->plane_fmt[extra_idx].sizeimage);
+		if (setup_extradata(i, extra_idx,
+				    pix->plane_fmt[extra_idx].sizeimage))
+			return -1;
 	}
 
 	return 0;
 }
 
-int video_stop_capture(struct instance *i)
+int video_release_capture(struct instance *i)
 {
 	struct video *vid = &i->video;
 	enum v4l2_buf_type type;
@@ -1175,19 +1744,8 @@ int video_stop_capture(struct instance *i)
 		return -1;
 	}
 
-	for (int n = 0; n < vid->cap_buf_cnt; n++) {
-		if (munmap(vid->cap_buf_addr[n], vid->cap_buf_size))
-			err("failed to unmap %s buffer: %m",
-			    buf_type_to_string(type));
-
-		if (close(vid->cap_buf_fd[n]) < 0)
-			err("failed to close %s ion buffer: %m",
-			    buf_type_to_string(type));
-
-		vid->cap_buf_fd[n] = -1;
-		vid->cap_buf_addr[n] = NULL;
+	for (int n = 0; n < vid->cap_buf_cnt; n++)
 		vid->cap_buf_flag[n] = 0;
-	}
 
 	vid->cap_planes_count = 0;
 	vid->cap_buf_size = 0;
@@ -1196,15 +1754,26 @@ int video_stop_capture(struct instance *i)
 	return 0;
 }
 
+int video_stop_capture(struct instance *i)
+{
+	int ret;
+
+	ret = video_release_capture(i);
+
+	for (int n = 0; n < MAX_CAP_BUF; n++)
+		free_capture_buffer(&i->video, n);
+
+	return ret;
+}
+
 int video_setup_output(struct instance *i, unsigned long codec,
-		       unsigned int size, int count)
+		       unsigned int size, unsigned int slab_size, int count)
 {
 	struct video *vid = &i->video;
 	enum v4l2_buf_type type;
 	struct v4l2_format fmt;
 	struct v4l2_pix_format_mplane *pix;
 	struct v4l2_requestbuffers reqbuf;
-	int ion_fd;
 	int ion_size;
 	void *buf_addr;
 	int n;
@@ -1217,6 +1786,8 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	pix->width = i->width;
 	pix->height = i->height;
 	pix->pixelformat = codec;
+	pix->num_planes = OUT_PLANES;
+	pix->plane_fmt[0].sizeimage = size;
 
 	video_set_framerate(i, i->fps_n, i->fps_d);
 
@@ -1229,6 +1800,7 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	    pix->plane_fmt[0].sizeimage, size);
 
 	vid->out_buf_size = pix->plane_fmt[0].sizeimage;
+	vid->out_fourcc = codec;
 
 	memzero(reqbuf);
 	reqbuf.count = count;
@@ -1246,30 +1818,27 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	dbg("%s: requested %d buffers, got %d", buf_type_to_string(type),
 	    count, reqbuf.count);
 
-	ion_size = vid->out_buf_cnt * vid->out_buf_size;
-	ion_fd = alloc_ion_buffer(i, ion_size, 0);
-	if (ion_fd < 0)
-		return -1;
-
-	buf_addr = mmap(NULL, ion_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			ion_fd, 0);
-	if (buf_addr == MAP_FAILED) {
-		err("failed to map %s buffer: %m", buf_type_to_string(type));
+	/* all buffers share one slab, large enough for two of the largest
+	 * frames, which the driver may have rounded up */
+	ion_size = OUT_ALIGN(MAX(slab_size, 2 * OUT_ALIGN(vid->out_buf_size)));
+	buf_addr = arena_alloc(i, ion_size, &vid->out_ion_fd,
+			       &vid->out_ion_off);
+	if (!buf_addr)
 		return -1;
-	}
 
-	vid->out_ion_fd = ion_fd;
 	vid->out_ion_size = ion_size;
 	vid->out_ion_addr = buf_addr;
 
 	for (n = 0; n < vid->out_buf_cnt; n++) {
-		vid->out_buf_off[n] = n * vid->out_buf_size;
-		vid->out_buf_addr[n] = buf_addr + vid->out_buf_off[n];
+		vid->out_buf_off[n] = 0;
+		vid->out_buf_addr[n] = buf_addr;
 		vid->out_buf_flag[n] = 0;
 	}
 
-	dbg("%s: succesfully mmapped %d buffers", buf_type_to_string(type),
-	    vid->out_buf_cnt);
+	vid->out_head = 0;
+
+	dbg("%s: succesfully mmapped %d buffers in %d bytes",
+	    buf_type_to_string(type), vid->out_buf_cnt, ion_size);
 
 	return 0;
 }
@@ -1295,17 +1864,9 @@ int video_stop_output(struct instance *i)
 		return -1;
 	}
 
-	if (vid->out_ion_addr) {
-		if (munmap(vid->out_ion_addr, vid->out_ion_size))
-			err("failed to unmap %s buffer: %m",
-			    buf_type_to_string(type));
-	}
-
-	if (vid->out_ion_fd >= 0) {
-		if (close(vid->out_ion_fd) < 0)
-			err("failed to close %s ion buffer: %m",
-			    buf_type_to_string(type));
-	}
+	/* the slab goes back to the arena, for the next stream */
+	if (vid->out_ion_addr)
+		arena_free(vid, vid->out_ion_addr);
 
 	for (int n = 0; n < vid->out_buf_cnt; n++) {
 		vid->out_buf_flag[n] = 0;
@@ -1315,8 +1876,10 @@ int video_stop_output(struct instance *i)
 
 	vid->out_ion_fd = -1;
 	vid->out_ion_size = 0;
+	vid->out_ion_off = 0;
 	vid->out_ion_addr = NULL;
 	vid->out_buf_cnt = 0;
+	vid->out_head = 0;
 
 	return 0;
 }
@@ -1336,6 +1899,47 @@ int video_subscribe_event(struct instance *i, int event_type)
 	return 0;
 }
 
+static const int event_type[] = {
+	V4L2_EVENT_MSM_VIDC_FLUSH_DONE,
+	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT,
+	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT,
+	V4L2_EVENT_MSM_VIDC_SYS_ERROR,
+	V4L2_EVENT_MSM_VIDC_HW_OVERLOAD,
+	V4L2_EVENT_MSM_VIDC_HW_UNSUPPORTED,
+	V4L2_EVENT_MSM_VIDC_RELEASE_BUFFER_REFERENCE,
+	V4L2_EVENT_MSM_VIDC_RELEASE_UNQUEUED_BUFFER,
+};
+
+int video_subscribe_events(struct instance *i)
+{
+	for (size_t n = 0; n < ARRAY_LENGTH(event_type); n++) {
+		if (video_subscribe_event(i, event_type[n]))
+			return -1;
+	}
+
+	return 0;
+}
+
+void video_drm_format(uint32_t pixelformat, uint32_t *format,
+		      uint64_t *modifier)
+{
+	*format = DRM_FORMAT_NV12;
+	*modifier = DRM_FORMAT_MOD_LINEAR;
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_NV12_UBWC:
+		*modifier = DRM_FORMAT_MOD_QCOM_COMPRESSED;
+		break;
+	case V4L2_PIX_FMT_NV12_TP10_UBWC:
+		*modifier = DRM_FORMAT_MOD_QCOM_COMPRESSED |
+			DRM_FORMAT_MOD_QCOM_DX | DRM_FORMAT_MOD_QCOM_TIGHT;
+		break;
+	case V4L2_PIX_FMT_P010:
+		*format = DRM_FORMAT_P010;
+		break;
+	}
+}
+
 int video_dequeue_event(struct instance *i, struct v4l2_event *ev)
 {
 	struct video *vid = &i->video;
@@ -1343,9 +1947,14 @@ int video_dequeue_event(struct instance *i, struct v4l2_event *ev)
 	memset(ev, 0, sizeof (*ev));
 
 	if (ioctl(vid->fd, VIDIOC_DQEVENT, ev) < 0) {
-		err("failed to dequeue event: %m");
-		return -1;
+		int ret = -errno;
+
+		if (ret != -ENOENT)
+			err("failed to dequeue event: %m");
+		return ret;
 	}
 
+	trace(i->id, TRACE_EVENT, ev->type, 0);
+
 	return 0;
 }
@@ -27,10 +27,16 @@
 #include <linux/videodev2.h>
 #include <media/msm_vidc.h>
 
+/* Linear 10-bit output, missing from the headers of older kernels */
+#ifndef V4L2_PIX_FMT_P010
+#define V4L2_PIX_FMT_P010	v4l2_fourcc('P', '0', '1', '0')
+#endif
+
 struct instance;
 struct fb;
 
-/* Open the video decoder device */
+/* Open the video decoder device, non blocking: the dequeue functions
+ * return -EAGAIN, or -ENOENT for the events, once nothing is ready */
 int video_open(struct instance *i, char *name);
 
 /* Close the video decoder devices */
@@ -39,15 +45,48 @@ void video_close(struct instance *i);
 /* Subscribe to an event on the video device */
 int video_subscribe_event(struct instance *i, int event_type);
 
+/* Subscribe to all the events the decoder is driven by */
+int video_subscribe_events(struct instance *i);
+
+/* Get the DRM format and layout modifier of a capture format */
+void video_drm_format(uint32_t pixelformat, uint32_t *format,
+		      uint64_t *modifier);
+
 /* Setup the OUTPUT queue. The size determines the size for the stream
  * buffer. This is the maximum size a single compressed frame can have.
+ * The stream buffers are packed in a single slab of slab_size bytes.
  * The count is the number of the stream buffers to allocate. */
 int video_setup_output(struct instance *i, unsigned long codec,
-		       unsigned int size, int count);
+		       unsigned int size, unsigned int slab_size, int count);
+
+/* Get a free OUTPUT buffer with room for the largest frame at its
+ * address, or -1 if the slab is full. Must be called from the thread
+ * queuing the OUTPUT buffers. */
+int video_get_buf_out(struct instance *i);
+
+/* Get the minimum number of CAPTURE buffers required by the decoder */
+int video_min_capture_buffers(struct instance *i);
 
-/* Setup the CAPTURE queue. */
+/* Setup the CAPTURE queue. The buffers left from a previous setup are
+ * reused when they are large enough. */
 int video_setup_capture(struct instance *i, int num_buffers, int w, int h);
 
+/* Allocate the CAPTURE buffers missing for a setup with the given
+ * parameters ahead of video_setup_capture() */
+int video_prepare_capture(struct instance *i, int num_buffers, int w, int h);
+
+/* Hand over a CAPTURE buffer to its current user, e.g. the compositor,
+ * so that it is never reused */
+void video_detach_capture_buffer(struct instance *i, int n);
+
+/* Take over the dmabuf of a CAPTURE buffer, which is forgotten like a
+ * detached one. Returns its fd, for the caller to close, or -1. */
+int video_take_capture_buffer(struct instance *i, int n);
+
+/* Stop CAPTURE queue and release buffers, keeping their memory for a
+ * new setup */
+int video_release_capture(struct instance *i);
+
 /* Stop OUTPUT queue and release buffers */
 int video_stop_output(struct instance *i);
 
@@ -68,26 +107,29 @@ int video_stream(struct instance *i, enum v4l2_buf_type type, int status);
 int video_flush(struct instance *i, uint32_t flags);
 
 /* Dequeue a buffer, the structure *buf is used to return the parameters of the
- * dequeued buffer. */
+ * dequeued buffer. Returns -EAGAIN when none is ready. */
 int video_dequeue_output(struct instance *i, int *n);
 int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 			  uint32_t *flags, struct timeval *ts,
-			  struct msm_vidc_extradata_header **extradata);
+			  const struct extradata_info **extradata);
 
-/* Dequeue a pending event */
+/* Dequeue a pending event, returns -ENOENT when none is */
 int video_dequeue_event(struct instance *i, struct v4l2_event *ev);
 
 int video_set_framerate(struct instance *i, int num, int den);
 int video_set_control(struct instance *i);
+int video_set_perf_level(struct instance *i, int level);
+
+/* Decode only the sync frames, when on */
+int video_set_pictype_decode(struct instance *i, int on);
 int video_set_secure(struct instance *i);
-int video_set_dpb(struct instance *i,
+int video_set_dpb(struct instance *i, int mode,
 		  enum v4l2_mpeg_vidc_video_dpb_color_format format);
 
-/* extradata parsing */
-bool extradata_header_is_valid(const struct msm_vidc_extradata_header *hdr,
-			       int size);
-void *extradata_header_find(const struct msm_vidc_extradata_header *hdr,
-			    int type);
+/* Parse the extradata of a frame in a single pass, fails and leaves
+ * info empty if any header is invalid */
+int extradata_parse(const struct msm_vidc_extradata_header *hdr, int size,
+		    struct extradata_info *info);
 
 #endif /* INCLUDE_VIDEO_H */
 